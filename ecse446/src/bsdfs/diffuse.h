@@ -30,11 +30,21 @@ struct DiffuseBSDF : BSDF {
         combinedType = 0;
         for (size_t i = 0; i < components.size(); ++i)
             combinedType |= components[i];
+
+        material.type = EDiffuseBSDF;
+        material.combinedType = combinedType;
+        material.diffuseReflectance = foldTexture(*albedo);
     }
 
     inline float getExponent(const SurfaceInteraction& i) const override { return 1.f; }
 
-    v3f eval(const SurfaceInteraction& i) const override {
+    v3f eval(const SurfaceInteraction& i) const override { return evalKernel(material, i); }
+    float pdf(const SurfaceInteraction& i) const override { return pdfKernel(material, i); }
+    v3f sample(SurfaceInteraction& i, Sampler& sampler, float* pdf) const override {
+        return sampleKernel(material, i, sampler, pdf);
+    }
+
+    static v3f evalKernel(const Material& m, const SurfaceInteraction& i) {
         v3f val(0.f);
 
         // TODO(A2): Implement this
@@ -44,32 +54,27 @@ struct DiffuseBSDF : BSDF {
         // both wi and wo point out from intersection point!!!!
         if (i.wo.z > 0 && i.wi.z > 0)
         {
-            // frameNs : vertices normal interpolation among barycentric coordinates
-            // frameNg : triangle normal
-            v3f localNormal = glm::normalize(i.frameNs.n);
-            val = albedo->eval(worldData, i) / M_PI * i.wi.z;
             // cosTheta = glm::dot( i.wi, localNormal ) == i.wi.z
+            val = m.diffuseReflectance.eval(*m.worldData, i) / M_PI * i.wi.z;
         }
 
         return val;
     }
 
-    float pdf(const SurfaceInteraction& i) const override {
-        float pdf = 0.f;
-
+    static float pdfKernel(const Material& m, const SurfaceInteraction& i) {
         // TODO(A3): Implement this
 
-        return Warp::squareToCosineHemispherePdf(i.wi);;
+        return Warp::squareToCosineHemispherePdf(i.wi);
     }
 
-    v3f sample(SurfaceInteraction& i, Sampler& sampler, float* _pdf) const override {
+    static v3f sampleKernel(const Material& m, SurfaceInteraction& i, Sampler& sampler, float* _pdf) {
         v3f val(0.f);
 
         // TODO(A3): Implement this
         i.wi = normalize(Warp::squareToCosineHemisphere(sampler.next2D()));
 
-        *_pdf = pdf(i);
-        val = eval(i);
+        *_pdf = pdfKernel(m, i);
+        val = evalKernel(m, i);
         return val;
     }
 
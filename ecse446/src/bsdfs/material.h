@@ -0,0 +1,61 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include "bsdfs/diffuse.h"
+#include "bsdfs/phong.h"
+#include "bsdfs/mixture.h"
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Static dispatch of the flat material records to the BSDF kernels.
+ * Mirrors (illum 5) have no offline BSDF and scatter no light.
+ */
+
+inline v3f Material::eval(const SurfaceInteraction& i) const {
+    switch (type) {
+        case EDiffuseBSDF: return DiffuseBSDF::evalKernel(*this, i);
+        case EPhongBSDF: return PhongBSDF::evalKernel(*this, i);
+        case EMixtureBSDF: return MixtureBSDF::evalKernel(*this, i);
+        default: return v3f(0.f);
+    }
+}
+
+/// Reflectance used as a feature (albedo AOV): emitters are clamped to 1
+inline v3f Material::getAlbedo(const SurfaceInteraction& i) const {
+    if (isEmissive()) return glm::min(emission, v3f(1.f));
+    switch (type) {
+        case EDiffuseBSDF: return diffuseReflectance.eval(*worldData, i);
+        case EPhongBSDF:
+        case EMixtureBSDF: return (diffuseReflectance.eval(*worldData, i) + specularReflectance.eval(*worldData, i)) * scale;
+        default: return v3f(0.f);
+    }
+}
+
+inline float Material::pdf(const SurfaceInteraction& i) const {
+    switch (type) {
+        case EDiffuseBSDF: return DiffuseBSDF::pdfKernel(*this, i);
+        case EPhongBSDF: return PhongBSDF::pdfKernel(*this, i);
+        case EMixtureBSDF: return MixtureBSDF::pdfKernel(*this, i);
+        default: return 0.f;
+    }
+}
+
+inline v3f Material::sample(SurfaceInteraction& i, Sampler& sampler, float* pdf) const {
+    switch (type) {
+        case EDiffuseBSDF: return DiffuseBSDF::sampleKernel(*this, i, sampler, pdf);
+        case EPhongBSDF: return PhongBSDF::sampleKernel(*this, i, sampler, pdf);
+        case EMixtureBSDF: return MixtureBSDF::sampleKernel(*this, i, sampler, pdf);
+        default:
+            if (pdf) *pdf = 0.f;
+            return v3f(0.f);
+    }
+}
+
+TR_NAMESPACE_END
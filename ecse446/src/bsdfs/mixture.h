@@ -51,17 +51,31 @@ struct MixtureBSDF : BSDF {
         combinedType = 0;
         for (unsigned int component : components)
             combinedType |= component;
+
+        material.type = EMixtureBSDF;
+        material.combinedType = combinedType;
+        material.diffuseReflectance = foldTexture(*diffuseReflectance);
+        material.specularReflectance = foldTexture(*specularReflectance);
+        material.exponent = mat.shininess;
+        material.scale = scale;
+        material.specularSamplingWeight = specularSamplingWeight;
     }
 
     inline float getExponent(const SurfaceInteraction& i) const override {
         return exponent->eval(worldData, i);
     }
 
-    inline v3f reflect(const v3f& d) const {
+    static inline v3f reflect(const v3f& d) {
         return v3f(-d.x, -d.y, d.z);
     }
 
-    v3f eval(const SurfaceInteraction& i) const override {
+    v3f eval(const SurfaceInteraction& i) const override { return evalKernel(material, i); }
+    float pdf(const SurfaceInteraction& i) const override { return pdfKernel(material, i); }
+    v3f sample(SurfaceInteraction& i, Sampler& sampler, float* pdf) const override {
+        return sampleKernel(material, i, sampler, pdf);
+    }
+
+    static v3f evalKernel(const Material& m, const SurfaceInteraction& i) {
         v3f val(0.f);
 
         // TODO(A5): Implement this
@@ -69,7 +83,7 @@ struct MixtureBSDF : BSDF {
         return val;
     }
 
-    float pdf(const SurfaceInteraction& i) const override {
+    static float pdfKernel(const Material& m, const SurfaceInteraction& i) {
         float pdf = 0.f;
 
         // TODO(A5): Implement this
@@ -77,7 +91,7 @@ struct MixtureBSDF : BSDF {
         return pdf;
     }
 
-    v3f sample(SurfaceInteraction& i, Sampler& sampler, float* pdf) const override {
+    static v3f sampleKernel(const Material& m, SurfaceInteraction& i, Sampler& sampler, float* pdf) {
         v3f val(0.f);
 
         // TODO(A5): Implement this
@@ -52,17 +52,31 @@ struct PhongBSDF : BSDF {
         combinedType = 0;
         for (unsigned int component : components)
             combinedType |= component;
+
+        material.type = EPhongBSDF;
+        material.combinedType = combinedType;
+        material.diffuseReflectance = foldTexture(*diffuseReflectance);
+        material.specularReflectance = foldTexture(*specularReflectance);
+        material.exponent = mat.shininess;
+        material.scale = scale;
+        material.specularSamplingWeight = specularSamplingWeight;
     }
 
     inline float getExponent(const SurfaceInteraction& i) const override {
         return exponent->eval(worldData, i);
     }
 
-    inline v3f reflect(const v3f& d) const {
+    static inline v3f reflect(const v3f& d) {
         return v3f(-d.x, -d.y, d.z);
     }
 
-    v3f eval(const SurfaceInteraction& i) const override {
+    v3f eval(const SurfaceInteraction& i) const override { return evalKernel(material, i); }
+    float pdf(const SurfaceInteraction& i) const override { return pdfKernel(material, i); }
+    v3f sample(SurfaceInteraction& i, Sampler& sampler, float* pdf) const override {
+        return sampleKernel(material, i, sampler, pdf);
+    }
+
+    static v3f evalKernel(const Material& m, const SurfaceInteraction& i) {
         v3f val(0.f);
         // 1. reflectivity/albedo map == color map
         //    BRDF: function about albedo!!!!!!
@@ -103,9 +117,7 @@ struct PhongBSDF : BSDF {
 
         // wo : view vector
         // reflect(wi)  : light reflectance
-        float exp = exponent->eval(worldData, i);
-        v3f diffuseColor = diffuseReflectance->eval(worldData, i) * scale;
-        v3f specularColor = specularReflectance->eval(worldData, i) * scale;
+        float exp = m.exponent;
         // energy conservation : scale, max energy(specularMax + diffuseMax) <= 1.0
 
         if (i.wo.z > 0 && i.wi.z > 0) //front-facing test
@@ -113,6 +125,7 @@ struct PhongBSDF : BSDF {
             float cosAlpha = glm::dot(reflect(i.wi), i.wo );
             float cosTheta = i.wi.z;
             cosAlpha = cosAlpha>0? pow(cosAlpha, exp) : 0;
+            v3f specularColor = m.specularReflectance.eval(*m.worldData, i) * m.scale;
             val = /*diffuseColor * INV_PI + */specularColor * ( exp + 2.f ) * INV_TWOPI * cosAlpha;
             val *= cosTheta; // foreshortening factor
         }
@@ -120,11 +133,11 @@ struct PhongBSDF : BSDF {
         return val;
     }
 
-    float pdf(const SurfaceInteraction& i) const override {
+    static float pdfKernel(const Material& m, const SurfaceInteraction& i) {
         float pdf = 0.f;
 
         // TODO(A3): Implement this
-        float exp = exponent->eval(worldData,i);
+        float exp = m.exponent;
         v3f wr = normalize(i.frameNs.toWorld(reflect(i.wo)));
         Frame lobe(wr);
         v3f dir = lobe.toLocal(i.frameNs.toWorld(i.wi));
@@ -133,24 +146,24 @@ struct PhongBSDF : BSDF {
         return pdf;
     }
 
-    v3f sample(SurfaceInteraction& i, Sampler& sampler, float* _pdf) const override {
+    static v3f sampleKernel(const Material& m, SurfaceInteraction& i, Sampler& sampler, float* _pdf) {
         v3f val(0.f);
 
         // TODO(A3): Implement this
 
-        float exp = exponent->eval(worldData,i);
+        float exp = m.exponent;
         v3f wr = normalize(i.frameNs.toWorld(reflect(i.wo)));
         Frame lobe(wr);
 
         // weighted example:
         //     spec / 60 + diff / 40 = ( spec / (60 / 100) + diff / (40 / 100) ) / 100
 
-        if (sampler.next() <= specularSamplingWeight)
+        if (sampler.next() <= m.specularSamplingWeight)
         {
             v3f dir = lobe.toWorld(Warp::squareToPhongLobe(sampler.next2D(), exp));
             i.wi = normalize(i.frameNs.toLocal(dir));
-            *_pdf = pdf(i);
-            val = eval(i) / specularSamplingWeight;
+            *_pdf = pdfKernel(m, i);
+            val = evalKernel(m, i) / m.specularSamplingWeight;
         }
         else
         {
@@ -159,8 +172,8 @@ struct PhongBSDF : BSDF {
             if (i.wo.z > 0 && i.wi.z > 0)
             {
                 float cosTheta = i.wi.z;
-                val = diffuseReflectance->eval(worldData, i) * scale * INV_PI * cosTheta;
-                val /= (1.0-specularSamplingWeight);
+                val = m.diffuseReflectance.eval(*m.worldData, i) * m.scale * INV_PI * cosTheta;
+                val /= (1.0-m.specularSamplingWeight);
             }
         }
         return val;
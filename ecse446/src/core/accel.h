@@ -122,6 +122,34 @@ struct AcceleratorBVH {
         return true;
     }
 
+    /**
+     * Texture coordinate derivatives at a hit point (Igehy '99): the offset rays are intersected
+     * with the tangent plane, and the offsets are expressed in the triangle's (u,v) parametrization.
+     */
+    static void computeDifferentials(const Ray& ray, SurfaceInteraction& info,
+                                     const v3f& e1, const v3f& e2, const v2f& dst1, const v2f& dst2) {
+        const v3f& n = info.frameNg.n;
+        const float d = glm::dot(n, info.p);
+        const float dnx = glm::dot(n, ray.rxDirection), dny = glm::dot(n, ray.ryDirection);
+        if (std::abs(dnx) < 1e-8f || std::abs(dny) < 1e-8f) return;
+        const v3f dpdx = ray.rxOrigin + ray.rxDirection * ((d - glm::dot(n, ray.rxOrigin)) / dnx) - info.p;
+        const v3f dpdy = ray.ryOrigin + ray.ryDirection * ((d - glm::dot(n, ray.ryOrigin)) / dny) - info.p;
+
+        // Least squares solve of dp = du e1 + dv e2
+        const float a00 = glm::dot(e1, e1), a01 = glm::dot(e1, e2), a11 = glm::dot(e2, e2);
+        const float det = a00 * a11 - a01 * a01;
+        if (std::abs(det) < 1e-20f) return;
+        const float invDet = 1.f / det;
+        auto toST = [&](const v3f& dp) {
+            const float b0 = glm::dot(e1, dp), b1 = glm::dot(e2, dp);
+            const float du = (a11 * b0 - a01 * b1) * invDet;
+            const float dv = (a00 * b1 - a01 * b0) * invDet;
+            return du * dst1 + dv * dst2;
+        };
+        info.dstdx = toST(dpdx);
+        info.dstdy = toST(dpdy);
+    }
+
     /**
      * Efficiently intersect a ray with the scene.
      * Returns a boolean indicating whether there was a hit or not.
@@ -166,6 +194,16 @@ struct AcceleratorBVH {
                 info.frameNs = Frame(glm::normalize(barycentric(n0, n1, n2, info.u, info.v)));
                 info.wo = info.frameNs.toLocal(glm::normalize(-ray.d));
                 info.matID = s.mesh.material_ids[info.primID];
+
+                info.st = info.dstdx = info.dstdy = v2f(0.f);
+                if (idx0.texcoord_index >= 0 && idx1.texcoord_index >= 0 && idx2.texcoord_index >= 0) {
+                    const v2f st0{sa.texcoords[2 * idx0.texcoord_index + 0], sa.texcoords[2 * idx0.texcoord_index + 1]};
+                    const v2f st1{sa.texcoords[2 * idx1.texcoord_index + 0], sa.texcoords[2 * idx1.texcoord_index + 1]};
+                    const v2f st2{sa.texcoords[2 * idx2.texcoord_index + 0], sa.texcoords[2 * idx2.texcoord_index + 1]};
+                    info.st = barycentric(st0, st1, st2, info.u, info.v);
+                    if (ray.hasDifferentials)
+                        computeDifferentials(ray, info, v1 - v0, v2 - v0, st1 - st0, st2 - st0);
+                }
                 return true;
             }
             return false;
@@ -0,0 +1,132 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <core/core.h>
+#include <core/film.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Checkpoint of the final pass of an offline render.
+ * Stores the film (weighted sums and weights), the AOVs and the number of samples taken in each pixel.
+ * Rows are rendered whole with a sampler seeded from the pass seed and their index, so the sampler
+ * state of the remaining rows is given by the seed: resuming renders the unfinished rows only, and
+ * gives the same image as an uninterrupted run (up to the summation order of wide filters).
+ * Integrators filling caches as they render (Integrator::isOrderDependent(), e.g. the irradiance cache)
+ * resume with empty caches, so their remaining rows differ from an uninterrupted run (a warning is printed).
+ */
+struct Checkpoint {
+    std::string filename;
+    int width, height, spp;
+    uint32_t seed;
+    /* Number of samples taken in each pixel (0 or spp, as rows are rendered whole) */
+    std::vector<uint32_t> sampleCounts;
+
+    Checkpoint(const Config& config, uint32_t seed)
+            : filename(getFile(config)), width(config.width), height(config.height), spp(config.spp), seed(seed) {
+        sampleCounts.assign(size_t(width) * height, 0);
+    }
+
+    static std::string getFile(const Config& config) {
+        return getOutputPath(config, "ckpt");
+    }
+
+    bool isRowDone(int y) const {
+        return sampleCounts[size_t(y) * width] == uint32_t(spp);
+    }
+
+    void setRowDone(int y) {
+        std::fill_n(sampleCounts.begin() + size_t(y) * width, width, uint32_t(spp));
+    }
+
+    int getRowsDone() const {
+        int n = 0;
+        for (int y = 0; y < height; y++) n += isRowDone(y);
+        return n;
+    }
+
+    /**
+     * Writes the checkpoint to a temporary file first, so that an interrupted write keeps the previous one.
+     */
+    bool save(const Film& film, const std::vector<AOVBuffer>& aovs, EPixelFilter filter) const {
+        const std::string tmp = filename + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            if (!out) return false;
+            writeHeader(out, aovs, filter);
+            out.write((const char*) sampleCounts.data(), sizeof(uint32_t) * sampleCounts.size());
+            out.write((const char*) &film.rgb.data[0], sizeof(v3f) * width * height);
+            out.write((const char*) film.weights.data(), sizeof(float) * film.weights.size());
+            for (const AOVBuffer& aov : aovs)
+                out.write((const char*) aov.data.data(), sizeof(float) * aov.data.size());
+            if (!out) return false;
+        }
+        try {
+            fs::rename(tmp, filename);
+        } catch (const std::exception& e) {
+            std::cerr << "Could not write checkpoint " << filename << ": " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Restores a checkpoint of the same render (resolution, spp, seed, filter and AOVs).
+     */
+    bool load(Film& film, std::vector<AOVBuffer>& aovs, EPixelFilter filter) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) return false;
+
+        std::ostringstream expected;
+        writeHeader(expected, aovs, filter);
+        const std::string header = expected.str();
+        std::string found(header.size(), '\0');
+        in.read(&found[0], found.size());
+        if (!in || found != header) {
+            std::cerr << "Checkpoint " << filename << " was made with different settings, ignoring it" << std::endl;
+            return false;
+        }
+
+        std::vector<uint32_t> counts(sampleCounts.size());
+        in.read((char*) counts.data(), sizeof(uint32_t) * counts.size());
+        in.read((char*) &film.rgb.data[0], sizeof(v3f) * width * height);
+        in.read((char*) film.weights.data(), sizeof(float) * film.weights.size());
+        for (AOVBuffer& aov : aovs)
+            in.read((char*) aov.data.data(), sizeof(float) * aov.data.size());
+        if (!in) {
+            std::cerr << "Truncated checkpoint " << filename << ", ignoring it" << std::endl;
+            film.rgb.clear();
+            std::fill(film.weights.begin(), film.weights.end(), 0.f);
+            return false;
+        }
+        sampleCounts = counts;
+        return true;
+    }
+
+    void remove() const {
+        std::remove(filename.c_str());
+    }
+
+private:
+    void writeHeader(std::ostream& out, const std::vector<AOVBuffer>& aovs, EPixelFilter filter) const {
+        const uint32_t magic = 0x4b435254; // "TRCK"
+        const int32_t values[] = {width, height, spp, int32_t(seed), int32_t(filter), int32_t(aovs.size())};
+        out.write((const char*) &magic, sizeof(magic));
+        out.write((const char*) values, sizeof(values));
+        for (const AOVBuffer& aov : aovs) {
+            const int32_t type = aov.type;
+            out.write((const char*) &type, sizeof(type));
+        }
+    }
+};
+
+TR_NAMESPACE_END
@@ -8,8 +8,13 @@
 #pragma once
 
 #include <GL/glew.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
 #include "platform.h"
 #include "math.h"
 #include "utils.h"
@@ -61,6 +66,7 @@ enum EBSDF {
     EDiffuseBSDF = 0,
     EMirrorBSDF,
     EPhongBSDF,
+    EMixtureBSDF,
     EBSDFs
 };
 
@@ -97,6 +103,77 @@ enum EPolygonalMethod {
     EPolygonalMethods
 };
 
+/**
+ * Emitter shape, selects how emitters are sampled from a shading point
+ */
+enum EEmitterShape {
+    ESphereEmitter = 0,  // Tessellated sphere: sampled in the cone it subtends
+    EMeshEmitter,        // Arbitrary triangle mesh: sampled by area
+    EEmitterShapes
+};
+
+/**
+ * Sampling of the triangles of mesh emitters from a shading point
+ */
+enum ETriangleSampling {
+    ETriangleArea = 0,              // Uniform area sampling, converted to solid angle
+    ETriangleSolidAngle,            // Uniform spherical triangle sampling (Arvo '95)
+    ETriangleProjectedSolidAngle,   // Spherical triangle warped by the cosine at the vertices
+    ETriangleSamplings
+};
+
+/**
+ * Filtering of bitmap textures
+ */
+enum ETextureFilter {
+    ETextureNearest = 0,    // Nearest texel of the finest level
+    ETextureBilinear,       // Bilinear interpolation on the finest level
+    ETextureTrilinear,      // Bilinear on the two mipmap levels matching the ray footprint
+    ETextureFilters
+};
+
+/**
+ * Pixel reconstruction filters (see Film)
+ */
+enum EPixelFilter {
+    EBoxFilter = 0,         // Average of the samples within the pixel
+    EGaussianFilter,
+    EMitchellFilter,        // Mitchell-Netravali, B = C = 1/3
+    ELanczosFilter,         // Lanczos windowed sinc
+    EPixelFilters
+};
+
+/**
+ * Role of the process in a render farm (see RenderFarm)
+ */
+enum EFarmRole {
+    EFarmNone = 0,          // Renders the whole image alone
+    EFarmCoordinator,       // Renders bands, then merges all of them into the image
+    EFarmWorker             // Renders bands only
+};
+
+/**
+ * Camera projections of offline renders
+ */
+enum ECameraType {
+    EPinholeCamera = 0,
+    EThinLensCamera,        // Depth of field
+    EOrthographicCamera
+};
+
+/**
+ * Auxiliary output variables (AOVs), written as extra layers of the output EXR
+ */
+enum EAOV {
+    EAOVAlbedo = 0,     // Reflectance of the first visible surface
+    EAOVNormal,         // Shading normal of the first visible surface (world space)
+    EAOVDepth,          // Distance to the first visible surface (+inf on misses)
+    EAOVVariance,       // Variance of the pixel estimate (per channel)
+    EAOVSampleCount,    // Number of samples taken in the pixel
+    EAOVTime,           // Time spent rendering the pixel (s)
+    EAOVs
+};
+
 // Forward declarations
 struct Scene;
 struct WorldData;
@@ -166,8 +243,20 @@ struct Ray {
     float min_t;
     /* Maximum distance to walk along the ray while allowing intersections */
     float max_t;
+    /* Auxiliary rays offset by one pixel in x and y (camera rays only), used to filter textures */
+    bool hasDifferentials = false;
+    v3f rxOrigin, ryOrigin;
+    v3f rxDirection, ryDirection;
     Ray(const v3f& co, const v3f& cd, float min_t = Epsilon, float max_t = std::numeric_limits<float>::max())
         : o(co), d(cd), min_t(min_t), max_t(max_t) { }
+
+    /* Shrink the differentials, e.g. by 1/sqrt(spp) when a pixel is covered by several samples */
+    void scaleDifferentials(float scale) {
+        rxOrigin = o + (rxOrigin - o) * scale;
+        ryOrigin = o + (ryOrigin - o) * scale;
+        rxDirection = d + (rxDirection - d) * scale;
+        ryDirection = d + (ryDirection - d) * scale;
+    }
 };
 
 /**
@@ -194,6 +283,42 @@ struct RenderBuffer {
     }
 };
 
+/**
+ * AOV buffer.
+ * Interleaved per-pixel channels of one auxiliary layer, written to the EXR as "<name>.<channel>".
+ */
+struct AOVBuffer {
+    EAOV type;
+    /* Whether the layer is stored as half (else 32-bit float) in the EXR */
+    bool half;
+    int width, height;
+    std::vector<float> data;
+
+    AOVBuffer(EAOV type, bool half, int w, int h) : type(type), half(half), width(w), height(h) {
+        data.assign(size_t(w) * h * getChannels().size(), 0.f);
+    }
+
+    static const char* getName(EAOV type) {
+        static const char* names[EAOVs] = {"albedo", "normal", "depth", "variance", "spp", "time"};
+        return names[type];
+    }
+
+    const std::vector<std::string>& getChannels() const {
+        static const std::vector<std::string> rgb = {"R", "G", "B"}, xyz = {"X", "Y", "Z"}, z = {"Z"}, y = {"Y"};
+        switch (type) {
+            case EAOVAlbedo:
+            case EAOVVariance: return rgb;
+            case EAOVNormal: return xyz;
+            case EAOVDepth: return z;
+            default: return y;
+        }
+    }
+
+    float* at(int x, int y) {
+        return &data[(size_t(y) * width + x) * getChannels().size()];
+    }
+};
+
 /**
  * Coordinate frame structure.
  * Stores canonical frame and transforms.
@@ -235,6 +360,8 @@ struct SurfaceInteraction {
     /* Incident direction (towards light source) */
     v3f wi;
     float t, u, v;
+    /* Texture coordinates, and their screen-space derivatives (0 without ray differentials) */
+    v2f st, dstdx, dstdy;
     /* ID of the shape that was hit */
     size_t shapeID;
     /* ID of the primitive that was hit */
@@ -253,6 +380,8 @@ struct SurfaceInteraction {
  * Stores origin, lookat, and up vector.
  */
 struct Camera {
+    /* Projection of the offline renders (see Sensor) */
+    ECameraType type;
     /* Origin point (eye position) */
     v3f o;
     /* Point the camera is looking at (center point) */
@@ -261,6 +390,19 @@ struct Camera {
     v3f up;
     /* Full field of view of the camera (vertical) */
     float fov;
+    /* Thin lens radius, and distance of the plane in focus (0 for the distance to `at`) */
+    float apertureRadius;
+    float focusDistance;
+    /* Height of the view of orthographic cameras (0 to match the field of view at the distance of `at`) */
+    float orthoHeight;
+};
+
+/**
+ * Camera at a given frame of an animation.
+ */
+struct CameraKeyframe {
+    int frame;
+    Camera camera;
 };
 
 /**
@@ -285,6 +427,39 @@ struct Config {
 	bool bonus;
 	/* Integer used to specify an automated test */
 	bool test;
+    /* How the triangles of mesh emitters are sampled for direct lighting */
+    ETriangleSampling triangleSampling;
+    /* Filtering of bitmap textures */
+    ETextureFilter textureFilter;
+    /* Memory budget (MB) of the texture pages loaded on demand, 0 to load all textures upfront */
+    float textureMemory;
+    /* Reconstruction filter splatting the samples onto the pixels */
+    EPixelFilter pixelFilter;
+    /* Auxiliary layers to write along the beauty image, and whether each is stored as half */
+    std::vector<std::pair<EAOV, bool>> aovs;
+    /* Seconds between checkpoints of the final pass (0 to disable), and whether to resume from the last one */
+    float checkpointInterval;
+    bool resume;
+    /* Number of frames of the camera animation (0 for a still image), its keyframes (sorted by frame),
+     * and the frame being rendered (-1 for a still image) */
+    int frames;
+    std::vector<CameraKeyframe> keyframes;
+    int frame;
+    /* Render farm role and shared directory, and seconds after which a band lease not renewed is taken over */
+    EFarmRole farmRole;
+    fs::path farmDir;
+    float leaseTimeout;
+    /* Denoise the image (feature-guided, see Denoiser) before saving it */
+    bool denoise;
+    /* Half-size (pixels) of the denoising window, and color tolerance in standard deviations */
+    int denoiseRadius;
+    float denoiseStrength;
+    /* Real-time: print CPU and GPU frame timings, and number of frames rendered without vsync to benchmark
+     * the renderpass (0 for interactive rendering) */
+    bool profile;
+    int benchmarkFrames;
+    /* Real-time: store vertex normals in 10 bits per component */
+    bool packNormals;
 
     struct IntegratorConfig {
         IntegratorConfig() : di{}{};
@@ -338,6 +513,20 @@ struct Config {
             int rrDepth;
             /* Russian Roulette probability (to keep bouncing a ray) */
             float rrProb;
+            /* Whether to cache the indirect irradiance at the first diffuse bounce */
+            bool irradianceCache{false};
+            /* Maximum interpolation error of the irradiance cache */
+            float icError{0.3f};
+            /* Number of hemisphere samples to compute an irradiance cache record */
+            int icSamples{256};
+            /* Whether to guide the indirect bounces with a learned SD-tree */
+            bool pathGuiding{false};
+            /* Number of training passes (1, 2, 4, ... spp) before the final render */
+            int guidingPasses{5};
+            /* Probability of sampling the BSDF rather than the guiding distribution */
+            float bsdfSamplingFraction{0.5f};
+            /* SD-tree file: loaded if it exists (skipping training), written after training otherwise */
+            std::string guidingFile;
         } pt;
         struct gi_s{
             int maxDepth;
@@ -349,6 +538,47 @@ struct Config {
 };
 
 struct Integrator;
+struct Tex;
+
+/**
+ * Texture parameter of a material, constant-folded at load time:
+ * holds a constant value, or a bitmap looked up at the hit point when `bitmap` is set.
+ */
+struct TextureParam3f {
+    v3f value = v3f(0.f);
+    const Tex* bitmap = nullptr;
+    inline v3f eval(const WorldData& s, const SurfaceInteraction& hit) const;
+};
+
+/**
+ * Flat material record, stored contiguously in `Scene::materialTable`.
+ * Holds the parameters of all BSDF types, tagged by `type`. Shading dispatches on the tag
+ * to the static kernels of the BSDF structures (see bsdfs/material.h), without virtual calls.
+ */
+struct Material {
+    enum EBSDF type = EMirrorBSDF; // Elaborated: ESamplingStrategy::EBSDF hides the type name
+    unsigned int combinedType = 0;
+    const WorldData* worldData = nullptr;
+    /* Emission of the material. Has length 0 if not emissive */
+    v3f emission = v3f(0.f);
+    TextureParam3f diffuseReflectance;
+    TextureParam3f specularReflectance;
+    float exponent = 1.f;
+    /* Energy conservation scale and lobe selection probability (Phong/Mixture) */
+    float scale = 1.f;
+    float specularSamplingWeight = 0.f;
+
+    bool isEmissive() const {
+        return glm::length2(emission) > 0.f;
+    }
+    unsigned int getType() const {
+        return combinedType;
+    }
+    inline v3f eval(const SurfaceInteraction&) const;
+    inline v3f getAlbedo(const SurfaceInteraction&) const;
+    inline float pdf(const SurfaceInteraction&) const;
+    inline v3f sample(SurfaceInteraction&, Sampler&, float* pdf = nullptr) const;
+};
 
 /**
  * Bidirectional scattering distribution function (BSDF) structure.
@@ -406,6 +636,8 @@ struct BSDF {
     v3f emission;
     std::vector<unsigned int> components;
     unsigned int combinedType;
+    /* Flat copy of the parameters, used for shading in the offline integrators */
+    Material material;
     BSDF(const WorldData& d, const Config& c, const size_t matID);
     virtual float getExponent(const SurfaceInteraction&) const = 0;
     virtual v3f eval(const SurfaceInteraction&) const = 0;
@@ -433,6 +665,11 @@ struct Emitter {
     v3f radiance;
     /* Discrete probability density function over the mesh triangles */
     Distribution1D faceAreaDistribution;
+    /* Shape of the emitter */
+    EEmitterShape shape;
+    /* Bounding sphere (exact sphere for ESphereEmitter) */
+    v3f center;
+    float radius;
     v3f getRadiance() const { return radiance; }
     v3f getPower() const { return area * M_PI * radiance; }
     bool operator==(const Emitter& other) const { return shapeID == other.shapeID; }
@@ -466,6 +703,8 @@ struct Scene {
     /* List of all the emitters in the scene */
     std::vector<Emitter> emitters;
     std::vector<std::unique_ptr<BSDF>> bsdfs;
+    /* Flat material table, indexed like `bsdfs` (by material ID) */
+    std::vector<Material> materialTable;
     AABB aabb;
 
     explicit Scene(const Config& config);
@@ -473,6 +712,7 @@ struct Scene {
     float getShapeArea(size_t shapeID, Distribution1D& faceAreaDistribution);
     float getShapeRadius(const size_t shapeID) const;
     v3f getShapeCenter(const size_t shapeID) const;
+    EEmitterShape getShapeType(size_t shapeID, v3f& center, float& radius) const;
     size_t getFirstLight() const;
     v3f getFirstLightPosition() const;
     v3f getFirstLightIntensity() const;
@@ -522,21 +762,238 @@ struct Texture {
     virtual T getMax() const = 0;
 };
 
+/**
+ * Storage format of texture texels
+ */
+enum ETexelFormat {
+    ETexelGamma8 = 0,   // 8-bit, gamma 2.2 encoded (PPM), decoded with a lookup table
+    ETexelHalf          // 16-bit linear half float (PFM)
+};
+
+/// Decoding table of 8-bit gamma encoded values, shared by all 8-bit textures
+inline const float* getGammaLUT() {
+    static const std::vector<float> lut = [] {
+        std::vector<float> t(256);
+        for (int i = 0; i < 256; i++)
+            t[i] = std::pow(float(i) / 255.f, 2.2f);
+        return t;
+    }();
+    return lut.data();
+}
+
+/**
+ * One level of a texture pyramid.
+ * RGB texels are stored in their source precision, in 8x8 tiles (row-major within a tile,
+ * tiles row-major in the image), so that a filter footprint touches few cache lines.
+ */
+struct TexLevel {
+    static const int TileShift = 3;
+    static const int TileSize = 1 << TileShift;
+    static const int TileMask = TileSize - 1;
+
+    int w = 0;
+    int h = 0;
+    int tilesX = 0;
+    ETexelFormat format = ETexelGamma8;
+    std::vector<uint8_t> data8;
+    std::vector<uint16_t> data16;
+
+    void resize(int width, int height, ETexelFormat fmt) {
+        w = width;
+        h = height;
+        format = fmt;
+        tilesX = (w + TileMask) >> TileShift;
+        const int tilesY = (h + TileMask) >> TileShift;
+        const size_t n = size_t(3) * tilesX * tilesY * TileSize * TileSize;
+        if (format == ETexelGamma8) data8.assign(n, 0);
+        else data16.assign(n, 0);
+    }
+
+    inline size_t offset(int x, int y) const {
+        const size_t tile = size_t(y >> TileShift) * tilesX + (x >> TileShift);
+        return 3 * ((tile << (2 * TileShift)) + ((y & TileMask) << TileShift) + (x & TileMask));
+    }
+
+    inline v3f texel(int x, int y) const {
+        const size_t i = offset(x, y);
+        if (format == ETexelGamma8) {
+            const float* lut = getGammaLUT();
+            return {lut[data8[i + 0]], lut[data8[i + 1]], lut[data8[i + 2]]};
+        }
+        return {halfToFloat(data16[i + 0]), halfToFloat(data16[i + 1]), halfToFloat(data16[i + 2])};
+    }
+
+    /// Store a linear value, encoded to the level's format
+    inline void set(int x, int y, const v3f& c) {
+        const size_t i = offset(x, y);
+        for (int k = 0; k < 3; k++) {
+            if (format == ETexelGamma8)
+                data8[i + k] = uint8_t(clamp(std::pow(std::max(c[k], 0.f), 1.f / 2.2f) * 255.f + 0.5f, 0.f, 255.f));
+            else
+                data16[i + k] = floatToHalf(c[k]);
+        }
+    }
+
+    size_t getMemoryUsage() const {
+        return data8.size() * sizeof(uint8_t) + data16.size() * sizeof(uint16_t);
+    }
+};
+
+/**
+ * Minimum, maximum and average texel values of a texture, gathered once while loading.
+ */
+struct TexStats {
+    v3f min = v3f(std::numeric_limits<float>::max());
+    v3f max = v3f(std::numeric_limits<float>::lowest());
+    v3f avg = v3f(0.f);
+    double sum[3] = {0., 0., 0.};
+    size_t count = 0;
+
+    inline void add(const v3f& c) {
+        min = glm::min(min, c);
+        max = glm::max(max, c);
+        for (int k = 0; k < 3; k++) sum[k] += c[k];
+        count++;
+    }
+
+    void finish() {
+        if (count == 0) return;
+        for (int k = 0; k < 3; k++) avg[k] = float(sum[k] / double(count));
+    }
+};
+
 /**
  * Main texture structure.
- * Stores width, height, and post-processing & loading methods.
+ * Stores width, height, the mipmap pyramid, and post-processing & loading methods.
  */
 struct Tex {
+    /* Level 0 of paged textures is split in pages of PageSize^2 texels, loaded on first access */
+    static const int PageShift = 6;
+    static const int PageSize = 1 << PageShift;
+    static const int PageMask = PageSize - 1;
+
+    struct Page {
+        TexLevel texels;
+        std::atomic<uint32_t> lastUse{0};
+    };
+
     int w;
     int h;
-    std::vector<float> cs;
+    /* Mipmap pyramid, level 0 being the full resolution image (empty when paged) */
+    std::vector<TexLevel> levels;
+    ETextureFilter filter = ETextureTrilinear;
+    /* Statistics of level 0 */
+    TexStats stats;
+
+    /* Paging state: pages are read from the source file and swapped with std::atomic_load/store */
+    bool paged = false;
+    FILE* file = nullptr;
+    long dataOffset = 0;
+    int pagesX = 0;
+    mutable std::vector<std::shared_ptr<Page>> pages;
+    mutable std::mutex fileMutex;
+
+    Tex() = default;
+    Tex(const Tex&) = delete;
+    Tex& operator=(const Tex&) = delete;
+    ~Tex() { if (file) fclose(file); }
 
     void pink() {
         w = 1;
         h = 1;
-        cs.emplace_back(1.f);
-        cs.emplace_back(0.f);
-        cs.emplace_back(1.f);
+        levels.assign(1, TexLevel());
+        levels[0].resize(1, 1, ETexelGamma8);
+        levels[0].set(0, 0, v3f(1.f, 0.f, 1.f));
+        stats = TexStats();
+        stats.add(levels[0].texel(0, 0));
+        stats.finish();
+    }
+
+    /// Build the coarser levels from the last one present with a 2x2 box filter (in linear space)
+    void buildMipmaps() {
+        while (levels.back().w > 1 || levels.back().h > 1) {
+            const TexLevel& prev = levels.back();
+            TexLevel next;
+            next.resize(std::max(1, prev.w / 2), std::max(1, prev.h / 2), prev.format);
+            for (int y = 0; y < next.h; y++)
+                for (int x = 0; x < next.w; x++) {
+                    const int x0 = std::min(2 * x, prev.w - 1), x1 = std::min(2 * x + 1, prev.w - 1);
+                    const int y0 = std::min(2 * y, prev.h - 1), y1 = std::min(2 * y + 1, prev.h - 1);
+                    next.set(x, y, 0.25f * (prev.texel(x0, y0) + prev.texel(x1, y0) +
+                                            prev.texel(x0, y1) + prev.texel(x1, y1)));
+                }
+            levels.push_back(std::move(next));
+        }
+    }
+
+    /// Bytes used by all levels (resident pages only, for paged textures)
+    size_t getMemoryUsage() const {
+        size_t bytes = 0;
+        for (const TexLevel& l : levels) bytes += l.getMemoryUsage();
+        for (size_t i = 0; i < pages.size(); i++) {
+            const std::shared_ptr<Page> page = std::atomic_load(&pages[i]);
+            if (page) bytes += page->texels.getMemoryUsage();
+        }
+        return bytes;
+    }
+
+    /// Texel of a level, paging it in if needed
+    inline v3f fetch(int level, int x, int y) const {
+        if (level > 0 || !paged) return levels[level].texel(x, y);
+        std::shared_ptr<Page> page = std::atomic_load(&pages[(y >> PageShift) * pagesX + (x >> PageShift)]);
+        if (!page) page = loadPage(x >> PageShift, y >> PageShift);
+        touch(*page);
+        return page->texels.texel(x & PageMask, y & PageMask);
+    }
+
+    inline std::shared_ptr<Page> loadPage(int px, int py) const;
+    inline void touch(Page& page) const;
+
+    // Nearest texel lookup at (wrapped) texture coordinates
+    inline v3f texel(v2f st) const {
+        st = st + v2f(1.0, 1.0);
+        st = st - glm::floor(st);
+
+        const int x = clamp(int(st.x * w), 0, w - 1);
+        const int y = clamp(int(st.y * h), 0, h - 1);
+
+        return fetch(0, x, y);
+    }
+
+    // Bilinear lookup at (wrapped) texture coordinates in a given level
+    inline v3f bilinear(int level, const v2f& st) const {
+        const TexLevel& l = levels[level];
+        const float x = st.x * l.w - 0.5f;
+        const float y = st.y * l.h - 0.5f;
+        const float fx = std::floor(x), fy = std::floor(y);
+        const float dx = x - fx, dy = y - fy;
+
+        auto wrap = [](int i, int n) { i %= n; return i < 0 ? i + n : i; };
+        const int x0 = wrap(int(fx), l.w), x1 = wrap(int(fx) + 1, l.w);
+        const int y0 = wrap(int(fy), l.h), y1 = wrap(int(fy) + 1, l.h);
+
+        return (1.f - dy) * ((1.f - dx) * fetch(level, x0, y0) + dx * fetch(level, x1, y0)) +
+               dy * ((1.f - dx) * fetch(level, x0, y1) + dx * fetch(level, x1, y1));
+    }
+
+    /**
+     * Filtered lookup. The footprint (in texels of level 0) is the largest of the
+     * texture coordinate derivatives; the two levels around log2(footprint) are blended.
+     */
+    inline v3f lookup(const v2f& st, const v2f& dstdx, const v2f& dstdy) const {
+        if (filter == ETextureNearest) return texel(st);
+
+        const float width = std::max(std::max(std::abs(dstdx.x) * w, std::abs(dstdx.y) * h),
+                                     std::max(std::abs(dstdy.x) * w, std::abs(dstdy.y) * h));
+        if (filter == ETextureBilinear || width <= 1.f) return bilinear(0, st);
+
+        const int last = int(levels.size()) - 1;
+        const float lod = std::min(std::log2(width), float(last));
+        const int l0 = std::min(int(lod), last);
+        const int l1 = std::min(l0 + 1, last);
+        const float t = lod - l0;
+        if (t <= 0.f || l0 == l1) return bilinear(l0, st);
+        return (1.f - t) * bilinear(l0, st) + t * bilinear(l1, st);
     }
 
     // Calculate pixel coordinate of the vertically-flipped image
@@ -547,27 +1004,39 @@ struct Tex {
         return 3 * ((h - y - 1) * w + x) + i % 3;
     }
 
-    // Post procses a pixel for pmp textures
-    inline float pf(int i, float e, std::vector<uint8_t>& ct) {
-        // Gamma expansion
-        return std::pow(float(ct[fl(i)]) / e, 2.2f);
+    // Store a pixel of a ppm texture (kept gamma encoded when possible)
+    inline void store(int x, int y, int i, float e, std::vector<uint8_t>& ct) {
+        TexLevel& l = levels[0];
+        if (e == 255.f) {
+            const size_t o = l.offset(x, y);
+            for (int k = 0; k < 3; k++) l.data8[o + k] = ct[fl(i + k)];
+        } else {
+            l.set(x, y, v3f(std::pow(float(ct[fl(i + 0)]) / e, 2.2f),
+                            std::pow(float(ct[fl(i + 1)]) / e, 2.2f),
+                            std::pow(float(ct[fl(i + 2)]) / e, 2.2f)));
+        }
     }
 
-    // Post procses a pixel for pmf textures
-    inline float pf(int i, float e, std::vector<float>& ct) {
-        if (e < 0) {
-            return ct[fl(i)];
+    // Store a pixel of a pfm texture
+    inline void store(int x, int y, int i, float e, std::vector<float>& ct) {
+        v3f c;
+        for (int k = 0; k < 3; k++) {
+            if (e < 0) {
+                c[k] = ct[fl(i + k)];
+            } else {
+                int32_t m = bswap(*(int32_t*) &ct[fl(i + k)]);
+                c[k] = *reinterpret_cast<float*>(&m);
+            }
         }
-        int32_t m = bswap(*(int32_t*) &ct[fl(i)]);
-        float* ptr = reinterpret_cast<float*>(&m);
-        return *ptr;
+        levels[0].set(x, y, c);
     }
 
-    // Load a ppm or a pfm texture
+    // Load a ppm or a pfm texture into level 0, in its source precision.
+    // Large 8-bit textures are paged instead when `pagingThreshold` (bytes of level 0) is non-zero.
     template<class T>
-    inline void loadpxm(std::vector<float>& c, std::string p) {
+    inline void loadpxm(std::string p, ETexelFormat format, size_t pagingThreshold) {
         puts(p.c_str());
-        static vector<T> ct;
+        std::vector<T> ct;
         FILE* f = fopen(p.c_str(), "rb");
         if (!f) {
             std::cout << "Err loading texture : " << p << std::endl;
@@ -578,40 +1047,309 @@ struct Tex {
         size_t read = fscanf(f, "%*s %d %d %d%*c", &w, &h, &e);
         if (read == 0) {
             std::cout << "Err loading texture : " << p << std::endl;
+            fclose(f);
             pink();
             return;
         }
         const int sz = w * h * 3;
+        if (format == ETexelGamma8 && e == 255 && pagingThreshold > 0 && size_t(sz) > pagingThreshold) {
+            loadPaged(f);
+            std::cout << "Success loading texture : " << p << " w: " << w << " h: " << h << " (paged)" << std::endl;
+            return;
+        }
         ct.assign(sz, 0);
-        c.assign(sz, 0);
         read = fread(ct.data(), sizeof(T), sz, f);
+        fclose(f);
         if (read == 0) {
             std::cout << "Err loading texture : " << p << std::endl;
             pink();
             return;
         }
-        for (int i = 0; i < sz; i++) {
-            c[i] = pf(i, float(e), ct);
-        }
-        fclose(f);
+        levels.assign(1, TexLevel());
+        levels[0].resize(w, h, format);
+        for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++) {
+                store(x, y, 3 * (w * y + x), float(e), ct);
+                stats.add(levels[0].texel(x, y));
+            }
+        stats.finish();
         std::cout << "Success loading texture : " << p << " w: " << w << " h: " << h << std::endl;
     }
 
+    // Set up paging of level 0 from an open 8-bit ppm file, streaming it once to build level 1
+    inline void loadPaged(FILE* f) {
+        paged = true;
+        file = f;
+        dataOffset = ftell(f);
+        pagesX = (w + PageMask) >> PageShift;
+        pages.assign(size_t(pagesX) * ((h + PageMask) >> PageShift), nullptr);
+
+        levels.assign(2, TexLevel());
+        levels[0].w = w;
+        levels[0].h = h;
+        levels[1].resize(std::max(1, w / 2), std::max(1, h / 2), ETexelGamma8);
+
+        // Image rows are stored bottom-up in the file
+        const float* lut = getGammaLUT();
+        std::vector<uint8_t> rows(size_t(w) * 3 * 2);
+        auto readRow = [&](int row, uint8_t* dst) {
+            fseek(f, dataOffset + long(h - row - 1) * w * 3, SEEK_SET);
+            if (fread(dst, 1, size_t(w) * 3, f) == 0) return;
+            for (int x = 0; x < w; x++)
+                stats.add(v3f(lut[dst[3 * x + 0]], lut[dst[3 * x + 1]], lut[dst[3 * x + 2]]));
+        };
+        TexLevel& l1 = levels[1];
+        for (int y = 0; y < l1.h; y++) {
+            readRow(2 * y, &rows[0]);
+            if (2 * y + 1 < h) readRow(2 * y + 1, &rows[size_t(w) * 3]);
+            else std::copy(rows.begin(), rows.begin() + size_t(w) * 3, rows.begin() + size_t(w) * 3);
+            for (int x = 0; x < l1.w; x++) {
+                const int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                v3f c(0.f);
+                for (int k = 0; k < 3; k++)
+                    c[k] = 0.25f * (lut[rows[3 * x0 + k]] + lut[rows[3 * x1 + k]] +
+                                    lut[rows[3 * (w + x0) + k]] + lut[rows[3 * (w + x1) + k]]);
+                l1.set(x, y, c);
+            }
+        }
+        // Odd height: the last row is not part of level 1
+        for (int row = 2 * l1.h; row < h; row++) readRow(row, &rows[0]);
+        stats.finish();
+    }
+
     // Load pfm texture
     inline void loadpfm(string p) {
-        loadpxm<float>(cs, p);
+        loadpxm<float>(p, ETexelHalf, 0);
+        buildMipmaps();
     }
 
     // Load ppm texture
-    inline void load(string p) {
+    inline void load(string p, size_t pagingThreshold = 0) {
         auto b = fs::path(p);
         auto pc = b.replace_extension(".ppm").string();
         auto pa = (b.parent_path() /
             fs::path(b.stem().string() + "_alpha.ppm")).string();
-        loadpxm<uint8_t>(cs, pc);
+        loadpxm<uint8_t>(pc, ETexelGamma8, pagingThreshold);
+        buildMipmaps();
+    }
+};
+
+/**
+ * Process-wide texture cache.
+ * Textures are shared by all materials referencing the same file, and can be preloaded in parallel.
+ * When a memory budget is set, large textures are paged: their level 0 is read on demand in
+ * PageSize^2 blocks, and the least recently used pages are evicted to stay within the budget.
+ */
+struct TextureCache {
+    static TextureCache& get() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    /// Budget (bytes) of the resident pages; textures whose level 0 exceeds 1/16 of it are paged
+    void setBudget(size_t bytes) { budget = bytes; }
+    size_t getBudget() const { return budget; }
+
+    /// Returns the texture loaded from a (resolved) path, loading it on the first request
+    std::shared_ptr<Tex> acquire(const std::string& path, ETextureFilter filter) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = textures.find(path);
+            if (it != textures.end()) return it->second;
+        }
+
+        std::shared_ptr<Tex> tex(new Tex());
+        tex->filter = filter;
+        tex->load(path, budget / 16);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto inserted = textures.insert(std::make_pair(path, tex));
+        if (inserted.second && tex->paged) paged.push_back(tex.get());
+        return inserted.first->second;
     }
+
+    /**
+     * Drops the textures no longer referenced outside the cache (e.g. by the materials of an unloaded scene)
+     * and their resident pages. Returns the number of textures dropped.
+     */
+    size_t purgeUnused() {
+        std::lock_guard<std::mutex> lockEvict(evictMutex);
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t purged = 0;
+        for (auto it = textures.begin(); it != textures.end();) {
+            if (it->second.use_count() > 1) {
+                ++it;
+                continue;
+            }
+            Tex* t = it->second.get();
+            if (t->paged) {
+                paged.erase(std::remove(paged.begin(), paged.end(), t), paged.end());
+                for (auto& p : t->pages) {
+                    std::shared_ptr<Tex::Page> page = std::atomic_exchange(&p, std::shared_ptr<Tex::Page>());
+                    if (page) resident -= page->texels.getMemoryUsage();
+                }
+            }
+            it = textures.erase(it);
+            purged++;
+        }
+        return purged;
+    }
+
+    /// Number of distinct textures loaded
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return textures.size();
+    }
+
+    uint32_t now() const { return clock.load(std::memory_order_relaxed); }
+
+    /// Account for a newly resident page, evicting the least recently used ones if over budget
+    void onPageLoaded(size_t bytes) {
+        clock.fetch_add(1, std::memory_order_relaxed);
+        if (resident.fetch_add(bytes) + bytes > budget) evict();
+    }
+
+private:
+    struct PageRef {
+        uint32_t lastUse;
+        Tex* tex;
+        size_t index;
+    };
+
+    void evict() {
+        std::lock_guard<std::mutex> lock(evictMutex);
+        if (resident.load() <= budget) return;
+
+        std::vector<PageRef> refs;
+        {
+            std::lock_guard<std::mutex> lockTextures(mutex);
+            for (Tex* t : paged)
+                for (size_t i = 0; i < t->pages.size(); i++) {
+                    const std::shared_ptr<Tex::Page> page = std::atomic_load(&t->pages[i]);
+                    if (page) refs.push_back({page->lastUse.load(std::memory_order_relaxed), t, i});
+                }
+        }
+        std::sort(refs.begin(), refs.end(), [](const PageRef& a, const PageRef& b) { return a.lastUse < b.lastUse; });
+
+        // Evict down to 90% of the budget, so that evictions are amortized over several page loads
+        const size_t target = budget - budget / 10;
+        for (const PageRef& r : refs) {
+            if (resident.load() <= target) break;
+            std::shared_ptr<Tex::Page> page = std::atomic_exchange(&r.tex->pages[r.index], std::shared_ptr<Tex::Page>());
+            if (page) resident -= page->texels.getMemoryUsage();
+        }
+    }
+
+    std::mutex mutex;
+    std::mutex evictMutex;
+    std::unordered_map<std::string, std::shared_ptr<Tex>> textures;
+    std::vector<Tex*> paged;
+    size_t budget = 0;
+    std::atomic<size_t> resident{0};
+    std::atomic<uint32_t> clock{0};
 };
 
+inline std::shared_ptr<Tex::Page> Tex::loadPage(int px, int py) const {
+    std::shared_ptr<Page> page(new Page());
+    page->texels.resize(PageSize, PageSize, ETexelGamma8);
+
+    const int x0 = px << PageShift, y0 = py << PageShift;
+    const int cols = std::min(PageSize, w - x0), rows = std::min(PageSize, h - y0);
+    std::vector<uint8_t> row(size_t(cols) * 3);
+    {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        for (int y = 0; y < rows; y++) {
+            fseek(file, dataOffset + (long(h - (y0 + y) - 1) * w + x0) * 3, SEEK_SET);
+            if (fread(row.data(), 1, row.size(), file) == 0) break;
+            for (int x = 0; x < cols; x++) {
+                uint8_t* t = &page->texels.data8[page->texels.offset(x, y)];
+                t[0] = row[3 * x + 0];
+                t[1] = row[3 * x + 1];
+                t[2] = row[3 * x + 2];
+            }
+        }
+    }
+
+    // Newer than any resident page, so that it is not the first one evicted
+    page->lastUse = TextureCache::get().now() + 1;
+
+    // Another thread may have loaded the same page meanwhile: keep the first one
+    std::shared_ptr<Page> expected;
+    if (!std::atomic_compare_exchange_strong(&pages[py * pagesX + px], &expected, page))
+        return expected;
+    TextureCache::get().onPageLoaded(page->texels.getMemoryUsage());
+    return page;
+}
+
+inline void Tex::touch(Page& page) const {
+    const uint32_t t = TextureCache::get().now();
+    if (page.lastUse.load(std::memory_order_relaxed) != t)
+        page.lastUse.store(t, std::memory_order_relaxed);
+}
+
+/**
+ * Output file next to the scene's TOML file, numbered with the frame when rendering an animation.
+ */
+inline std::string getOutputPath(const Config& config, const std::string& extension) {
+    std::string name = config.tomlFile.stem().string();
+    if (config.frame >= 0) {
+        char number[16];
+        std::snprintf(number, sizeof(number), "_%04d", config.frame);
+        name += number;
+    }
+    return (config.tomlFile.parent_path() / (name + "." + extension)).string();
+}
+
+/**
+ * Last modification time of a file, in seconds since the epoch (boost::filesystem returns a time_t).
+ */
+inline int64_t getWriteTime(const fs::path& file) {
+#if defined(__APPLE__)
+    return int64_t(fs::last_write_time(file));
+#else
+    return int64_t(std::chrono::system_clock::to_time_t(fs::last_write_time(file)));
+#endif
+}
+
+/**
+ * Camera of an animation at a given frame, linearly interpolated between the keyframes around it.
+ */
+inline Camera interpolateCamera(const std::vector<CameraKeyframe>& keyframes, int frame) {
+    if (frame <= keyframes.front().frame) return keyframes.front().camera;
+    if (frame >= keyframes.back().frame) return keyframes.back().camera;
+    size_t i = 1;
+    while (keyframes[i].frame < frame) i++;
+    const CameraKeyframe& a = keyframes[i - 1];
+    const CameraKeyframe& b = keyframes[i];
+    const float t = float(frame - a.frame) / float(b.frame - a.frame);
+    Camera c = a.camera;
+    c.o = glm::mix(a.camera.o, b.camera.o, t);
+    c.at = glm::mix(a.camera.at, b.camera.at, t);
+    c.up = glm::mix(a.camera.up, b.camera.up, t);
+    c.fov = glm::mix(a.camera.fov, b.camera.fov, t);
+    c.apertureRadius = glm::mix(a.camera.apertureRadius, b.camera.apertureRadius, t);
+    c.focusDistance = glm::mix(a.camera.focusDistance, b.camera.focusDistance, t);
+    c.orthoHeight = glm::mix(a.camera.orthoHeight, b.camera.orthoHeight, t);
+    return c;
+}
+
+/**
+ * Resolves a texture file name relative to the scene's obj file.
+ */
+inline std::string resolveTexturePath(const Config& config, const std::string& filename) {
+    fs::path fullpath(config.objFile);
+    if (!fullpath.is_absolute())
+        fullpath = config.tomlFile.parent_path() / fullpath;
+
+    fs::path file(filename);
+    if (!file.is_absolute())
+        fullpath = fullpath.parent_path() / file;
+    else
+        fullpath = file;
+
+    return fullpath.make_preferred().string();
+}
+
 struct ConstantTexture3f : Texture<v3f> {
     v3f value;
     explicit ConstantTexture3f(const v3f& v) : value(v) { }
@@ -635,167 +1373,70 @@ struct ConstantTexture1f : Texture<float> {
 };
 
 struct BitmapTexture3f : Texture<v3f> {
-    std::unique_ptr<Tex> texturePtr;
+    std::shared_ptr<Tex> texturePtr;
 
     explicit BitmapTexture3f(const Config& config, const std::string& filename) {
-        texturePtr = std::unique_ptr<Tex>(new Tex());
-
-        fs::path fullpath(config.objFile);
-        if (!fullpath.is_absolute())
-            fullpath = config.tomlFile.parent_path() / fullpath;
-
-        fs::path file(filename);
-        if (!file.is_absolute())
-            fullpath = fullpath.parent_path() / file;
-        else
-            fullpath = file;
-
-        texturePtr->load(fullpath.make_preferred().string());
+        texturePtr = TextureCache::get().acquire(resolveTexturePath(config, filename), config.textureFilter);
     }
 
-    v3f getAverage() const override {
-        v3f s(0);
-        for (size_t i = 0; i < texturePtr->cs.size() / 3; i++) {
-            s += v3f(texturePtr->cs[i * 3 + 0], texturePtr->cs[i * 3 + 1], texturePtr->cs[i * 3 + 2]);
-        }
-        float scale = 1.0 / (texturePtr->cs.size() / 3.0);
-        return s * scale;
-    }
-
-    v3f getMin() const override {
-        v3f s(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
-        for (size_t i = 0; i < texturePtr->cs.size() / 3; i++)
-            s = glm::min(s, v3f(texturePtr->cs[i * 3 + 0], texturePtr->cs[i * 3 + 1], texturePtr->cs[i * 3 + 2]));
-        return s;
-    }
-
-    v3f getMax() const override {
-        v3f s(-std::numeric_limits<float>::min(),
-              -std::numeric_limits<float>::min(),
-              -std::numeric_limits<float>::min());
-        for (size_t i = 0; i < texturePtr->cs.size() / 3; i++)
-            s = glm::max(s, v3f(texturePtr->cs[i * 3 + 0], texturePtr->cs[i * 3 + 1], texturePtr->cs[i * 3 + 2]));
-        return s;
-    }
+    v3f getAverage() const override { return texturePtr->stats.avg; }
+    v3f getMin() const override { return texturePtr->stats.min; }
+    v3f getMax() const override { return texturePtr->stats.max; }
 
     v3f eval(const WorldData& s, const SurfaceInteraction& hit) const override {
-        const tinyobj::shape_t& shape = s.shapes[hit.shapeID];
-
-        int i0 = shape.mesh.indices[hit.primID * 3 + 0].texcoord_index;
-        int i1 = shape.mesh.indices[hit.primID * 3 + 1].texcoord_index;
-        int i2 = shape.mesh.indices[hit.primID * 3 + 2].texcoord_index;
-        v2f st0{s.attrib.texcoords[2 * i0 + 0], s.attrib.texcoords[2 * i0 + 1]};
-        v2f st1{s.attrib.texcoords[2 * i1 + 0], s.attrib.texcoords[2 * i1 + 1]};
-        v2f st2{s.attrib.texcoords[2 * i2 + 0], s.attrib.texcoords[2 * i2 + 1]};
-
-        v2f st = barycentric(st0, st1, st2, hit.u, hit.v) + v2f(1.0, 1.0);
-        st = st - glm::floor(st);
-
-        const int x = clamp(int(st.x * texturePtr->w), 0, texturePtr->w - 1);
-        const int y = clamp(int(st.y * texturePtr->h), 0, texturePtr->h - 1);
-        const int i = texturePtr->w * y + x;
-
-        return {texturePtr->cs[i * 3 + 0], texturePtr->cs[i * 3 + 1], texturePtr->cs[i * 3 + 2]};
+        return texturePtr->lookup(hit.st, hit.dstdx, hit.dstdy);
     };
 };
 
+/**
+ * Single channel bitmap texture: reads the first channel of the image.
+ */
 struct BitmapTexture1f : Texture<float> {
-    std::unique_ptr<Tex> texturePtr;
+    std::shared_ptr<Tex> texturePtr;
 
     explicit BitmapTexture1f(const std::string& filename) {
-        texturePtr = std::unique_ptr<Tex>(new Tex());
-        texturePtr->load(filename);
-    }
-
-    float getAverage() const override {
-        float s(0);
-        for (size_t i = 0; i < texturePtr->cs.size(); i++) {
-            s += texturePtr->cs[i];
-        }
-        float scale = 1.0f / texturePtr->cs.size();
-        return s * scale;
-    }
-
-    float getMin() const override {
-        float s = std::numeric_limits<float>::max();
-        for (size_t i = 0; i < texturePtr->cs.size() / 3; i++)
-            s = min(texturePtr->cs[i], s);
-        return s;
+        texturePtr = TextureCache::get().acquire(filename, ETextureTrilinear);
     }
 
-    float getMax() const override {
-        float s = std::numeric_limits<float>::min();
-        for (size_t i = 0; i < texturePtr->cs.size() / 3; i++)
-            s = max(texturePtr->cs[i], s);
-        return s;
-    }
+    float getAverage() const override { return texturePtr->stats.avg.x; }
+    float getMin() const override { return texturePtr->stats.min.x; }
+    float getMax() const override { return texturePtr->stats.max.x; }
 
     float eval(const WorldData& s, const SurfaceInteraction& hit) const override {
-        const tinyobj::shape_t& shape = s.shapes[hit.shapeID];
-
-        int i0 = shape.mesh.indices[hit.primID * 3 + 0].texcoord_index;
-        int i1 = shape.mesh.indices[hit.primID * 3 + 1].texcoord_index;
-        int i2 = shape.mesh.indices[hit.primID * 3 + 2].texcoord_index;
-        v2f st0{s.attrib.texcoords[2 * i0 + 0], s.attrib.texcoords[2 * i0 + 1]};
-        v2f st1{s.attrib.texcoords[2 * i1 + 0], s.attrib.texcoords[2 * i1 + 1]};
-        v2f st2{s.attrib.texcoords[2 * i2 + 0], s.attrib.texcoords[2 * i2 + 1]};
-
-        v2f st = barycentric(st0, st1, st2, hit.u, hit.v) + v2f(1.0, 1.0);
-        st = st - glm::floor(st);
-
-        const int x = clamp(int(st.x * texturePtr->w), 0, texturePtr->w - 1);
-        const int y = clamp(int(st.y * texturePtr->h), 0, texturePtr->h - 1);
-        const int i = texturePtr->w * y + x;
-
-        return texturePtr->cs[i];
+        return texturePtr->lookup(hit.st, hit.dstdx, hit.dstdy).x;
     };
 };
 
+inline v3f TextureParam3f::eval(const WorldData& s, const SurfaceInteraction& hit) const {
+    return bitmap ? bitmap->lookup(hit.st, hit.dstdx, hit.dstdy) : value;
+}
+
+/**
+ * Folds a texture into a material parameter: bitmaps are referenced, anything else is a constant.
+ */
+inline TextureParam3f foldTexture(const Texture<v3f>& texture) {
+    TextureParam3f param;
+    if (const BitmapTexture3f* bitmap = dynamic_cast<const BitmapTexture3f*>(&texture))
+        param.bitmap = bitmap->texturePtr.get();
+    else
+        param.value = texture.getAverage();
+    return param;
+}
+
 /**
  * Utilities for managing multi-threading
  * Provides static methods for running a `for` loop in parallel
+ * The worker threads are created once and reused by every loop (e.g. all the frames of an animation).
+ * Iterations are handed out in small chunks, so that threads finishing early take over the remaining work.
  */
 struct ThreadPool {
 
     /* Run a `for` loop in parallel */
 	template<typename Index, typename Callable>
 	static void ParallelFor(Index start, Index end, Callable func) {
-		// Estimate number of threads in the pool
-		const static unsigned nb_threads_hint = std::thread::hardware_concurrency();
-		const static unsigned nb_threads = (nb_threads_hint == 0u ? 8u : nb_threads_hint);
-
-		// Size of a slice for the range functions
-		Index n = end - start + 1;
-		Index slice = (Index)std::round(n / static_cast<double> (nb_threads));
-		slice = std::max(slice, Index(1));
-
-		// [Helper] Inner loop
-		auto launchRange = [&func](int k1, int k2) {
-			for (Index k = k1; k < k2; k++) {
-				func(k);
-			}
-		};
-
-		// Create pool and launch jobs
-		std::vector<std::thread> pool;
-		pool.reserve(nb_threads);
-		Index i1 = start;
-		Index i2 = std::min(start + slice, end);
-		for (unsigned i = 0; i + 1 < nb_threads && i1 < end; ++i) {
-			pool.emplace_back(launchRange, i1, i2);
-			i1 = i2;
-			i2 = std::min(i2 + slice, end);
-		}
-		if (i1 < end) {
-			pool.emplace_back(launchRange, i1, end);
-		}
-
-		// Wait for jobs to finish
-		for (std::thread &t : pool) {
-			if (t.joinable()) {
-				t.join();
-			}
-		}
+		if (end <= start) return;
+		const std::function<void(size_t)> job = [&func, start](size_t i) { func(Index(start + Index(i))); };
+		get().run(size_t(end - start), job);
 	}
 
     /* Run a `for` loop sequentially for easy comparison. Equivalent to a regular C++ `for` loop */
@@ -805,6 +1446,120 @@ struct ThreadPool {
 			func(i);
 		}
 	}
+
+	/* Number of threads running the loops (workers and calling thread) */
+	static unsigned getThreadCount() { return unsigned(get().m_workers.size()) + 1; }
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_wake.notify_all();
+		for (std::thread& t : m_workers) t.join();
+	}
+
+private:
+	std::vector<std::thread> m_workers;
+	std::mutex m_runMutex, m_mutex;
+	std::condition_variable m_wake, m_done;
+	bool m_quit = false;
+	/* Current loop: iteration count, chunk size, next iteration to hand out */
+	const std::function<void(size_t)>* m_job = nullptr;
+	size_t m_size = 0, m_chunk = 1;
+	std::atomic<size_t> m_next{0};
+	size_t m_generation = 0;
+	unsigned m_active = 0;
+	/* First exception thrown by a worker in the current loop, rethrown by the calling thread */
+	std::exception_ptr m_error;
+
+	ThreadPool() {
+		// Estimate number of threads in the pool
+		const unsigned nb_threads_hint = std::thread::hardware_concurrency();
+		const unsigned nb_threads = (nb_threads_hint == 0u ? 8u : nb_threads_hint);
+		for (unsigned i = 0; i + 1 < nb_threads; i++)
+			m_workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+
+	static ThreadPool& get() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	/* Whether the current thread is running an iteration (nested loops then run sequentially) */
+	static bool& inLoop() {
+		static thread_local bool value = false;
+		return value;
+	}
+
+	void run(size_t n, const std::function<void(size_t)>& job) {
+		if (inLoop() || m_workers.empty()) {
+			for (size_t i = 0; i < n; i++) job(i);
+			return;
+		}
+
+		std::lock_guard<std::mutex> runLock(m_runMutex);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_job = &job;
+			m_size = n;
+			m_chunk = std::max(n / (8 * (m_workers.size() + 1)), size_t(1));
+			m_next = 0;
+			m_active = unsigned(m_workers.size());
+			m_error = nullptr;
+			m_generation++;
+		}
+		m_wake.notify_all();
+
+		// The calling thread works too. On error, the remaining iterations are skipped
+		std::exception_ptr error;
+		inLoop() = true;
+		try {
+			work();
+		} catch (...) {
+			error = std::current_exception();
+			m_next = m_size;
+		}
+		inLoop() = false;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this] { return m_active == 0; });
+		m_job = nullptr;
+		if (!error) error = m_error;
+		m_error = nullptr;
+		if (error) std::rethrow_exception(error);
+	}
+
+	void work() {
+		for (;;) {
+			const size_t i = m_next.fetch_add(m_chunk);
+			if (i >= m_size) return;
+			for (size_t k = i; k < std::min(i + m_chunk, m_size); k++) (*m_job)(k);
+		}
+	}
+
+	void workerLoop() {
+		inLoop() = true;
+		size_t generation = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [&] { return m_quit || m_generation != generation; });
+				if (m_quit) return;
+				generation = m_generation;
+			}
+			std::exception_ptr error;
+			try {
+				work();
+			} catch (...) {
+				error = std::current_exception();
+				m_next = m_size;
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (error && !m_error) m_error = error;
+			if (--m_active == 0) m_done.notify_one();
+		}
+	}
 };
 
 /**
@@ -0,0 +1,138 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <core/core.h>
+#include <core/simd.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Feature-guided denoiser.
+ * Joint (cross) bilateral filter over the albedo-demodulated radiance: neighbors are weighted by
+ * their distance, their albedo/normal/depth differences and a variance-normalized color distance
+ * (Rousselle et al. '12), then the filtered irradiance is modulated back by the albedo.
+ * Rows are filtered in parallel, 4 neighbors at a time.
+ */
+struct Denoiser {
+    /* Half-size of the filter window (pixels) */
+    int radius;
+    /* Color distance tolerance, in units of the pixel standard deviation */
+    float strength;
+    float sigmaAlbedo = 0.1f;
+    float sigmaNormal = 0.2f;
+    /* Depth tolerance, relative to the depth of the filtered pixel */
+    float sigmaDepth = 0.05f;
+
+    Denoiser(int radius, float strength) : radius(radius), strength(strength) { }
+
+    /**
+     * Filters `rgb` in place. Features must match the AOV layouts (albedo RGB, normal XYZ, depth Z, variance RGB).
+     * The color term needs the per-pixel variance, i.e. at least 2 spp; it is ignored otherwise.
+     */
+    void apply(RenderBuffer& rgb, const AOVBuffer& albedo, const AOVBuffer& normal,
+               const AOVBuffer& depth, const AOVBuffer& variance, bool useVariance) const {
+        const int w = rgb.width, h = rgb.height, r = radius;
+        // Planar copies padded by the radius (plus a SIMD tail on the right), invalid outside the image
+        const int pw = w + 2 * r + 4, ph = h + 2 * r;
+        enum { IR = 0, IG, IB, VAR, AR, AG, AB, NX, NY, NZ, D, VALID, NPLANES };
+        std::vector<float> planes(size_t(NPLANES) * pw * ph, 0.f);
+        auto plane = [&](int i) { return planes.data() + size_t(i) * pw * ph; };
+        std::vector<v3f> modulation(size_t(w) * h);
+
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                const size_t i = size_t(y) * w + x, j = size_t(y + r) * pw + x + r;
+                const float* a = &albedo.data[3 * i];
+                const float* n = &normal.data[3 * i];
+                const float* v = &variance.data[3 * i];
+                // Don't demodulate (near) black albedos: misses, mirrors
+                v3f m;
+                for (int c = 0; c < 3; c++) m[c] = a[c] > 0.01f ? a[c] : 1.f;
+                modulation[i] = m;
+                const v3f irr = rgb.data[i] / m;
+                plane(IR)[j] = irr.x;
+                plane(IG)[j] = irr.y;
+                plane(IB)[j] = irr.z;
+                plane(VAR)[j] = (v[0] / (m.x * m.x) + v[1] / (m.y * m.y) + v[2] / (m.z * m.z)) / 3.f;
+                plane(AR)[j] = a[0];
+                plane(AG)[j] = a[1];
+                plane(AB)[j] = a[2];
+                plane(NX)[j] = n[0];
+                plane(NY)[j] = n[1];
+                plane(NZ)[j] = n[2];
+                plane(D)[j] = std::isfinite(depth.data[i]) ? depth.data[i] : 0.f;
+                plane(VALID)[j] = 1.f;
+            }
+        }
+
+        const float invSigmaS2 = 2.f / float(r * r);
+        const float invSigmaA2 = 0.5f / (sigmaAlbedo * sigmaAlbedo);
+        const float invSigmaN2 = 0.5f / (sigmaNormal * sigmaNormal);
+        const float k2 = strength * strength;
+
+        auto filterRow = [&](int y) {
+            for (int x = 0; x < w; x++) {
+                const size_t j = size_t(y + r) * pw + x + r;
+                const float4 ir(plane(IR)[j]), ig(plane(IG)[j]), ib(plane(IB)[j]), var(plane(VAR)[j]);
+                const float4 ar(plane(AR)[j]), ag(plane(AG)[j]), ab(plane(AB)[j]);
+                const float4 nx(plane(NX)[j]), ny(plane(NY)[j]), nz(plane(NZ)[j]), d(plane(D)[j]);
+                // Misses (depth 0) only blend with misses
+                const float4 invSigmaD2(0.5f / (sigmaDepth * sigmaDepth * plane(D)[j] * plane(D)[j] + 1e-8f));
+
+                float4 sw(0.f), sr(0.f), sg(0.f), sb(0.f);
+                for (int dy = -r; dy <= r; dy++) {
+                    const size_t row = size_t(y + r + dy) * pw;
+                    for (int dx = -r; dx <= r; dx += 4) {
+                        const size_t q = row + x + r + dx;
+                        const float4 qr = float4::load(plane(IR) + q), qg = float4::load(plane(IG) + q);
+                        const float4 qb = float4::load(plane(IB) + q);
+                        const float4 offset = float4(float(dx), float(dx + 1), float(dx + 2), float(dx + 3));
+
+                        float4 e = (offset * offset + float4(float(dy * dy))) * float4(invSigmaS2);
+                        if (useVariance) {
+                            const float4 qvar = float4::load(plane(VAR) + q);
+                            const float4 cr = ir - qr, cg = ig - qg, cb = ib - qb;
+                            const float4 dist = (cr * cr + cg * cg + cb * cb) * float4(1.f / 3.f) - (var + min(var, qvar));
+                            e += max(dist, float4(0.f)) / (float4(1e-10f) + float4(k2) * (var + qvar));
+                        }
+                        const float4 da = sqr4(ar - float4::load(plane(AR) + q)) + sqr4(ag - float4::load(plane(AG) + q))
+                                        + sqr4(ab - float4::load(plane(AB) + q));
+                        const float4 dn = sqr4(nx - float4::load(plane(NX) + q)) + sqr4(ny - float4::load(plane(NY) + q))
+                                        + sqr4(nz - float4::load(plane(NZ) + q));
+                        e += da * float4(invSigmaA2) + dn * float4(invSigmaN2);
+                        e += sqr4(d - float4::load(plane(D) + q)) * invSigmaD2;
+
+                        // Lanes past the window or the image get no weight
+                        float4 wq = exp(float4(0.f) - e) * float4::load(plane(VALID) + q);
+                        wq = select(offset > float4(r + 0.5f), float4(0.f), wq);
+                        sw += wq;
+                        sr += wq * qr;
+                        sg += wq * qg;
+                        sb += wq * qb;
+                    }
+                }
+
+                const size_t i = size_t(y) * w + x;
+                const float invSum = 1.f / hsum(sw);
+                rgb.data[i] = modulation[i] * v3f(hsum(sr), hsum(sg), hsum(sb)) * invSum;
+            }
+        };
+
+#ifdef NDEBUG
+        ThreadPool::ParallelFor(0, h, filterRow);
+#else
+        ThreadPool::SequentialFor(0, h, filterRow);
+#endif
+    }
+
+private:
+    static float4 sqr4(const float4& x) { return x * x; }
+};
+
+TR_NAMESPACE_END
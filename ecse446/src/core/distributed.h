@@ -0,0 +1,231 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <core/core.h>
+#include <core/film.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Render farm sharing a frame between processes through a shared directory.
+ * The image is split in bands of rows. A process leases a band by creating `band_<b>.lease` exclusively,
+ * renews the lease while rendering, then publishes the band's partial film (filter-weighted sums of the
+ * band rows plus the margin their splats reach, and the AOVs of the band) as `band_<b>.film`.
+ * Leases not renewed within the timeout belong to dead workers and are taken over.
+ * The coordinator renders like any worker, then merges the band films into the final image.
+ * Bands are rendered with the same seeds as a single process would, so the image doesn't depend on
+ * how the work is split, unless the integrator fills caches as it renders (Integrator::isOrderDependent(),
+ * e.g. the irradiance cache): each process then has its own. Passes before the final one (e.g. path guiding
+ * training) run in each process.
+ */
+struct RenderFarm {
+    fs::path dir;
+    int width, height, spp, bandSize, nbBands;
+    EPixelFilter filter;
+    /* Seconds after which a lease that wasn't renewed is considered abandoned */
+    float leaseTimeout;
+    std::string workerID;
+
+    RenderFarm(const Config& config, int bandSize)
+            : dir(config.farmDir), width(config.width), height(config.height), spp(config.spp),
+              bandSize(bandSize), filter(config.pixelFilter), leaseTimeout(config.leaseTimeout) {
+        nbBands = (height + bandSize - 1) / bandSize;
+        std::random_device rd;
+        std::ostringstream id;
+        id << std::hex << rd() << rd();
+        workerID = id.str();
+        // Each frame of an animation has its own bands
+        if (config.frame >= 0) dir /= "frame_" + std::to_string(config.frame);
+        fs::create_directories(dir);
+    }
+
+    std::string getFile(int band, const char* ext) const {
+        return (dir / ("band_" + std::to_string(band) + ext)).string();
+    }
+
+    bool isDone(int band) const {
+        return fs::exists(getFile(band, ".film"));
+    }
+
+    /**
+     * Leases a band that isn't done, possibly taking over an abandoned lease.
+     */
+    bool tryLease(int band) {
+        const std::string lease = getFile(band, ".lease");
+        if (createLease(band)) return !isDone(band) || (releaseLease(band), false);
+
+        // Take over an abandoned lease: only one of the processes renaming it succeeds
+        std::string owner;
+        double stamp = 0.;
+        std::ifstream in(lease);
+        if (!(in >> owner >> stamp)) return false; // Being created or renamed
+        in.close();
+        if (now() - stamp < leaseTimeout) return false;
+        if (std::rename(lease.c_str(), (lease + ".stale." + workerID).c_str()) != 0) return false;
+        std::remove((lease + ".stale." + workerID).c_str());
+        std::cout << "Taking over band " << band << " from worker " << owner << std::endl;
+        return createLease(band) && (!isDone(band) || (releaseLease(band), false));
+    }
+
+    /**
+     * Renews a lease held by this process. Fails if the lease was taken over (or removed) meanwhile.
+     * The new stamp is written aside, then renamed over the lease once it is checked to still be ours: a
+     * takeover within the remaining window (between the check and the rename) only makes two processes
+     * render the band, with the same result.
+     */
+    bool renewLease(int band) const {
+        const std::string lease = getFile(band, ".lease");
+        const std::string tmp = lease + ".renew." + workerID;
+        std::ofstream(tmp, std::ios::trunc) << workerID << " " << std::fixed << now() << std::endl;
+        if (!ownsLease(band) || std::rename(tmp.c_str(), lease.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /// Removes a lease held by this process (a lease taken over by another process is left alone)
+    void releaseLease(int band) const {
+        if (ownsLease(band)) std::remove(getFile(band, ".lease").c_str());
+    }
+
+    /**
+     * Publishes the film of a band (written to a temporary file, then renamed) and releases its lease.
+     */
+    bool submit(int band, const FilmTile& tile, const std::vector<AOVBuffer>& aovs) const {
+        const std::string filename = getFile(band, ".film");
+        const std::string tmp = filename + "." + workerID;
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            writeHeader(out, band, aovs);
+            const int32_t rows[] = {tile.y0, tile.y1};
+            out.write((const char*) rows, sizeof(rows));
+            out.write((const char*) tile.sum.data(), sizeof(v3f) * tile.sum.size());
+            out.write((const char*) tile.weight.data(), sizeof(float) * tile.weight.size());
+            for (const AOVBuffer& aov : aovs) {
+                size_t begin, end;
+                getAOVRange(band, aov, begin, end);
+                out.write((const char*) &aov.data[begin], sizeof(float) * (end - begin));
+            }
+            if (!out) {
+                std::cerr << "Could not write " << tmp << std::endl;
+                return false;
+            }
+        }
+        std::remove(filename.c_str()); // For renames that don't replace existing files
+        const bool ok = std::rename(tmp.c_str(), filename.c_str()) == 0;
+        releaseLease(band);
+        return ok;
+    }
+
+    /**
+     * Merges the film of a band into the image, and copies its AOVs.
+     */
+    bool collect(int band, Film& film, std::vector<AOVBuffer>& aovs) const {
+        std::ifstream in(getFile(band, ".film"), std::ios::binary);
+        std::ostringstream expected;
+        writeHeader(expected, band, aovs);
+        std::string found(expected.str().size(), '\0');
+        in.read(&found[0], found.size());
+        if (!in || found != expected.str()) {
+            std::cerr << "Band " << band << " was rendered with different settings" << std::endl;
+            return false;
+        }
+
+        int32_t rows[2];
+        in.read((char*) rows, sizeof(rows));
+        if (!in || rows[0] < 0 || rows[1] > height || rows[0] >= rows[1]) return false;
+        FilmTile tile(rows[0], rows[1], width);
+        in.read((char*) tile.sum.data(), sizeof(v3f) * tile.sum.size());
+        in.read((char*) tile.weight.data(), sizeof(float) * tile.weight.size());
+        for (AOVBuffer& aov : aovs) {
+            size_t begin, end;
+            getAOVRange(band, aov, begin, end);
+            in.read((char*) &aov.data[begin], sizeof(float) * (end - begin));
+        }
+        if (!in) {
+            std::cerr << "Truncated film for band " << band << std::endl;
+            return false;
+        }
+        film.mergeTile(tile);
+        return true;
+    }
+
+    /**
+     * Marks the frame as merged by the coordinator (or clears the mark of a previous frame):
+     * workers waiting on leases stop instead of rendering the removed bands again.
+     */
+    void setComplete(bool complete) const {
+        const std::string filename = (dir / "complete").string();
+        if (complete) std::ofstream(filename) << workerID << std::endl;
+        else std::remove(filename.c_str());
+    }
+
+    bool isComplete() const {
+        return fs::exists(dir / "complete");
+    }
+
+    /**
+     * Removes the band files of this frame.
+     */
+    void cleanUp() const {
+        for (int b = 0; b < nbBands; b++) {
+            std::remove(getFile(b, ".film").c_str());
+            std::remove(getFile(b, ".lease").c_str());
+        }
+    }
+
+private:
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    bool createLease(int band) const {
+        // Exclusive creation ("x"): fails if another process holds the lease
+        std::FILE* f = std::fopen(getFile(band, ".lease").c_str(), "wx");
+        if (!f) return false;
+        std::fclose(f);
+        writeLease(band);
+        return true;
+    }
+
+    void writeLease(int band) const {
+        std::ofstream out(getFile(band, ".lease"), std::ios::trunc);
+        out << workerID << " " << std::fixed << now() << std::endl;
+    }
+
+    bool ownsLease(int band) const {
+        std::string owner;
+        std::ifstream in(getFile(band, ".lease"));
+        return (in >> owner) && owner == workerID;
+    }
+
+    void getAOVRange(int band, const AOVBuffer& aov, size_t& begin, size_t& end) const {
+        const size_t rowSize = size_t(width) * aov.getChannels().size();
+        begin = size_t(band) * bandSize * rowSize;
+        end = size_t(std::min((band + 1) * bandSize, height)) * rowSize;
+    }
+
+    void writeHeader(std::ostream& out, int band, const std::vector<AOVBuffer>& aovs) const {
+        const uint32_t magic = 0x4d465254; // "TRFM"
+        const int32_t values[] = {width, height, spp, bandSize, band, int32_t(filter), int32_t(aovs.size())};
+        out.write((const char*) &magic, sizeof(magic));
+        out.write((const char*) values, sizeof(values));
+        for (const AOVBuffer& aov : aovs) {
+            const int32_t type = aov.type;
+            out.write((const char*) &type, sizeof(type));
+        }
+    }
+};
+
+TR_NAMESPACE_END
@@ -0,0 +1,253 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <core/platform.h>
+#include <core/math.h>
+
+// zlib compression of the miniz copy compiled with the tinyexr implementation (main.cpp)
+namespace tinyexr {
+namespace miniz {
+typedef unsigned long mz_ulong;
+extern "C" {
+int mz_compress(unsigned char* pDest, mz_ulong* pDest_len, const unsigned char* pSource, mz_ulong source_len);
+mz_ulong mz_compressBound(mz_ulong source_len);
+}
+}
+}
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Channel of a multi-layer EXR image: `width * height` values read with a stride (in floats).
+ */
+struct EXRChannel {
+    std::string name;
+    const float* data;
+    int stride;
+    bool half;
+};
+
+/**
+ * Streaming writer of tiled, ZIP-compressed EXR images.
+ * Tiles are packed, compressed and appended to the file by a background I/O thread as soon as
+ * they are queued (in any order), reading the channels in place: no full-frame copy is made.
+ * The tile offset table is patched when the file is closed.
+ */
+struct TiledEXRWriter {
+    static const int TileSize = 64;
+
+    TiledEXRWriter(const std::string& filename, int width, int height, std::vector<EXRChannel> channels)
+            : m_filename(filename), m_width(width), m_height(height), m_channels(std::move(channels)) {
+        std::sort(m_channels.begin(), m_channels.end(),
+                  [](const EXRChannel& a, const EXRChannel& b) { return a.name < b.name; });
+        m_tilesX = (width + TileSize - 1) / TileSize;
+        m_tilesY = (height + TileSize - 1) / TileSize;
+    }
+
+    ~TiledEXRWriter() { close(); }
+
+    int getTilesY() const { return m_tilesY; }
+
+    /**
+     * Creates the file and starts the I/O thread.
+     */
+    bool open() {
+        m_file = std::fopen(m_filename.c_str(), "wb");
+        if (!m_file) {
+            std::cerr << "Could not create EXR image " << m_filename << std::endl;
+            return false;
+        }
+        const std::vector<unsigned char> header = getHeader();
+        std::fwrite(header.data(), 1, header.size(), m_file);
+        m_tableOffset = header.size();
+        m_offsets.assign(size_t(m_tilesX) * m_tilesY, 0);
+        std::fwrite(m_offsets.data(), sizeof(uint64_t), m_offsets.size(), m_file);
+        m_end = m_tableOffset + sizeof(uint64_t) * m_offsets.size();
+        m_done = false;
+        m_thread = std::thread(&TiledEXRWriter::run, this);
+        return true;
+    }
+
+    /**
+     * Queues the tiles of tile row `ty` (image rows [ty * TileSize, (ty + 1) * TileSize)), which must be final.
+     */
+    void writeTileRow(int ty) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (int tx = 0; tx < m_tilesX; tx++) m_queue.push_back(ty * m_tilesX + tx);
+        }
+        m_cv.notify_one();
+    }
+
+    /**
+     * Flushes the queued tiles and writes the offset table.
+     */
+    bool close() {
+        if (!m_file) return false;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_done = true;
+        }
+        m_cv.notify_one();
+        m_thread.join();
+
+        bool complete = true;
+        for (uint64_t o : m_offsets) complete &= o != 0;
+        std::fseek(m_file, long(m_tableOffset), SEEK_SET);
+        std::fwrite(m_offsets.data(), sizeof(uint64_t), m_offsets.size(), m_file);
+        const bool ok = std::fclose(m_file) == 0 && complete;
+        m_file = nullptr;
+        if (ok) std::cout << "\nSaved EXR image to " << m_filename << std::endl;
+        else std::cerr << "Incomplete EXR image " << m_filename << std::endl;
+        return ok;
+    }
+
+private:
+    std::string m_filename;
+    int m_width, m_height;
+    std::vector<EXRChannel> m_channels;
+    int m_tilesX, m_tilesY;
+
+    std::FILE* m_file = nullptr;
+    size_t m_tableOffset = 0;
+    /* File offset of each tile (0 until written), and end of the file */
+    std::vector<uint64_t> m_offsets;
+    size_t m_end = 0;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<int> m_queue;
+    bool m_done = false;
+
+    template<typename T>
+    static void put(std::vector<unsigned char>& out, const T& v) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(&v);
+        out.insert(out.end(), p, p + sizeof(T));
+    }
+
+    static void putString(std::vector<unsigned char>& out, const std::string& s) {
+        out.insert(out.end(), s.begin(), s.end());
+        out.push_back(0);
+    }
+
+    static void putAttribute(std::vector<unsigned char>& out, const char* name, const char* type,
+                             const std::vector<unsigned char>& value) {
+        putString(out, name);
+        putString(out, type);
+        put(out, int32_t(value.size()));
+        out.insert(out.end(), value.begin(), value.end());
+    }
+
+    std::vector<unsigned char> getHeader() const {
+        std::vector<unsigned char> h, v;
+        put(h, uint32_t(20000630)); // Magic number
+        put(h, uint32_t(2 | 0x200)); // Version 2, single-part tiled
+
+        for (const EXRChannel& c : m_channels) {
+            putString(v, c.name);
+            put(v, int32_t(c.half ? 1 : 2)); // HALF, FLOAT
+            put(v, uint32_t(0));             // pLinear, reserved
+            put(v, int32_t(1));
+            put(v, int32_t(1));
+        }
+        v.push_back(0);
+        putAttribute(h, "channels", "chlist", v);
+
+        putAttribute(h, "compression", "compression", {3}); // ZIP
+        v.clear();
+        for (int32_t x : {0, 0, m_width - 1, m_height - 1}) put(v, x);
+        putAttribute(h, "dataWindow", "box2i", v);
+        putAttribute(h, "displayWindow", "box2i", v);
+        // Tiles are stored as they complete, and located through the offset table. Still declared as
+        // INCREASING_Y, as tinyexr flips the rows of tiles of any other line order
+        putAttribute(h, "lineOrder", "lineOrder", {0});
+        v.clear();
+        put(v, 1.f);
+        putAttribute(h, "pixelAspectRatio", "float", v);
+        putAttribute(h, "screenWindowWidth", "float", v);
+        v.clear();
+        put(v, 0.f);
+        put(v, 0.f);
+        putAttribute(h, "screenWindowCenter", "v2f", v);
+        v.clear();
+        put(v, uint32_t(TileSize));
+        put(v, uint32_t(TileSize));
+        v.push_back(0); // ONE_LEVEL, ROUND_DOWN
+        putAttribute(h, "tiles", "tiledesc", v);
+        h.push_back(0);
+        return h;
+    }
+
+    /// Tile data: for each scanline, the pixels of each channel
+    void packTile(int tx, int ty, std::vector<unsigned char>& raw) const {
+        const int x0 = tx * TileSize, x1 = std::min(x0 + TileSize, m_width);
+        const int y0 = ty * TileSize, y1 = std::min(y0 + TileSize, m_height);
+        raw.clear();
+        for (int y = y0; y < y1; y++) {
+            for (const EXRChannel& c : m_channels) {
+                const float* p = c.data + (size_t(y) * m_width + x0) * c.stride;
+                for (int x = x0; x < x1; x++, p += c.stride) {
+                    if (c.half) put(raw, floatToHalf(*p));
+                    else put(raw, *p);
+                }
+            }
+        }
+    }
+
+    /// EXR ZIP compression: byte deinterleaving, delta predictor, then zlib
+    static void compressZip(const std::vector<unsigned char>& raw, std::vector<unsigned char>& tmp,
+                            std::vector<unsigned char>& out) {
+        const size_t n = raw.size();
+        tmp.resize(n);
+        const size_t half = (n + 1) / 2;
+        for (size_t i = 0; i < n; i++) tmp[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+        for (size_t i = n - 1; i > 0; i--) tmp[i] = (unsigned char) (int(tmp[i]) - int(tmp[i - 1]) + 128);
+
+        tinyexr::miniz::mz_ulong size = tinyexr::miniz::mz_compressBound(tinyexr::miniz::mz_ulong(n));
+        out.resize(size);
+        if (tinyexr::miniz::mz_compress(out.data(), &size, tmp.data(), tinyexr::miniz::mz_ulong(n)) != 0 || size >= n)
+            out = raw; // Stored uncompressed when it doesn't pay off
+        else
+            out.resize(size);
+    }
+
+    void run() {
+        std::vector<unsigned char> raw, tmp, data, chunk;
+        for (;;) {
+            int tile;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_done || !m_queue.empty(); });
+                if (m_queue.empty()) return;
+                tile = m_queue.front();
+                m_queue.pop_front();
+            }
+            const int tx = tile % m_tilesX, ty = tile / m_tilesX;
+            packTile(tx, ty, raw);
+            compressZip(raw, tmp, data);
+
+            chunk.clear();
+            for (int32_t i : {tx, ty, 0, 0, int32_t(data.size())}) put(chunk, i);
+            chunk.insert(chunk.end(), data.begin(), data.end());
+            std::fwrite(chunk.data(), 1, chunk.size(), m_file);
+            m_offsets[tile] = m_end;
+            m_end += chunk.size();
+        }
+    }
+};
+
+TR_NAMESPACE_END
@@ -0,0 +1,164 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <mutex>
+#include <core/core.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Separable pixel reconstruction filter, tabulated over [0, radius).
+ * Radii and parameters follow pbrt-v3 defaults.
+ */
+struct Filter {
+    static const int TableSize = 64;
+
+    EPixelFilter type;
+    float radius;
+    float table[TableSize];
+
+    explicit Filter(EPixelFilter type) : type(type) {
+        // Box, Gaussian, Mitchell, Lanczos
+        static const float radii[EPixelFilters] = {0.5f, 2.f, 2.f, 4.f};
+        radius = radii[type];
+        for (int i = 0; i < TableSize; i++)
+            table[i] = eval1D((i + 0.5f) * radius / TableSize);
+    }
+
+    /// 1D profile at distance x (pixels) from the pixel center
+    float eval1D(float x) const {
+        x = std::abs(x);
+        switch (type) {
+            case EGaussianFilter: {
+                const float alpha = 2.f;
+                return std::max(0.f, std::exp(-alpha * x * x) - std::exp(-alpha * radius * radius));
+            }
+            case EMitchellFilter: {
+                // B = C = 1/3, over [0, 2]
+                const float B = 1.f / 3.f, C = 1.f / 3.f;
+                x = 2.f * x / radius;
+                if (x > 2.f) return 0.f;
+                if (x > 1.f)
+                    return ((-B - 6 * C) * x * x * x + (6 * B + 30 * C) * x * x + (-12 * B - 48 * C) * x
+                            + (8 * B + 24 * C)) / 6.f;
+                return ((12 - 9 * B - 6 * C) * x * x * x + (-18 + 12 * B + 6 * C) * x * x + (6 - 2 * B)) / 6.f;
+            }
+            case ELanczosFilter: {
+                // Windowed sinc, tau = 3
+                const float tau = 3.f;
+                auto sinc = [](float t) { return t < 1e-5f ? 1.f : std::sin(float(M_PI) * t) / (float(M_PI) * t); };
+                return x > radius ? 0.f : sinc(x) * sinc(x / tau);
+            }
+            default:
+                return x <= radius ? 1.f : 0.f;
+        }
+    }
+
+    float eval(float dx, float dy) const {
+        const int ix = std::min(int(std::abs(dx) * TableSize / radius), TableSize - 1);
+        const int iy = std::min(int(std::abs(dy) * TableSize / radius), TableSize - 1);
+        return table[ix] * table[iy];
+    }
+};
+
+/**
+ * Filter-weighted sums of the samples of a band of rows, plus the margin their splats reach.
+ * Tiles are private to the thread rendering them, then merged into the film.
+ */
+struct FilmTile {
+    int y0, y1;
+    int width;
+    std::vector<v3f> sum;
+    std::vector<float> weight;
+
+    FilmTile(int y0, int y1, int width) : y0(y0), y1(y1), width(width) {
+        sum.assign(size_t(y1 - y0) * width, v3f(0.f));
+        weight.assign(size_t(y1 - y0) * width, 0.f);
+    }
+
+    /**
+     * Splats radiance L sampled in pixel (x, y), at position (ox, oy) in [0,1)^2 within the pixel,
+     * onto the pixels within the filter radius. The box filter only reaches pixel (x, y).
+     */
+    void addSample(const Filter& filter, int x, int y, float ox, float oy, const v3f& L) {
+        if (filter.type == EBoxFilter) {
+            add(x, y, L, 1.f);
+            return;
+        }
+        const float px = x + ox, py = y + oy;
+        const int xa = int(std::ceil(px - 0.5f - filter.radius)), xb = int(std::floor(px - 0.5f + filter.radius));
+        const int ya = int(std::ceil(py - 0.5f - filter.radius)), yb = int(std::floor(py - 0.5f + filter.radius));
+        for (int j = std::max(ya, y0); j <= std::min(yb, y1 - 1); j++)
+            for (int i = std::max(xa, 0); i <= std::min(xb, width - 1); i++)
+                add(i, j, L, filter.eval(i + 0.5f - px, j + 0.5f - py));
+    }
+
+    /// Accumulates a tile covering a subset of this tile's rows
+    void merge(const FilmTile& tile) {
+        const size_t offset = size_t(tile.y0 - y0) * width;
+        for (size_t i = 0; i < tile.sum.size(); i++) {
+            sum[offset + i] += tile.sum[i];
+            weight[offset + i] += tile.weight[i];
+        }
+    }
+
+private:
+    void add(int x, int y, const v3f& L, float w) {
+        if (x < 0 || x >= width || y < y0 || y >= y1) return;
+        const size_t i = size_t(y - y0) * width + x;
+        sum[i] += w * L;
+        weight[i] += w;
+    }
+};
+
+/**
+ * Film accumulating filter-weighted samples into a render buffer.
+ * The buffer holds weighted sums until rows are developed (divided by their filter weights).
+ */
+struct Film {
+    RenderBuffer& rgb;
+    Filter filter;
+    /* Number of rows around a sample's pixel that its splat can reach */
+    int margin;
+    /* Sum of the filter weights of each pixel */
+    std::vector<float> weights;
+
+    Film(RenderBuffer& rgb, EPixelFilter type) : rgb(rgb), filter(type) {
+        margin = type == EBoxFilter ? 0 : int(std::ceil(filter.radius - 0.5f));
+        weights.assign(size_t(rgb.width) * rgb.height, 0.f);
+        rgb.clear();
+    }
+
+    /// Tile receiving the samples of rows [y0, y1)
+    FilmTile createTile(int y0, int y1) const {
+        return FilmTile(std::max(y0 - margin, 0), std::min(y1 + margin, rgb.height), rgb.width);
+    }
+
+    void mergeTile(const FilmTile& tile) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const size_t offset = size_t(tile.y0) * rgb.width;
+        for (size_t i = 0; i < tile.sum.size(); i++) {
+            rgb.data[offset + i] += tile.sum[i];
+            weights[offset + i] += tile.weight[i];
+        }
+    }
+
+    /// Normalizes rows [y0, y1), once all the samples splatting onto them are merged
+    void develop(int y0, int y1) {
+        for (size_t i = size_t(y0) * rgb.width; i < size_t(y1) * rgb.width; i++) {
+            // Negative lobes may leave (slightly) negative values
+            rgb.data[i] = weights[i] != 0.f ? glm::max(rgb.data[i] / weights[i], v3f(0.f)) : v3f(0.f);
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+};
+
+TR_NAMESPACE_END
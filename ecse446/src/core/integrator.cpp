@@ -5,7 +5,10 @@
     Derek Nowrouzezahrai, McGill University.
 */
 
+#include <chrono>
+
 #include <core/integrator.h>
+#include <core/denoiser.h>
 
 #include "tiny_obj_loader.h"
 
@@ -16,26 +19,119 @@ Integrator::Integrator(const Scene& scene) : scene(scene) { }
 bool Integrator::init() {
     rgb = std::unique_ptr<RenderBuffer>(new RenderBuffer(scene.config.width, scene.config.height));
     rgb->clear();
+    aovs.clear();
+    for (const auto& aov : scene.config.aovs)
+        aovs.emplace_back(aov.first, aov.second, scene.config.width, scene.config.height);
+    // Features guiding the denoiser (also written to the image)
+    if (scene.config.denoise) {
+        for (EAOV type : {EAOVAlbedo, EAOVNormal, EAOVDepth, EAOVVariance})
+            if (!getAOV(type)) aovs.emplace_back(type, true, scene.config.width, scene.config.height);
+    }
     return true;
 }
 
 void Integrator::cleanUp() {
+    if (scene.config.denoise) denoise();
     save();
 }
 
+AOVBuffer* Integrator::getAOV(EAOV type) {
+    for (AOVBuffer& aov : aovs)
+        if (aov.type == type) return &aov;
+    return nullptr;
+}
+
+void Integrator::denoise() {
+    const auto begin = std::chrono::steady_clock::now();
+    Denoiser denoiser(scene.config.denoiseRadius, scene.config.denoiseStrength);
+    denoiser.apply(*rgb, *getAOV(EAOVAlbedo), *getAOV(EAOVNormal), *getAOV(EAOVDepth), *getAOV(EAOVVariance),
+                   scene.config.spp > 1);
+    const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - begin;
+    std::cout << "Denoised in " << elapsed.count() << "s" << std::endl;
+}
+
 bool Integrator::save() {
-    fs::path p = scene.config.tomlFile;
-    saveEXR(rgb->data, p.replace_extension("exr").string(), scene.config.width, scene.config.height);
-    return true;
+    if (stream) {
+        const bool ok = stream->close();
+        stream.reset();
+        return ok;
+    }
+    return saveEXR(getEXRChannels(), getOutputFile(), scene.config.width, scene.config.height);
+}
+
+std::string Integrator::getOutputFile() const {
+    return getOutputPath(scene.config, "exr");
+}
+
+std::vector<EXRChannel> Integrator::getEXRChannels() const {
+    const float* data = &rgb->data[0].x;
+    std::vector<EXRChannel> channels = {{"R", data + 0, 3, false}, {"G", data + 1, 3, false}, {"B", data + 2, 3, false}};
+    for (const AOVBuffer& aov : aovs) {
+        const auto& names = aov.getChannels();
+        for (size_t c = 0; c < names.size(); c++)
+            channels.push_back({std::string(AOVBuffer::getName(aov.type)) + "." + names[c],
+                                aov.data.data() + c, int(names.size()), aov.half});
+    }
+    return channels;
+}
+
+bool Integrator::beginStreaming() {
+    if (scene.config.denoise) return false;
+    stream = std::unique_ptr<TiledEXRWriter>(
+            new TiledEXRWriter(getOutputFile(), scene.config.width, scene.config.height, getEXRChannels()));
+    if (!stream->open()) stream.reset();
+    return bool(stream);
+}
+
+void Integrator::streamTileRow(int ty) {
+    if (stream) stream->writeTileRow(ty);
+    if (onTileRow) onTileRow(ty);
+}
+
+void Integrator::renderFeatures(const Ray& ray, v3f& albedo, v3f& normal, float& depth) const {
+    SurfaceInteraction hit;
+    albedo = normal = v3f(0.f);
+    depth = INFINITY;
+    if (!scene.bvh->intersect(ray, hit)) return;
+
+    albedo = getMaterial(hit)->getAlbedo(hit);
+    normal = hit.frameNs.n;
+    depth = glm::distance(ray.o, hit.p);
+}
+
+void Integrator::writeAOVs(int x, int y, const Ray& ray, const v3f& sum, const v3f& sumSq, int spp, float seconds) {
+    if (aovs.empty()) return;
+
+    v3f albedo, normal;
+    float depth;
+    renderFeatures(ray, albedo, normal, depth);
+
+    for (AOVBuffer& aov : aovs) {
+        float* v = aov.at(x, y);
+        switch (aov.type) {
+            case EAOVAlbedo: v[0] = albedo.x; v[1] = albedo.y; v[2] = albedo.z; break;
+            case EAOVNormal: v[0] = normal.x; v[1] = normal.y; v[2] = normal.z; break;
+            case EAOVDepth: v[0] = depth; break;
+            case EAOVVariance: {
+                // Variance of the pixel mean (unbiased sample variance / spp)
+                const v3f var = spp > 1 ? glm::max((sumSq - sum * sum / float(spp)) / float(spp - 1), v3f(0.f)) / float(spp)
+                                        : v3f(0.f);
+                v[0] = var.x; v[1] = var.y; v[2] = var.z;
+                break;
+            }
+            case EAOVSampleCount: v[0] = float(spp); break;
+            case EAOVTime: v[0] = seconds; break;
+            default: break;
+        }
+    }
 }
 
 const Emitter& Integrator::getEmitterByID(const int emitterID) const {
     return scene.emitters[emitterID];
 }
-const BSDF* Integrator::getBSDF(const SurfaceInteraction& hit) const {
-    assert(hit.shapeID < scene.worldData.shapes.size());
-    const tinyobj::shape_t& shape = scene.worldData.shapes[hit.shapeID];
-    return scene.bsdfs[shape.mesh.material_ids[hit.primID]].get();
+const Material* Integrator::getMaterial(const SurfaceInteraction& hit) const {
+    assert(size_t(hit.matID) < scene.materialTable.size());
+    return &scene.materialTable[hit.matID];
 }
 
 v3f Integrator::getEmission(const SurfaceInteraction& hit) const {
@@ -98,4 +194,149 @@ void Integrator::sampleEmitterPosition(Sampler& sampler, const Emitter& emitter,
 }
 
 
-TR_NAMESPACE_END
\ No newline at end of file
+void Integrator::getEmitterTriangle(const Emitter& emitter, size_t primID, v3f v[3], v3f& ng) const {
+    const tinyobj::shape_t& shape = scene.worldData.shapes[emitter.shapeID];
+    auto& vx = scene.worldData.attrib.vertices;
+    auto& ns = scene.worldData.attrib.normals;
+
+    v3f nsSum(0.f);
+    for (int k = 0; k < 3; k++) {
+        const tinyobj::index_t& idx = shape.mesh.indices[3 * primID + k];
+        v[k] = v3f(vx[3 * idx.vertex_index + 0], vx[3 * idx.vertex_index + 1], vx[3 * idx.vertex_index + 2]);
+        if (idx.normal_index >= 0)
+            nsSum += v3f(ns[3 * idx.normal_index + 0], ns[3 * idx.normal_index + 1], ns[3 * idx.normal_index + 2]);
+    }
+
+    ng = glm::cross(v[1] - v[0], v[2] - v[0]);
+    const float len = glm::length(ng);
+    ng = len > 0.f ? ng / len : v3f(0.f);
+    if (glm::dot(ng, nsSum) < 0.f) ng = -ng;
+}
+
+/* Spherical triangles outside of this range (in sr) are sampled by area, for robustness */
+static const float MinSphericalTriangleArea = 3e-4f;
+static const float MaxSphericalTriangleArea = 6.22f;
+
+/// Bilinear weights approximating the cosine over the spherical triangle (corners b, b, a, c)
+static void getTriangleCosineWeights(const v3f& n, const v3f& a, const v3f& b, const v3f& c, float w[4]) {
+    w[0] = w[1] = std::max(0.01f, glm::dot(n, b));
+    w[2] = std::max(0.01f, glm::dot(n, a));
+    w[3] = std::max(0.01f, glm::dot(n, c));
+}
+
+void Integrator::sampleEmitterSolidAngle(Sampler& sampler, const Emitter& emitter, const v3f& x, const v3f& n,
+                                         v3f& wiW, float& pdf, float* dist) const {
+    const float d2Center = glm::length2(emitter.center - x);
+
+    // Outside of a sphere: uniform sampling of the subtended cone
+    if (emitter.shape == ESphereEmitter && d2Center > emitter.radius * emitter.radius) {
+        const float cosThetaMax = std::sqrt(1.f - emitter.radius * emitter.radius / d2Center);
+        const Frame frame(glm::normalize(emitter.center - x));
+        wiW = glm::normalize(frame.toWorld(Warp::squareToUniformCone(sampler.next2D(), cosThetaMax)));
+        pdf = Warp::squareToUniformConePdf(cosThetaMax);
+        if (dist) {
+            // Nearest intersection with the sphere
+            const float b = glm::dot(wiW, x - emitter.center);
+            *dist = -b - safeSqrt(b * b - d2Center + emitter.radius * emitter.radius);
+        }
+        return;
+    }
+
+    // Area sampling of the whole mesh, converted to solid angle
+    if (scene.config.triangleSampling == ETriangleArea) {
+        v3f ne, pos;
+        sampleEmitterPosition(sampler, emitter, ne, pos, pdf);
+        wiW = pos - x;
+        const float d2 = glm::length2(wiW);
+        wiW /= std::sqrt(d2);
+        const float cosL = glm::dot(ne, -wiW);
+        pdf = cosL > 0.f ? pdf * d2 / cosL : 0.f;
+        if (dist) *dist = std::sqrt(d2);
+        return;
+    }
+
+    // Pick a triangle by area, then sample the solid angle it subtends
+    const size_t primID = (size_t) emitter.faceAreaDistribution.sample(sampler.next());
+    const float pmf = emitter.faceAreaDistribution.pdf(primID);
+    v3f v[3], ng;
+    getEmitterTriangle(emitter, primID, v, ng);
+    pdf = 0.f;
+    if (glm::dot(ng, x - v[0]) <= 0.f) return; // Emitting side faces away
+
+    const v3f a = glm::normalize(v[0] - x), b = glm::normalize(v[1] - x), c = glm::normalize(v[2] - x);
+    const float solidAngle = Warp::sphericalTriangleArea(a, b, c);
+
+    if (solidAngle > MinSphericalTriangleArea && solidAngle < MaxSphericalTriangleArea) {
+        p2f u = sampler.next2D();
+        float warpPdf = 1.f;
+        if (scene.config.triangleSampling == ETriangleProjectedSolidAngle) {
+            float w[4];
+            getTriangleCosineWeights(n, a, b, c, w);
+            u = Warp::squareToBilinear(u, w);
+            warpPdf = Warp::squareToBilinearPdf(u, w);
+        }
+        float triPdf;
+        wiW = Warp::squareToSphericalTriangle(u, a, b, c, triPdf);
+        pdf = pmf * triPdf * warpPdf;
+        // Intersection with the plane of the triangle
+        if (dist) *dist = glm::dot(ng, v[0] - x) / std::min(glm::dot(ng, wiW), -1e-8f);
+        return;
+    }
+
+    // Small (or very large) spherical triangle: uniform area sampling of the triangle
+    const v2f uv = Warp::squareToUniformTriangle(sampler.next2D());
+    wiW = barycentric(v[0], v[1], v[2], uv.x, uv.y) - x;
+    const float d2 = glm::length2(wiW);
+    wiW /= std::sqrt(d2);
+    const float cosL = glm::dot(ng, -wiW);
+    const float triArea = 0.5f * glm::length(glm::cross(v[1] - v[0], v[2] - v[0]));
+    pdf = cosL > 0.f ? pmf / triArea * d2 / cosL : 0.f;
+    if (dist) *dist = std::sqrt(d2);
+}
+
+bool Integrator::isEmitterSample(const Emitter& emitter, const SurfaceInteraction& hit, float dist) const {
+    if (hit.shapeID != emitter.shapeID) return false;
+    return emitter.shape == ESphereEmitter || std::abs(hit.t - dist) <= 1e-3f * (1.f + dist);
+}
+
+float Integrator::getEmitterSolidAnglePdf(const Emitter& emitter, const v3f& x, const v3f& n,
+                                          const SurfaceInteraction& emitterHit) const {
+    const float d2Center = glm::length2(emitter.center - x);
+
+    if (emitter.shape == ESphereEmitter && d2Center > emitter.radius * emitter.radius) {
+        const float cosThetaMax = std::sqrt(1.f - emitter.radius * emitter.radius / d2Center);
+        return Warp::squareToUniformConePdf(cosThetaMax);
+    }
+
+    const v3f d = emitterHit.p - x;
+    const float d2 = glm::length2(d);
+
+    if (scene.config.triangleSampling == ETriangleArea) {
+        const float cosL = glm::dot(emitterHit.frameNs.n, -d) / std::sqrt(d2);
+        return cosL > 0.f ? d2 / (cosL * emitter.area) : 0.f;
+    }
+
+    const float pmf = emitter.faceAreaDistribution.pdf(emitterHit.primID);
+    v3f v[3], ng;
+    getEmitterTriangle(emitter, emitterHit.primID, v, ng);
+    if (glm::dot(ng, x - v[0]) <= 0.f) return 0.f;
+
+    const v3f a = glm::normalize(v[0] - x), b = glm::normalize(v[1] - x), c = glm::normalize(v[2] - x);
+    const float solidAngle = Warp::sphericalTriangleArea(a, b, c);
+
+    if (solidAngle > MinSphericalTriangleArea && solidAngle < MaxSphericalTriangleArea) {
+        float warpPdf = 1.f;
+        if (scene.config.triangleSampling == ETriangleProjectedSolidAngle) {
+            float w[4];
+            getTriangleCosineWeights(n, a, b, c, w);
+            warpPdf = Warp::squareToBilinearPdf(Warp::sphericalTriangleToSquare(glm::normalize(d), a, b, c), w);
+        }
+        return pmf * warpPdf / solidAngle;
+    }
+
+    const float cosL = glm::dot(ng, -d) / std::sqrt(d2);
+    const float triArea = 0.5f * glm::length(glm::cross(v[1] - v[0], v[2] - v[0]));
+    return cosL > 0.f ? pmf / triArea * d2 / cosL : 0.f;
+}
+
+TR_NAMESPACE_END
@@ -10,6 +10,7 @@
 #include <core/platform.h>
 #include <core/core.h>
 #include <core/accel.h>
+#include <bsdfs/material.h>
 
 TR_NAMESPACE_BEGIN
 
@@ -23,6 +24,11 @@ struct Integrator {
     const Scene& scene;
     std::vector<Sampler> samplers;
     std::unique_ptr<RenderBuffer> rgb;
+    std::vector<AOVBuffer> aovs;
+    /* Output image written as the final pass progresses, if no post-processing is needed */
+    std::unique_ptr<TiledEXRWriter> stream;
+    /* Called with each tile row of the final pass once it is final (e.g. to send it to a render server client) */
+    std::function<void(int)> onTileRow;
 
     explicit Integrator(const Scene& scene);
     virtual bool init();
@@ -30,6 +36,60 @@ struct Integrator {
     virtual v3f render(const Ray&, Sampler&) const = 0;
     bool save();
 
+    /**
+     * Output image file, and the channels written to it (RGB and AOVs).
+     */
+    std::string getOutputFile() const;
+    std::vector<EXRChannel> getEXRChannels() const;
+
+    /**
+     * Starts writing the output image while the final pass renders, unless it is post-processed.
+     * Returns false if the image will be saved at the end instead.
+     */
+    bool beginStreaming();
+
+    /**
+     * Called once all the rows of tile row `ty` (see TiledEXRWriter) are final,
+     * when streaming or when `onTileRow` is set.
+     */
+    void streamTileRow(int ty);
+
+    /**
+     * Training passes rendered before the final image (e.g. to learn a guiding distribution).
+     * Pass i is rendered with 2^i spp and its image is discarded.
+     */
+    virtual int getTrainingPasses() const { return 0; }
+    virtual void beginTrainingPass(int pass) { }
+    virtual void endTrainingPass(int pass) { }
+
+    /**
+     * Whether the image depends on the order in which its rows are rendered (e.g. a cache filled on the fly).
+     * Resumed and render farm images then differ from the image of an uninterrupted single process.
+     */
+    virtual bool isOrderDependent() const { return false; }
+
+    /**
+     * Features of the first visible surface along a camera ray, for the AOVs.
+     * Depth is +inf (and the other features zero) if nothing is hit.
+     */
+    virtual void renderFeatures(const Ray& ray, v3f& albedo, v3f& normal, float& depth) const;
+
+    /**
+     * Fills the AOVs of pixel (x, y) from its center ray, the sum and squared sum
+     * of its `spp` radiance samples, and the time spent on it.
+     */
+    void writeAOVs(int x, int y, const Ray& ray, const v3f& sum, const v3f& sumSq, int spp, float seconds);
+
+    /**
+     * AOV of the given type, if rendered.
+     */
+    AOVBuffer* getAOV(EAOV type);
+
+    /**
+     * Filters the RGB buffer guided by the albedo, normal, depth and variance AOVs.
+     */
+    void denoise();
+
     /**
      * Helper functions for emitter getters.
      */
@@ -38,9 +98,9 @@ struct Integrator {
     float getEmitterPdf(const Emitter& emitter) const;
 
     /**
-     * Retrieves BSDF at intersection point.
+     * Retrieves the material (flat BSDF record) at intersection point.
      */
-    const BSDF* getBSDF(const SurfaceInteraction& hit) const;
+    const Material* getMaterial(const SurfaceInteraction& hit) const;
 
     /**
      * Retrieves emission profile at intersection point, if any.
@@ -64,6 +124,35 @@ struct Integrator {
      * Returns a direction and PDF in solid angle measure.
      */
     void sampleEmitterDirection(Sampler& sampler, const Emitter& emitter, const v3f& n, v3f& d, float& pdf) const;
+
+    /**
+     * Samples a direction towards an emitter from a shading point at position x with normal n.
+     * Spheres are sampled uniformly within the cone they subtend. Other meshes pick a triangle
+     * by area, then sample it according to `Config::triangleSampling`.
+     * Returns the world direction and its PDF in solid angle measure (0 if the sample is invalid), and
+     * optionally the distance to the sampled point: the sample is unoccluded only if it is the first hit.
+     */
+    void sampleEmitterSolidAngle(Sampler& sampler, const Emitter& emitter, const v3f& x, const v3f& n,
+                                 v3f& wiW, float& pdf, float* dist = nullptr) const;
+
+    /**
+     * Whether the first hit along a direction sampled on an emitter is the sampled point, at distance `dist`,
+     * and not another part of the emitter in front of it. Spheres are convex, and their samples lie on the
+     * analytic sphere rather than on its triangles: any hit on them is accepted.
+     */
+    bool isEmitterSample(const Emitter& emitter, const SurfaceInteraction& hit, float dist) const;
+
+    /**
+     * PDF in solid angle measure with which sampleEmitterSolidAngle() generates
+     * the direction from x (normal n) towards the emitter point `emitterHit`.
+     */
+    float getEmitterSolidAnglePdf(const Emitter& emitter, const v3f& x, const v3f& n,
+                                  const SurfaceInteraction& emitterHit) const;
+
+    /**
+     * Vertices of a triangle of an emitter, and its geometric normal oriented like the shading normals.
+     */
+    void getEmitterTriangle(const Emitter& emitter, size_t primID, v3f v[3], v3f& ng) const;
 };
 
 TR_NAMESPACE_END
\ No newline at end of file
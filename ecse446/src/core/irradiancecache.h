@@ -0,0 +1,198 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <core/core.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Irradiance cache record (Ward '88, with Ward & Heckbert '92 gradients).
+ * Stores the indirect irradiance at a point along with its translational and
+ * rotational gradients (one gradient vector per color channel) and validity radius.
+ */
+struct IrradianceRecord {
+    /* World position of the record */
+    v3f p;
+    /* Shading normal at the record */
+    v3f n;
+    /* Indirect irradiance */
+    v3f E;
+    /* Translational gradient, one vector per RGB channel */
+    v3f gradT[3];
+    /* Rotational gradient, one vector per RGB channel */
+    v3f gradR[3];
+    /* Harmonic mean distance to the surfaces seen from the record */
+    float R;
+
+    /* Extrapolates the irradiance to a nearby point using the gradients */
+    v3f extrapolate(const v3f& pos, const v3f& normal) const {
+        const v3f dp = pos - p;
+        const v3f dn = glm::cross(n, normal);
+        v3f e = E;
+        for (int c = 0; c < 3; c++)
+            e[c] += glm::dot(dn, gradR[c]) + glm::dot(dp, gradT[c]);
+        return clampBelow(e, 0.f);
+    }
+};
+
+/**
+ * Irradiance cache.
+ * Records are stored in an octree over the scene bounds; each record is stored in every node,
+ * at the depth matching its area of influence, that overlaps that area. A lookup then only
+ * visits the nodes on the path from the root to the leaf containing the query point.
+ * Lookups and insertions can be called concurrently from the rendering threads: the octree only grows
+ * (nodes and records are published with release stores), so lookups don't lock, and insertions are
+ * serialized by a mutex.
+ */
+struct IrradianceCache {
+
+    struct Node {
+        /* Records of the node, newest first */
+        struct Entry {
+            IrradianceRecord record;
+            const Entry* next;
+        };
+
+        std::atomic<Node*> children[8];
+        std::atomic<const Entry*> records{nullptr};
+
+        Node() {
+            for (auto& child : children) child.store(nullptr, std::memory_order_relaxed);
+        }
+        ~Node() {
+            for (auto& child : children) delete child.load(std::memory_order_relaxed);
+            for (const Entry* e = records.load(std::memory_order_relaxed); e;) {
+                const Entry* next = e->next;
+                delete e;
+                e = next;
+            }
+        }
+    };
+
+    /* Maximum allowed interpolation error (Ward's 'a' parameter) */
+    float maxError;
+    /* Bounds on the record radii, relative to the scene bounding sphere */
+    float minRadius;
+    float maxRadius;
+
+    AABB bounds;
+    Node root;
+    size_t nbRecords = 0;
+    /* Serializes the insertions */
+    std::mutex mutex;
+
+    IrradianceCache(const AABB& sceneBounds, float error) : maxError(error) {
+        // Octree needs a cubic domain, slightly larger than the scene
+        const v3f center = sceneBounds.getCenter();
+        const v3f d = sceneBounds.max - sceneBounds.min;
+        const float halfSize = 0.5f * 1.01f * std::max(d.x, std::max(d.y, d.z));
+        bounds.min = center - v3f(halfSize);
+        bounds.max = center + v3f(halfSize);
+
+        const float sceneRadius = 0.5f * glm::length(d);
+        minRadius = 0.005f * sceneRadius;
+        maxRadius = 0.25f * sceneRadius;
+    }
+
+    /// Ward's weight of a record at a query point; records with w <= 1/a are rejected
+    inline float weight(const IrradianceRecord& r, const v3f& p, const v3f& n) const {
+        const float dn = safeSqrt(1.f - glm::dot(n, r.n));
+        const float dp = glm::length(p - r.p) / r.R;
+        return 1.f / std::max(dp + dn, 1e-6f);
+    }
+
+    /**
+     * Interpolates irradiance at p from the cached records.
+     * Returns false if no record is valid at p (a new one needs to be computed).
+     */
+    bool lookup(const v3f& p, const v3f& n, v3f& E) const {
+        const float minWeight = 1.f / maxError;
+        v3f sumE(0.f);
+        float sumW = 0.f;
+
+        const Node* node = &root;
+        v3f nodeMin = bounds.min, nodeMax = bounds.max;
+        while (node) {
+            for (const Node::Entry* e = node->records.load(std::memory_order_acquire); e; e = e->next) {
+                const IrradianceRecord& r = e->record;
+                // Reject records in front of the query point (Ward's d_i test)
+                if (glm::dot(p - r.p, 0.5f * (n + r.n)) < -0.01f * r.R) continue;
+                const float w = weight(r, p, n);
+                if (w <= minWeight) continue;
+                sumE += w * r.extrapolate(p, n);
+                sumW += w;
+            }
+
+            // Descend to the child that contains p
+            const v3f mid = 0.5f * (nodeMin + nodeMax);
+            int child = 0;
+            for (int a = 0; a < 3; a++) {
+                if (p[a] > mid[a]) { child |= 1 << a; nodeMin[a] = mid[a]; }
+                else nodeMax[a] = mid[a];
+            }
+            node = node->children[child].load(std::memory_order_acquire);
+        }
+
+        if (sumW <= 0.f) return false;
+        E = sumE / sumW;
+        return true;
+    }
+
+    /// Adds a new record to the cache
+    void insert(IrradianceRecord r) {
+        r.R = clamp(r.R, minRadius, maxRadius);
+
+        // Area of influence of the record: points where its weight is above 1/a
+        const float influence = maxError * r.R;
+        AABB recordBounds;
+        recordBounds.min = r.p - v3f(influence);
+        recordBounds.max = r.p + v3f(influence);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        insert(&root, bounds.min, bounds.max, r, recordBounds, 2.f * influence);
+        nbRecords++;
+    }
+
+  private:
+    void insert(Node* node, const v3f& nodeMin, const v3f& nodeMax,
+                const IrradianceRecord& r, const AABB& recordBounds, float diameter) {
+        // Store the record once its area of influence is comparable to the node size
+        const float size = nodeMax.x - nodeMin.x;
+        if (size < 2.f * diameter) {
+            node->records.store(new Node::Entry{r, node->records.load(std::memory_order_relaxed)},
+                                std::memory_order_release);
+            return;
+        }
+
+        const v3f mid = 0.5f * (nodeMin + nodeMax);
+        for (int child = 0; child < 8; child++) {
+            v3f childMin, childMax;
+            for (int a = 0; a < 3; a++) {
+                childMin[a] = (child & (1 << a)) ? mid[a] : nodeMin[a];
+                childMax[a] = (child & (1 << a)) ? nodeMax[a] : mid[a];
+            }
+
+            bool overlaps = true;
+            for (int a = 0; a < 3; a++)
+                overlaps &= recordBounds.min[a] <= childMax[a] && recordBounds.max[a] >= childMin[a];
+            if (!overlaps) continue;
+
+            Node* next = node->children[child].load(std::memory_order_relaxed);
+            if (!next) {
+                next = new Node();
+                node->children[child].store(next, std::memory_order_release);
+            }
+            insert(next, childMin, childMax, r, recordBounds, diameter);
+        }
+    }
+};
+
+TR_NAMESPACE_END
@@ -64,6 +64,55 @@ inline float getLuminance(const v3f& rgb) {
     return glm::dot(rgb, v3f(0.212671f, 0.715160f, 0.072169f));
 }
 
+/**
+ * IEEE 754 half precision conversions (used for compact texture storage).
+ * Rounds to nearest, keeps denormals, infinities and NaNs.
+ */
+inline uint16_t floatToHalf(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    const uint32_t sign = (x >> 16) & 0x8000u;
+    const uint32_t biased = (x >> 23) & 0xffu;
+    uint32_t mant = x & 0x7fffffu;
+    if (biased == 0xffu) return uint16_t(sign | 0x7c00u | (mant ? 0x200u : 0u));
+    const int exp = int(biased) - 127 + 15;
+    if (exp >= 31) return uint16_t(sign | 0x7c00u);
+    if (exp <= 0) {
+        if (exp < -10) return uint16_t(sign);
+        mant |= 0x800000u;
+        const int shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        if ((mant >> (shift - 1)) & 1u) h++;
+        return uint16_t(sign | h);
+    }
+    uint32_t h = sign | (uint32_t(exp) << 10) | (mant >> 13);
+    if (mant & 0x1000u) h++; // A carry into the exponent is the correctly rounded result
+    return uint16_t(h);
+}
+
+inline float halfToFloat(uint16_t h) {
+    const uint32_t sign = uint32_t(h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1fu;
+    uint32_t mant = h & 0x3ffu;
+    uint32_t x;
+    if (exp == 0) {
+        if (mant == 0) {
+            x = sign;
+        } else {
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400u)) { mant <<= 1; exp--; }
+            x = sign | (exp << 23) | ((mant & 0x3ffu) << 13);
+        }
+    } else if (exp == 31) {
+        x = sign | 0x7f800000u | (mant << 13);
+    } else {
+        x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
 /**
  * Pseudo-random sampler (Mersenne Twister 19937) structure.
  */
@@ -229,6 +278,118 @@ inline float squareToUniformConePdf(float cosThetaMax) {
     return pdf;
 }
 
+/**
+ * Numerically robust angle between two unit vectors.
+ */
+inline float angleBetween(const v3f& a, const v3f& b) {
+    if (glm::dot(a, b) < 0.f)
+        return M_PI - 2.f * std::asin(std::min(1.f, glm::length(a + b) * 0.5f));
+    return 2.f * std::asin(std::min(1.f, glm::length(b - a) * 0.5f));
+}
+
+/**
+ * Solid angle of the spherical triangle with unit vertices a, b, c (from its interior angles).
+ * Returns 0 for degenerate triangles.
+ */
+inline float sphericalTriangleArea(const v3f& a, const v3f& b, const v3f& c) {
+    v3f nab = glm::cross(a, b), nbc = glm::cross(b, c), nca = glm::cross(c, a);
+    if (glm::length2(nab) == 0.f || glm::length2(nbc) == 0.f || glm::length2(nca) == 0.f) return 0.f;
+    nab = glm::normalize(nab); nbc = glm::normalize(nbc); nca = glm::normalize(nca);
+    return std::max(0.f, angleBetween(nab, -nca) + angleBetween(nbc, -nab) + angleBetween(nca, -nbc) - float(M_PI));
+}
+
+/**
+ * Uniform sampling of the spherical triangle with unit vertices a, b, c (Arvo '95).
+ * sample.x selects the sub-triangle area (a point c' on the arc ac), sample.y the position
+ * on the arc from b to c'. The corners of the square map to b (y = 0), a (0, 1) and c (1, 1).
+ * Sets pdf = 1 / solid angle (0 if the triangle is degenerate).
+ */
+inline v3f squareToSphericalTriangle(const p2f& sample, const v3f& a, const v3f& b, const v3f& c, float& pdf) {
+    pdf = 0.f;
+    v3f nab = glm::cross(a, b), nbc = glm::cross(b, c), nca = glm::cross(c, a);
+    if (glm::length2(nab) == 0.f || glm::length2(nbc) == 0.f || glm::length2(nca) == 0.f) return a;
+    nab = glm::normalize(nab); nbc = glm::normalize(nbc); nca = glm::normalize(nca);
+
+    const float alpha = angleBetween(nab, -nca);
+    const float beta = angleBetween(nbc, -nab);
+    const float gamma = angleBetween(nca, -nbc);
+    const float areaPi = alpha + beta + gamma;
+    if (areaPi - M_PI <= 0.f) return a;
+    pdf = 1.f / (areaPi - M_PI);
+
+    // Sub-triangle of area A' = sample.x * A: find c' on the arc ac
+    const float apPi = M_PI + sample.x * (areaPi - M_PI);
+    const float cosAlpha = std::cos(alpha), sinAlpha = std::sin(alpha);
+    const float sinPhi = std::sin(apPi) * cosAlpha - std::cos(apPi) * sinAlpha;
+    const float cosPhi = std::cos(apPi) * cosAlpha + std::sin(apPi) * sinAlpha;
+    const float k1 = cosPhi + cosAlpha;
+    const float k2 = sinPhi - sinAlpha * glm::dot(a, b);
+    float cosBp = (k2 + (k2 * cosPhi - k1 * sinPhi) * cosAlpha) / ((k2 * sinPhi + k1 * cosPhi) * sinAlpha);
+    cosBp = clamp(cosBp, -1.f, 1.f);
+    const float sinBp = safeSqrt(1.f - cosBp * cosBp);
+    const v3f cp = cosBp * a + sinBp * glm::normalize(c - glm::dot(c, a) * a);
+
+    // Uniform in solid angle along the arc from b to c'
+    const float cosTheta = 1.f - sample.y * (1.f - glm::dot(cp, b));
+    const float sinTheta = safeSqrt(1.f - cosTheta * cosTheta);
+    const v3f t = cp - glm::dot(cp, b) * b;
+    if (glm::length2(t) == 0.f) return b;
+    return glm::normalize(cosTheta * b + sinTheta * glm::normalize(t));
+}
+
+/**
+ * Inverse of squareToSphericalTriangle(): the sample that maps to the unit direction w.
+ */
+inline p2f sphericalTriangleToSquare(const v3f& w, const v3f& a, const v3f& b, const v3f& c) {
+    v3f nab = glm::cross(a, b), nbc = glm::cross(b, c), nca = glm::cross(c, a);
+    if (glm::length2(nab) == 0.f || glm::length2(nbc) == 0.f || glm::length2(nca) == 0.f) return p2f(0.5f);
+    nab = glm::normalize(nab); nbc = glm::normalize(nbc); nca = glm::normalize(nca);
+
+    const float alpha = angleBetween(nab, -nca);
+    const float beta = angleBetween(nbc, -nab);
+    const float gamma = angleBetween(nca, -nbc);
+
+    // c' is where the great circle through b and w meets the arc ac
+    v3f cp = glm::cross(glm::cross(b, w), glm::cross(c, a));
+    if (glm::length2(cp) == 0.f) return p2f(0.5f);
+    cp = glm::normalize(cp);
+    if (glm::dot(cp, a + c) < 0.f) cp = -cp;
+
+    float u0 = 0.f;
+    if (glm::dot(a, cp) < 0.99999847691f) {
+        v3f ncpb = glm::cross(cp, b), nacp = glm::cross(a, cp);
+        if (glm::length2(ncpb) == 0.f || glm::length2(nacp) == 0.f) return p2f(0.5f);
+        ncpb = glm::normalize(ncpb); nacp = glm::normalize(nacp);
+        const float ap = alpha + angleBetween(nab, ncpb) + angleBetween(nacp, -ncpb) - M_PI;
+        u0 = ap / (alpha + beta + gamma - M_PI);
+    }
+    const float u1 = (1.f - glm::dot(w, b)) / (1.f - glm::dot(cp, b));
+    return p2f(clamp(u0, 0.f, 1.f), clamp(u1, 0.f, 1.f));
+}
+
+/**
+ * Sampling of the bilinear function with corner values w = {f(0,0), f(1,0), f(0,1), f(1,1)}.
+ */
+inline float squareToLinear(float u, float a, float b) {
+    if (u == 0.f && a == 0.f) return 0.f;
+    const float x = u * (a + b) / (a + std::sqrt((1.f - u) * a * a + u * b * b));
+    return std::min(x, 1.f - 1e-6f);
+}
+
+inline p2f squareToBilinear(const p2f& sample, const float w[4]) {
+    p2f p;
+    p.y = squareToLinear(sample.y, w[0] + w[1], w[2] + w[3]);
+    p.x = squareToLinear(sample.x, (1.f - p.y) * w[0] + p.y * w[2], (1.f - p.y) * w[1] + p.y * w[3]);
+    return p;
+}
+
+inline float squareToBilinearPdf(const p2f& p, const float w[4]) {
+    const float sum = w[0] + w[1] + w[2] + w[3];
+    if (sum <= 0.f) return 1.f;
+    return 4.f * ((1.f - p.x) * (1.f - p.y) * w[0] + p.x * (1.f - p.y) * w[1] +
+                  (1.f - p.x) * p.y * w[2] + p.x * p.y * w[3]) / sum;
+}
+
 }
 
 TR_NAMESPACE_END
\ No newline at end of file
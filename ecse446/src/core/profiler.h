@@ -0,0 +1,157 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <core/core.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Frame profiler of the real-time passes: CPU time of each frame, and GPU time of the stages of a frame
+ * (e.g. G-buffer, SSAO, post-process) measured with timestamp queries.
+ * Queries are read back `Latency` frames after being issued, so that measuring doesn't stall the pipeline.
+ * Does nothing unless enabled.
+ */
+struct FrameProfiler {
+    static const int Latency = 4;
+
+    /* Timings (ms) of a series of frames */
+    struct Series {
+        std::string name;
+        std::vector<float> times;
+
+        float min() const { return times.empty() ? 0.f : *std::min_element(times.begin(), times.end()); }
+        float avg() const {
+            float sum = 0.f;
+            for (float t : times) sum += t;
+            return times.empty() ? 0.f : sum / times.size();
+        }
+        float percentile(float p) const {
+            if (times.empty()) return 0.f;
+            std::vector<float> sorted(times);
+            std::sort(sorted.begin(), sorted.end());
+            return sorted[std::min(size_t(std::ceil(p * sorted.size())), sorted.size()) - 1];
+        }
+    };
+
+    bool enabled = false;
+
+    void beginFrame() {
+        if (!enabled) return;
+        m_slot = m_frame % Latency;
+        // Queries issued Latency frames ago, reused by this frame
+        for (Stage& stage : m_stages) collect(stage, m_slot);
+        m_beginFrame = std::chrono::steady_clock::now();
+    }
+
+    /// Ends a frame, whose CPU time includes the swap (which waits for the GPU once frames queue up)
+    void endFrame() {
+        if (!enabled) return;
+        const std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - m_beginFrame;
+        m_cpu.times.push_back(elapsed.count());
+        m_frame++;
+    }
+
+    /// Starts timing a stage of the frame. Stages can be nested
+    void beginStage(const char* name) {
+        if (!enabled) return;
+        size_t i = 0;
+        while (i < m_stages.size() && m_stages[i].series.name != name) i++;
+        if (i == m_stages.size()) {
+            m_stages.emplace_back();
+            m_stages.back().series.name = name;
+            glGenQueries(2 * Latency, &m_stages.back().queries[0][0]);
+        }
+        glQueryCounter(m_stages[i].queries[m_slot][0], GL_TIMESTAMP);
+        m_open.push_back(i);
+    }
+
+    void endStage() {
+        if (!enabled || m_open.empty()) return;
+        Stage& stage = m_stages[m_open.back()];
+        m_open.pop_back();
+        glQueryCounter(stage.queries[m_slot][1], GL_TIMESTAMP);
+        stage.pending[m_slot] = true;
+    }
+
+    /// Waits for the queries in flight
+    void finish() {
+        if (!enabled) return;
+        for (Stage& stage : m_stages)
+            for (int slot = 0; slot < Latency; slot++) collect(stage, slot);
+    }
+
+    /// Frame and stage statistics over all the frames
+    void report(std::ostream& out) const {
+        out << "Profiled " << m_cpu.times.size() << " frames (ms)" << std::endl;
+        out << std::left << std::setw(16) << "" << std::right << std::setw(10) << "min" << std::setw(10) << "avg"
+            << std::setw(10) << "p99" << std::endl;
+        print(out, m_cpu);
+        for (const Stage& stage : m_stages) print(out, stage.series);
+    }
+
+    /// Averages since the last overlay, on one line
+    void printOverlay(std::ostream& out) {
+        out << std::fixed << std::setprecision(2) << "Frame " << average(m_cpu, m_overlayCPU) << " ms";
+        m_overlayCPU = m_cpu.times.size();
+        for (Stage& stage : m_stages) {
+            out << " | " << stage.series.name << " " << average(stage.series, stage.overlay) << " ms";
+            stage.overlay = stage.series.times.size();
+        }
+        out << std::defaultfloat << std::endl;
+    }
+
+    void cleanUp() {
+        for (Stage& stage : m_stages) glDeleteQueries(2 * Latency, &stage.queries[0][0]);
+        m_stages.clear();
+    }
+
+private:
+    struct Stage {
+        Series series;
+        GLuint queries[Latency][2]{};
+        bool pending[Latency]{};
+        /* Number of timings already shown by the overlay */
+        size_t overlay = 0;
+    };
+
+    Series m_cpu{"CPU frame", {}};
+    size_t m_overlayCPU = 0;
+    std::vector<Stage> m_stages;
+    /* Stages begun and not ended yet */
+    std::vector<size_t> m_open;
+    uint64_t m_frame = 0;
+    int m_slot = 0;
+    std::chrono::steady_clock::time_point m_beginFrame;
+
+    static void collect(Stage& stage, int slot) {
+        if (!stage.pending[slot]) return;
+        GLuint64 begin, end;
+        glGetQueryObjectui64v(stage.queries[slot][0], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(stage.queries[slot][1], GL_QUERY_RESULT, &end);
+        stage.series.times.push_back(float(end - begin) * 1e-6f);
+        stage.pending[slot] = false;
+    }
+
+    static float average(const Series& series, size_t from) {
+        float sum = 0.f;
+        for (size_t i = from; i < series.times.size(); i++) sum += series.times[i];
+        return series.times.size() > from ? sum / (series.times.size() - from) : 0.f;
+    }
+
+    static void print(std::ostream& out, const Series& series) {
+        out << std::left << std::setw(16) << series.name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << series.min() << std::setw(10) << series.avg() << std::setw(10)
+            << series.percentile(0.99f) << std::defaultfloat << std::endl;
+    }
+};
+
+TR_NAMESPACE_END
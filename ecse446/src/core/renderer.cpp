@@ -5,9 +5,15 @@
     Derek Nowrouzezahrai, McGill University.
 */
 
+#include <chrono>
+#include <set>
 #include <core/core.h>
 #include <core/accel.h>
 #include <core/renderer.h>
+#include <core/film.h>
+#include <core/checkpoint.h>
+#include <core/sensor.h>
+#include <core/distributed.h>
 #include <GL/glew.h>
 
 #ifdef __APPLE__
@@ -85,42 +91,48 @@ bool Renderer::init(const bool isRealTime, bool nogui) {
             throw std::runtime_error("Invalid renderpass type");
         }
 
-        bool succ = renderpass.get()->initOpenGL(scene.config.width, scene.config.height);
+        bool succ = renderpass.get()->initOpenGL(scene.config.width, scene.config.height, nogui);
         if (!succ) return false;
 
+        renderpass->interactive = !nogui && scene.config.benchmarkFrames == 0;
         return renderpass->init(scene.config);
     } else {
-        if (scene.config.integrator == ENormalIntegrator) {
-            integrator = std::unique_ptr<NormalIntegrator>(new NormalIntegrator(scene));
-        }
-        else if (scene.config.integrator == EAOIntegrator) {
-            integrator = std::unique_ptr<AOIntegrator>(new AOIntegrator(scene));
-        } else if (scene.config.integrator == EROIntegrator) {
-            integrator = std::unique_ptr<ROIntegrator>(new ROIntegrator(scene));
-        }
-        else if (scene.config.integrator == ESimpleIntegrator) {
-            integrator = std::unique_ptr<SimpleIntegrator>(new SimpleIntegrator(scene));
-        }
-        else if (scene.config.integrator == EDirectIntegrator) {
-            integrator = std::unique_ptr<DirectIntegrator>(new DirectIntegrator(scene));
-        }
-        else if (scene.config.integrator == EPolygonalIntegrator) {
-            integrator = std::unique_ptr<PolygonalIntegrator>(new PolygonalIntegrator(scene));
-        }
-        else if (scene.config.integrator == EPathTracerIntegrator) {
-            integrator = std::unique_ptr<PathTracerIntegrator>(new PathTracerIntegrator(scene));
-        }
-        else {
-            throw std::runtime_error("Invalid integrator type");
-        }
+        return initIntegrator();
+    }
+}
 
-        return integrator->init();
+bool Renderer::initIntegrator() {
+    if (scene.config.integrator == ENormalIntegrator) {
+        integrator = std::unique_ptr<NormalIntegrator>(new NormalIntegrator(scene));
+    }
+    else if (scene.config.integrator == EAOIntegrator) {
+        integrator = std::unique_ptr<AOIntegrator>(new AOIntegrator(scene));
+    } else if (scene.config.integrator == EROIntegrator) {
+        integrator = std::unique_ptr<ROIntegrator>(new ROIntegrator(scene));
+    }
+    else if (scene.config.integrator == ESimpleIntegrator) {
+        integrator = std::unique_ptr<SimpleIntegrator>(new SimpleIntegrator(scene));
     }
+    else if (scene.config.integrator == EDirectIntegrator) {
+        integrator = std::unique_ptr<DirectIntegrator>(new DirectIntegrator(scene));
+    }
+    else if (scene.config.integrator == EPolygonalIntegrator) {
+        integrator = std::unique_ptr<PolygonalIntegrator>(new PolygonalIntegrator(scene));
+    }
+    else if (scene.config.integrator == EPathTracerIntegrator) {
+        integrator = std::unique_ptr<PathTracerIntegrator>(new PathTracerIntegrator(scene));
+    }
+    else {
+        throw std::runtime_error("Invalid integrator type");
+    }
+
+    return integrator->init();
 }
 
 void Renderer::render() {
     if (realTime) {
 
+        if (scene.config.benchmarkFrames > 0) return benchmark();
 		if (nogui) return renderpass->render(); // Simply render a single image if --nogui is specified
 
         /**
@@ -167,18 +179,29 @@ void Renderer::render() {
 
         // gl_Position : default NDC coordinates, only vertices are between [-1,1] can be draw.
 
+        FrameProfiler& profiler = renderpass->profiler;
+        profiler.enabled = scene.config.profile;
+        auto lastOverlay = std::chrono::steady_clock::now();
         while(true)
         {
             SDL_Event event;
-            SDL_PollEvent( &event );
-            if ( event.type == SDL_QUIT )
+            if ( SDL_PollEvent( &event ) )
             {
-                break;
+                if ( event.type == SDL_QUIT ) break;
+                // Camera, and events of the renderpass (e.g. space bar for the polygonal pass shadows)
+                renderpass->handleEvents( event );
             }
-            else
-                renderpass->updateCamera( event );
+            profiler.beginFrame();
             renderpass->render();
             SDL_GL_SwapWindow( renderpass->window );
+            profiler.endFrame();
+
+            // Average timings, every second
+            const std::chrono::duration<float> sinceOverlay = std::chrono::steady_clock::now() - lastOverlay;
+            if (profiler.enabled && sinceOverlay.count() >= 1.f) {
+                profiler.printOverlay(std::cout);
+                lastOverlay = std::chrono::steady_clock::now();
+            }
         }
     } else {
         /**
@@ -193,82 +216,253 @@ void Renderer::render() {
          */
         // TODO(A1): Implement this
 
-        // camera parameters
-        // coordinate origin point position first, than perform basis transformation(camera uvw basis at origin point)
-        // lookat view matrix: basis transformation matrix * translation matrix ( * camera space position), world to camera
-
-        // Do not require persipective transformation in ray tracing.
-        // sphere to plane is not a conformal mapping, which causes stretching
-
-        // at, up is directions! not points
-        glm::vec3 at = scene.config.camera.at;
-        glm::vec3 eye = scene.config.camera.o;
-        glm::vec3 up = scene.config.camera.up;
-        // x point right, y point up, z point out
-        // negative direction -> inverse translation
-        // orthogonal transpose -> inverse basis transformation
-        // very important! translation is meaningless to vector, which implicit homogeneous w coordinate is zero
-        // it also means we only require inverse basis transformation to transform a vector from camera to world!!!
-        // so using transpose of lookup matrix instead of inverse can save computations.
-
-        // !!!!! OPENGL uses ( eye - center ) as camera direction vector!!!
-        // so objects only can be seen when the z coordinates in view space is negative !!!!!
-        glm::mat4 viewMatrix = glm::lookAt( eye, at, up );
         // clear RGB buffer
         integrator->rgb->clear();
 
-        // width of view plane
-        float fov = scene.config.camera.fov;
-        float distance = 1.0;
-        float height = tanf( fov / 360.0 * M_PI ) * distance * 2;
-        float width = scene.config.width * 1.0 / scene.config.height * height;
-        // donot know why using aspectRatio * fovScale as width
+        // Camera basis and pixel steps, computed once for all the passes
+        const Sensor sensor( scene.config );
+
+        // Renders row y with spp samples per pixel, splatting them into the tile and writing the AOVs.
+        // Camera rays are generated in batches; samples are jittered within 2x2 strata of the pixel,
+        // except the last one, through the pixel center (also used for the AOV features)
+        auto renderRow = [&](int y, int spp, int seed, const Filter& filter, FilmTile& tile) {
+            // thread safe random
+            Sampler sampler( seed + y );
+            const float differentialScale = 1.f / std::sqrt( float( spp ) );
+            const size_t nbSamples = size_t( scene.config.width ) * spp;
+            RayBatch batch;
+            v3f sum(0.f), sumSq(0.f);
+            auto beginPixel = std::chrono::steady_clock::now();
+
+            for (size_t first = 0; first < nbSamples; first += RayBatch::Size)
+            {
+                batch.count = int( std::min( nbSamples - first, size_t( RayBatch::Size ) ) );
+                for (int k = 0; k < batch.count; k++)
+                {
+                    const int x = int( (first + k) / spp ), i = int( (first + k) % spp );
+                    batch.px[k] = x + 0.5f;
+                    batch.py[k] = y + 0.5f;
+                    if (i < spp - 1) {
+                        const v2f r2 = sampler.next2D();
+                        batch.px[k] = x + (i % 2 + r2.x) / 2.f;
+                        batch.py[k] = y + (i / 2 % 2 + r2.y) / 2.f;
+                    }
+                    if (sensor.hasLens()) {
+                        const v2f lens = Warp::squareToUniformDiskConcentric( sampler.next2D() );
+                        batch.lensU[k] = lens.x;
+                        batch.lensV[k] = lens.y;
+                    }
+                }
+                sensor.generateRays( batch, differentialScale );
+
+                for (int k = 0; k < batch.count; k++)
+                {
+                    const int x = int( (first + k) / spp ), i = int( (first + k) % spp );
+                    const Ray& ray = batch.rays[k];
+                    const v3f L = integrator->render( ray, sampler );
+                    tile.addSample( filter, x, y, batch.px[k] - x, batch.py[k] - y, L );
+                    sum += L;
+                    sumSq += L * L;
+                    if (i < spp - 1) continue;
+
+                    const auto endPixel = std::chrono::steady_clock::now();
+                    const std::chrono::duration<float> pixelTime = endPixel - beginPixel;
+                    integrator->writeAOVs( x, y, ray, sum, sumSq, spp, pixelTime.count() );
+                    sum = sumSq = v3f(0.f);
+                    beginPixel = endPixel;
+                }
+            }
+        };
+
+        // Renders the whole image with spp samples per pixel into the RGB buffer,
+        // handing finished bands of rows to the output stream if requested.
+        // With a checkpoint, rows it records as done are skipped, and it is saved periodically.
+        auto renderImage = [&](int spp, int seed, bool streamRows, Checkpoint* checkpoint) {
+            Film film( *integrator->rgb, scene.config.pixelFilter );
+            if (checkpoint && scene.config.resume) {
+                if (checkpoint->load( film, integrator->aovs, scene.config.pixelFilter )) {
+                    std::cout << "Resuming from " << checkpoint->filename << " (" << checkpoint->getRowsDone()
+                              << "/" << scene.config.height << " rows done)" << std::endl;
+                    if (integrator->isOrderDependent())
+                        std::cerr << "The integrator's caches start empty again: the remaining rows won't match "
+                                     "an uninterrupted render" << std::endl;
+                } else
+                    std::cout << "No checkpoint to resume from, rendering from scratch" << std::endl;
+            }
+            auto isRowDone = [&](int y) { return checkpoint && checkpoint->isRowDone(y); };
+
+            // A band is final once all the rows splatting onto it are merged
+            const int bandSize = TiledEXRWriter::TileSize;
+            const int nbBands = (scene.config.height + bandSize - 1) / bandSize;
+            std::vector<int> rowsLeft(nbBands, 0);
+            for (int b = 0; b < nbBands; b++) {
+                const int y0 = std::max(b * bandSize - film.margin, 0);
+                const int y1 = std::min((b + 1) * bandSize + film.margin, scene.config.height);
+                for (int y = y0; y < y1; y++) rowsLeft[b] += !isRowDone(y);
+                // Resumed bands are already developed
+                if (rowsLeft[b] == 0 && streamRows) integrator->streamTileRow(b);
+            }
 
-        //sampler
-        int divideNum = 4;
-        int sqrtDivideNum = 2;
-        Sampler* sampler;
+            // Finished rows are merged, and checkpointed, one at a time
+            std::mutex rowMutex;
+            auto lastCheckpoint = std::chrono::steady_clock::now();
 
 #ifdef NDEBUG // Running in release mode - Use threads, start, end, *func
-        ThreadPool::ParallelFor(0, scene.config.height, [&] (int y)
-        {
+            ThreadPool::ParallelFor(0, scene.config.height, [&] (int y)
+            {
 #else   // Running in debug mode - Don't use threads
-        ThreadPool::SequentialFor(0, scene.config.height, [&](int y)
-        {
-#endif
-            // thread safe random
-            sampler = new Sampler( 47567 + y );
-            // Your code here
-            // for each pixel, y is paralleled
-            for (size_t x = 0; x < scene.config.width; x++)
+            ThreadPool::SequentialFor(0, scene.config.height, [&](int y)
             {
-                glm::fvec3 color(0, 0, 0);
-                // compute pixel center pos, start from left top
-                float xCenterPos = 0 +  width * (x - scene.config.width / 2.0 + 0.5) / scene.config.width;
-                float yCenterPos = 0 +  height * (scene.config.height - y - scene.config.height / 2.0 + 0.5) / scene.config.height;
+#endif
+                if (isRowDone(y)) return;
+                FilmTile tile = film.createTile( y, y + 1 );
+                renderRow( y, spp, seed, film.filter, tile );
+
+                std::lock_guard<std::mutex> lock( rowMutex );
+                film.mergeTile( tile );
+                for (int b = (tile.y0) / bandSize; b <= (tile.y1 - 1) / bandSize; b++) {
+                    if (--rowsLeft[b] > 0) continue;
+                    film.develop( b * bandSize, std::min((b + 1) * bandSize, scene.config.height) );
+                    if (streamRows) integrator->streamTileRow( b );
+                }
 
-                for (int i = 0; i < scene.config.spp - 1; i++)
-                {
-                    float xoffset = (i % sqrtDivideNum - sqrtDivideNum / 2.0 + 0.5) / sqrtDivideNum * width / scene.config.width;
-                    float yoffset = (i / sqrtDivideNum % sqrtDivideNum - sqrtDivideNum / 2.0 + 0.5) / sqrtDivideNum * height / scene.config.height;
-                    glm::fvec2 r2 = sampler->next2D();
-                    float xjitter = (r2[0] - 0.5) / sqrtDivideNum * width / scene.config.width;
-                    float yjitter = (r2[1] - 0.5) / sqrtDivideNum * height / scene.config.height;
-
-                    float xSamplePos = xCenterPos + xoffset + xjitter;
-                    float ySamplePos = yCenterPos + yoffset + yjitter;
-
-                    glm::fvec3 rayDirection = normalize( glm::fvec3( transpose(viewMatrix) * glm::fvec4( xSamplePos, ySamplePos, -distance, 0 ) ) );
-                    Ray ray = Ray( scene.config.camera.o, rayDirection );
-                    color += integrator->render( ray, *sampler ) / scene.config.spp;
+                if (!checkpoint) return;
+                checkpoint->setRowDone( y );
+                const std::chrono::duration<float> sinceCheckpoint = std::chrono::steady_clock::now() - lastCheckpoint;
+                if (scene.config.checkpointInterval > 0.f && sinceCheckpoint.count() >= scene.config.checkpointInterval) {
+                    checkpoint->save( film, integrator->aovs, scene.config.pixelFilter );
+                    lastCheckpoint = std::chrono::steady_clock::now();
+                }
+            });
+        };
+
+        // Renders the bands of the image leased from the render farm, until all of them are done.
+        // The coordinator then merges the films of all the bands into the RGB buffer.
+        auto renderFarm = [&](int spp, int seed) {
+            RenderFarm farm( scene.config, TiledEXRWriter::TileSize );
+            Film film( *integrator->rgb, scene.config.pixelFilter );
+            const bool coordinator = scene.config.farmRole == EFarmCoordinator;
+            if (coordinator) farm.setComplete( false );
+            if (integrator->isOrderDependent())
+                std::cerr << "Each process fills its own integrator caches: the image depends on how the bands "
+                             "are split between processes" << std::endl;
+
+            int nbRendered = 0;
+            for (bool pending = true; pending && !farm.isComplete(); ) {
+                pending = false;
+                for (int b = 0; b < farm.nbBands; b++) {
+                    if (farm.isDone( b )) continue;
+                    if (!farm.tryLease( b )) {
+                        pending = true;
+                        continue;
+                    }
+                    const int y0 = b * farm.bandSize, y1 = std::min((b + 1) * farm.bandSize, scene.config.height);
+                    FilmTile band = film.createTile( y0, y1 );
+                    std::mutex bandMutex;
+                    // Set when the lease was taken over (e.g. after a stall longer than the timeout)
+                    std::atomic<bool> leaseLost( false );
+#ifdef NDEBUG
+                    ThreadPool::ParallelFor(y0, y1, [&](int y) {
+#else
+                    ThreadPool::SequentialFor(y0, y1, [&](int y) {
+#endif
+                        if (leaseLost) return;
+                        FilmTile tile = film.createTile( y, y + 1 );
+                        renderRow( y, spp, seed, film.filter, tile );
+                        std::lock_guard<std::mutex> lock( bandMutex );
+                        band.merge( tile );
+                        if (!farm.renewLease( b )) leaseLost = true;
+                    });
+                    if (leaseLost) {
+                        // The new owner renders and submits the band
+                        std::cout << "Lost the lease of band " << b << std::endl;
+                        pending = true;
+                        continue;
+                    }
+                    if (!farm.submit( b, band, integrator->aovs ))
+                        throw std::runtime_error("Could not submit band " + std::to_string(b) + " to the render farm");
+                    nbRendered++;
                 }
-                glm::fvec3 rayDirection = normalize( glm::fvec3( transpose(viewMatrix) * glm::fvec4( xCenterPos, yCenterPos, -distance, 0 ) ) );
-                Ray ray = Ray( scene.config.camera.o, rayDirection );
-                color += integrator->render( ray, *sampler ) / scene.config.spp;
-                integrator->rgb->data[ y * scene.config.width + x ] = color;
+                // Wait for the bands leased by other processes
+                if (pending) std::this_thread::sleep_for( std::chrono::seconds(1) );
             }
-        });
+            std::cout << "Rendered " << nbRendered << "/" << farm.nbBands << " bands of the render farm" << std::endl;
+
+            if (!coordinator) return;
+            for (int b = 0; b < farm.nbBands; b++) {
+                if (!farm.collect( b, film, integrator->aovs ))
+                    throw std::runtime_error("Could not merge band " + std::to_string(b) + " of the render farm");
+            }
+            film.develop( 0, scene.config.height );
+            // Complete first: workers seeing the bands removed would lease and render them again
+            farm.setComplete( true );
+            farm.cleanUp();
+        };
+
+        // Training passes (e.g. path guiding), with doubling sample counts
+        const int nbTrainingPasses = integrator->getTrainingPasses();
+        for (int pass = 0; pass < nbTrainingPasses; pass++) {
+            const int spp = 1 << pass;
+            const clock_t beginPass = clock();
+            integrator->beginTrainingPass(pass);
+            renderImage(spp, 47567 + (pass + 1) * scene.config.height, false, nullptr);
+            integrator->endTrainingPass(pass);
+            std::cout << "Training pass " << pass + 1 << "/" << nbTrainingPasses << " (" << spp << " spp) done in "
+                      << float(clock() - beginPass) / CLOCKS_PER_SEC << "s" << std::endl;
+        }
+        if (nbTrainingPasses > 0) integrator->rgb->clear();
+
+        const auto beginRender = std::chrono::steady_clock::now();
+        if (scene.config.farmRole != EFarmNone) {
+            // Band files already make farm renders resumable
+            renderFarm(scene.config.spp, 47567);
+        } else {
+            const bool streaming = integrator->beginStreaming() || bool(integrator->onTileRow);
+            std::unique_ptr<Checkpoint> checkpoint;
+            if (scene.config.checkpointInterval > 0.f || scene.config.resume)
+                checkpoint = std::unique_ptr<Checkpoint>(new Checkpoint(scene.config, 47567));
+            renderImage(scene.config.spp, 47567, streaming, checkpoint.get());
+        }
+        const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - beginRender;
+        std::cout << "Rendered " << scene.config.spp << " spp in " << elapsed.count() << "s" << std::endl;
+    }
+}
+
+/**
+ * Renders the real-time pass for the configured number of frames, without vsync and with a fixed camera,
+ * then prints the frame timings. The first frame (which compiles shaders lazily and is saved) isn't counted.
+ */
+void Renderer::benchmark() {
+    FrameProfiler& profiler = renderpass->profiler;
+    const int frames = scene.config.benchmarkFrames;
+    renderpass->setVSync(false);
+    renderpass->render();
+    glFinish();
+
+    profiler.enabled = true;
+    const auto begin = std::chrono::steady_clock::now();
+    int frame = 0;
+    for (; frame < frames; frame++) {
+        if (!renderpass->headless) {
+            SDL_Event event;
+            bool quit = false;
+            while (SDL_PollEvent(&event)) quit |= event.type == SDL_QUIT;
+            if (quit) break;
+        }
+        profiler.beginFrame();
+        renderpass->render();
+        // Pbuffers aren't swapped: wait for the frame instead
+        if (renderpass->headless) glFinish();
+        else SDL_GL_SwapWindow(renderpass->window);
+        profiler.endFrame();
     }
+    profiler.finish();
+    const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - begin;
+
+    std::cout << "Benchmark: " << frame << " frames in " << elapsed.count() << "s ("
+              << frame / elapsed.count() << " fps)" << std::endl;
+    profiler.report(std::cout);
+    renderpass->setVSync(true);
 }
 
 /**
@@ -278,12 +472,19 @@ void Renderer::cleanUp() {
     if (realTime) {
         renderpass->cleanUp();
     } else {
+        // Workers hand their bands to the coordinator, which saves the image
+        if (scene.config.farmRole == EFarmWorker) return;
         integrator->cleanUp();
+        // The image is saved: checkpoints of this render are obsolete
+        if (scene.config.checkpointInterval > 0.f || scene.config.resume)
+            std::remove(Checkpoint::getFile(scene.config).c_str());
     }
 }
 
 BSDF::BSDF(const WorldData& d, const Config& c, const size_t matID) : worldData(d), config(c) {
     emission = glm::make_vec3(worldData.materials[matID].emission);
+    material.worldData = &worldData;
+    material.emission = emission;
 }
 
 Scene::Scene(const Config& config) : config(config) { }
@@ -310,6 +511,19 @@ bool Scene::load(bool isRealTime) {
         return false;
     }
 
+    // Load the textures referenced by the materials in parallel (each file once)
+    TextureCache::get().setBudget(size_t(config.textureMemory * (1 << 20)));
+    std::vector<std::string> texturePaths;
+    for (const tinyobj::material_t& mat : worldData.materials) {
+        for (const std::string& name : {mat.diffuse_texname, mat.specular_texname})
+            if (!name.empty()) texturePaths.push_back(resolveTexturePath(config, name));
+    }
+    std::sort(texturePaths.begin(), texturePaths.end());
+    texturePaths.erase(std::unique(texturePaths.begin(), texturePaths.end()), texturePaths.end());
+    ThreadPool::ParallelFor(0, int(texturePaths.size()), [&](int i) {
+        TextureCache::get().acquire(texturePaths[i], config.textureFilter);
+    });
+
     // Build list of BSDFs
     bsdfs = std::vector<std::unique_ptr<BSDF>>(worldData.materials.size());
     for (size_t i = 0; i < worldData.materials.size(); i++) {
@@ -321,6 +535,36 @@ bool Scene::load(bool isRealTime) {
             bsdfs[i] = std::unique_ptr<BSDF>(new MixtureBSDF(worldData, config, i));
     }
 
+    // Flatten the BSDF parameters into the material table used for offline shading
+    materialTable.assign(worldData.materials.size(), Material());
+    for (size_t i = 0; i < worldData.materials.size(); i++) {
+        if (bsdfs[i]) {
+            materialTable[i] = bsdfs[i]->material;
+        } else {
+            materialTable[i].worldData = &worldData;
+            materialTable[i].emission = glm::make_vec3(worldData.materials[i].emission);
+        }
+    }
+
+    // Report the memory used by textures, against full precision float storage
+    std::set<const Tex*> textures;
+    for (const Material& m : materialTable) {
+        if (m.diffuseReflectance.bitmap) textures.insert(m.diffuseReflectance.bitmap);
+        if (m.specularReflectance.bitmap) textures.insert(m.specularReflectance.bitmap);
+    }
+    if (!textures.empty()) {
+        size_t bytes = 0, floatBytes = 0;
+        for (const Tex* t : textures) {
+            bytes += t->getMemoryUsage();
+            floatBytes += size_t(t->w) * t->h * 3 * sizeof(float);
+        }
+        std::cout << "Textures: " << textures.size() << " using " << float(bytes) / (1 << 20) << " MB with mipmaps ("
+                  << float(floatBytes) / (1 << 20) << " MB as 32-bit float RGB without)";
+        if (TextureCache::get().getBudget() > 0)
+            std::cout << ", large textures paged within " << config.textureMemory << " MB";
+        std::cout << std::endl;
+    }
+
     // Build list of emitters (and print what has been loaded)
     std::string nbShapes = worldData.shapes.size() > 1 ? " shapes" : " shape";
     std::cout << "Found " << worldData.shapes.size() << nbShapes << std::endl;
@@ -333,15 +577,6 @@ bool Scene::load(bool isRealTime) {
         std::cout << "Mesh " << i << ": " << shape.name << " ["
                   << shape.mesh.indices.size() / 3 << " primitives | ";
 
-        if (bsdf->isEmissive()) {
-            Distribution1D faceAreaDistribution;
-            float shapeArea = getShapeArea(i, faceAreaDistribution);
-            emitters.emplace_back(Emitter{i, shapeArea, bsdf->emission, faceAreaDistribution});
-            std::cout << "Emitter]" << std::endl;
-        } else {
-            std::cout << bsdf->toString() << "]" << std::endl;
-        }
-
         // Build world AABB and shape centers
         worldData.shapesCenter[i] = v3f(0.0);
         for (auto idx: shape.mesh.indices) {
@@ -353,6 +588,18 @@ bool Scene::load(bool isRealTime) {
             aabb.expandBy(p);
         }
         worldData.shapesCenter[i] /= float(shape.mesh.indices.size());
+
+        if (bsdf->isEmissive()) {
+            Distribution1D faceAreaDistribution;
+            float shapeArea = getShapeArea(i, faceAreaDistribution);
+            v3f center;
+            float radius;
+            const EEmitterShape type = getShapeType(i, center, radius);
+            emitters.emplace_back(Emitter{i, shapeArea, bsdf->emission, faceAreaDistribution, type, center, radius});
+            std::cout << (type == ESphereEmitter ? "Sphere " : "") << "Emitter]" << std::endl;
+        } else {
+            std::cout << bsdf->toString() << "]" << std::endl;
+        }
     }
 
     // Build BVH
@@ -403,6 +650,44 @@ float Scene::getShapeRadius(const size_t shapeID) const {
     return worldData.shapesAABOX[shapeID].max.x - emitterCenter.x;
 }
 
+/**
+ * Detects tessellated spheres: all vertices are at the same distance from the center of the
+ * bounding box, and so are the triangle centroids (which excludes cubes and other polyhedra).
+ * Otherwise returns the bounding sphere of the shape.
+ */
+EEmitterShape Scene::getShapeType(const size_t shapeID, v3f& center, float& radius) const {
+    const tinyobj::shape_t& s = worldData.shapes[shapeID];
+    const AABB& box = worldData.shapesAABOX[shapeID];
+    center = box.getCenter();
+
+    float minDist = std::numeric_limits<float>::infinity(), maxDist = 0.f, sumDist = 0.f;
+    float minCentroidDist = std::numeric_limits<float>::infinity();
+    for (size_t i = 0; i < s.mesh.indices.size(); i += 3) {
+        v3f centroid(0.f);
+        for (size_t k = 0; k < 3; k++) {
+            const int idx = s.mesh.indices[i + k].vertex_index;
+            const v3f p{worldData.attrib.vertices[3 * idx + 0], worldData.attrib.vertices[3 * idx + 1],
+                        worldData.attrib.vertices[3 * idx + 2]};
+            const float d = glm::distance(p, center);
+            minDist = std::min(minDist, d);
+            maxDist = std::max(maxDist, d);
+            sumDist += d;
+            centroid += p / 3.f;
+        }
+        minCentroidDist = std::min(minCentroidDist, glm::distance(centroid, center));
+    }
+
+    radius = maxDist;
+    if (s.mesh.indices.empty()) return EMeshEmitter;
+
+    const float meanDist = sumDist / float(s.mesh.indices.size());
+    if (maxDist - minDist < 0.01f * meanDist && minCentroidDist > 0.95f * meanDist) {
+        radius = meanDist;
+        return ESphereEmitter;
+    }
+    return EMeshEmitter;
+}
+
 v3f Scene::getShapeCenter(const size_t shapeID) const {
     assert(shapeID < worldData.shapes.size());
     return worldData.shapesCenter[shapeID];
@@ -29,7 +29,10 @@ struct Renderer {
 
     explicit Renderer(const Config& config);
     bool init(bool isRealTime, bool nogui);
+    /* (Re)creates the offline integrator from the current config, keeping the loaded scene */
+    bool initIntegrator();
     void render();
+    void benchmark();
     void cleanUp();
 };
 
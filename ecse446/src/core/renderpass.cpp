@@ -9,8 +9,10 @@
 #include "core/renderpass.h"
 #include <bsdfs/diffuse.h>
 #include <bsdfs/phong.h>
+#include <cstring>
 #include <string>
 #include <fstream>
+#include <unordered_map>
 
 TR_NAMESPACE_BEGIN
 
@@ -46,10 +48,21 @@ bool RenderPass::init(const Config& config) {
 
     initPostProcessShader();
 
+    glGenBuffers(1, &frameUniformsUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUniformsUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
     return true;
 }
 
 void RenderPass::cleanUp() {
+    profiler.cleanUp();
+    glDeleteBuffers(1, &frameUniformsUBO);
+    glDeleteBuffers(1, &geometryVBO);
+    glDeleteBuffers(1, &geometryIBO);
+    glDeleteVertexArrays(1, &geometryVAO);
+
     // cleanup post-process shader
     glDeleteProgram(postprocess_quadShader);
     glDeleteBuffers(1, &postprocess_quadVBO);
@@ -58,13 +71,13 @@ void RenderPass::cleanUp() {
     glDeleteTextures(1, &postprocess_textureColor);
     glDeleteTextures(1, &postprocess_textureDepth);
 
-    SDL_GL_DeleteContext(contextGL);
-    SDL_DestroyWindow(window);
-    SDL_Quit();
+    destroyContext();
 }
 
 void RenderPass::render() {
+    profiler.beginStage("Post-process");
     renderPostProcessShader();
+    profiler.endStage();
 
     if (!isSaved) { // save first frame
         std::unique_ptr<GLfloat> data(new GLfloat[3 * nPixel]);
@@ -81,11 +94,18 @@ bool RenderPass::save(GLfloat* data) {
     return true;
 }
 
-bool RenderPass::initOpenGL(int width, int height) {
+bool RenderPass::initOpenGL(int width, int height, bool headless) {
     this->width = width;
     this->height = height;
     nPixel = width * height;
 
+    // Offscreen context: the passes render into their framebuffers as usual, and the saved image is read
+    // back from a pbuffer instead of a window
+    this->headless = headless && initOffscreenContext();
+    if (headless && !this->headless)
+        std::cout << "Can't create an offscreen OpenGL context, opening a window" << std::endl;
+    if (this->headless) return initGLEW();
+
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cout << "SDL_Init Error: " << SDL_GetError() << std::endl;
         return false;
@@ -106,7 +126,6 @@ bool RenderPass::initOpenGL(int width, int height) {
 
     SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
     SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
-    SDL_GL_SetSwapInterval(1); // enable vsync
 
     // Create OpenGL context
     contextGL = SDL_GL_CreateContext(window);
@@ -115,9 +134,27 @@ bool RenderPass::initOpenGL(int width, int height) {
         exit(EXIT_FAILURE);
     }
 
+    if (!initGLEW()) return false;
+    setVSync(true);
+
+    SDL_GL_SwapWindow(window);
+
+    return true;
+}
+
+void RenderPass::setVSync(bool vsync) {
+    // Needs the context (pbuffers aren't swapped)
+    if (!headless) SDL_GL_SetSwapInterval(vsync ? 1 : 0);
+}
+
+bool RenderPass::initGLEW() {
     // Init GLEW (needs to be called just after creating the OpenGL context)
     glewExperimental = GL_TRUE; // Enable most of the GL stuff we need...
     GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GLEW built for GLX loads the GL entry points, then fails on the GLX extensions of EGL contexts
+    if (headless && err == GLEW_ERROR_NO_GLX_DISPLAY) err = GLEW_OK;
+#endif
     if (GLEW_OK != err) {
         std::cout << "glewInit error: " << glewGetErrorString(err) << std::endl;
         exit(EXIT_FAILURE);
@@ -127,17 +164,91 @@ bool RenderPass::initOpenGL(int width, int height) {
         exit(EXIT_FAILURE);
     }
 
-    // Clear and swap
+    // Clear
     // glEnable(GL_CULL_FACE);
     // glCullFace(GL_BACK);
 
     glClearColor(0.0, 0.0, 0.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    SDL_GL_SwapWindow(window);
 
     return true;
 }
 
+bool RenderPass::initOffscreenContext() {
+#ifdef TR_HEADLESS_EGL
+    // Displays to try: each EGL device (GPU, or Mesa's software rasterizer), which needs no display server,
+    // then the default display
+    std::vector<EGLDisplay> displays;
+    auto queryDevices = (PFNEGLQUERYDEVICESEXTPROC) eglGetProcAddress("eglQueryDevicesEXT");
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (queryDevices && getPlatformDisplay) {
+        EGLDeviceEXT devices[16];
+        EGLint nDevices = 0;
+        if (queryDevices(16, devices, &nDevices))
+            for (EGLint i = 0; i < nDevices; i++)
+                displays.push_back(getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[i], nullptr));
+    }
+    displays.push_back(eglGetDisplay(EGL_DEFAULT_DISPLAY));
+
+    const EGLint configAttribs[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+            EGL_DEPTH_SIZE, 24,
+            EGL_NONE
+    };
+    const EGLint surfaceAttribs[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    // Same profile as the window context
+    const EGLint contextAttribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+            EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+            EGL_NONE
+    };
+
+    for (EGLDisplay display : displays) {
+        EGLint major, minor, nConfigs = 0;
+        EGLConfig config;
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) continue;
+        eglDisplay = display;
+        if (eglBindAPI(EGL_OPENGL_API) && eglChooseConfig(display, configAttribs, &config, 1, &nConfigs)
+            && nConfigs > 0) {
+            eglSurface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+            eglContext = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+            if (eglSurface != EGL_NO_SURFACE && eglContext != EGL_NO_CONTEXT
+                && eglMakeCurrent(display, eglSurface, eglSurface, eglContext)) {
+                std::cout << "Offscreen OpenGL context: " << glGetString(GL_RENDERER) << std::endl;
+                return true;
+            }
+        }
+        destroyContext();
+    }
+    std::cout << "EGL error: 0x" << std::hex << eglGetError() << std::dec << std::endl;
+    return false;
+#else
+    std::cout << "Offscreen OpenGL contexts need EGL (TR_HEADLESS_EGL)" << std::endl;
+    return false;
+#endif
+}
+
+void RenderPass::destroyContext() {
+#ifdef TR_HEADLESS_EGL
+    if (eglDisplay != EGL_NO_DISPLAY) {
+        eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (eglContext != EGL_NO_CONTEXT) eglDestroyContext(eglDisplay, eglContext);
+        if (eglSurface != EGL_NO_SURFACE) eglDestroySurface(eglDisplay, eglSurface);
+        eglTerminate(eglDisplay);
+        eglDisplay = EGL_NO_DISPLAY;
+        eglSurface = EGL_NO_SURFACE;
+        eglContext = EGL_NO_CONTEXT;
+        return;
+    }
+#endif
+    SDL_GL_DeleteContext(contextGL);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+}
+
 GLuint RenderPass::compileProgram(GLuint vs, GLuint fs) {
     printf("Linking program...\n");
 
@@ -167,6 +278,10 @@ GLuint RenderPass::compileProgram(GLuint vs, GLuint fs) {
     glDetachShader(program, vs);
     glDetachShader(program, fs);
 
+    // Per-frame uniforms come from the pass' uniform buffer
+    const GLuint frameBlock = glGetUniformBlockIndex(program, "FrameUniforms");
+    if (frameBlock != GL_INVALID_INDEX) glUniformBlockBinding(program, frameBlock, FRAME_UNIFORMS_BINDING);
+
     return program;
 }
 
@@ -222,72 +337,104 @@ std::string RenderPass::readFile(const char* filePath) {
     return str;
 }
 
-void RenderPass::buildVBO(size_t objectIdx) {
+/**
+ * Builds the vertex and index buffers of all the objects, and the VAO drawing them.
+ * Corners sharing a position and a normal are welded into one vertex, and each object is a range of the
+ * index buffer. With `packNormals`, normals are stored in 10 bits per component (16 bytes per vertex instead
+ * of 24); shaders still read them as vec3. No copy of the geometry is kept on the CPU.
+ * Returns the (position, normal) indices of the welded vertices.
+ */
+std::vector<tinyobj::index_t> RenderPass::buildGeometry() {
     const tinyobj::attrib_t& sa = scene.worldData.attrib;
-    const tinyobj::shape_t& s = scene.worldData.shapes[objectIdx];
-
-    GLObject& obj = objects[objectIdx];
-
-    obj.nVerts = s.mesh.indices.size();
-    obj.vertices.resize(obj.nVerts * N_ATTR_PER_VERT);
-    int k = 0;
-    for (size_t i = 0; i < s.mesh.indices.size(); i++) {
-        int idx = s.mesh.indices[i].vertex_index;
-        int idx_n = s.mesh.indices[i].normal_index;
-
-        // Position
-        obj.vertices[k + 0] = sa.vertices[3 * idx + 0];
-        obj.vertices[k + 1] = sa.vertices[3 * idx + 1];
-        obj.vertices[k + 2] = sa.vertices[3 * idx + 2];
-
-        // Normal
-        float nx = sa.normals[3 * idx_n + 0];
-        float ny = sa.normals[3 * idx_n + 1];
-        float nz = sa.normals[3 * idx_n + 2];
-        float norm = std::sqrt(nx * nx + ny * ny + nz * nz);
-        obj.vertices[k + 3] = nx / norm;
-        obj.vertices[k + 4] = ny / norm;
-        obj.vertices[k + 5] = nz / norm;
-
-        k += N_ATTR_PER_VERT;
+    const auto& shapes = scene.worldData.shapes;
+
+    // Weld corners on their (position, normal) indices
+    std::unordered_map<uint64_t, GLuint> welded;
+    std::vector<tinyobj::index_t> corners;
+    std::vector<GLuint> indices;
+    objects.resize(shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+        GLObject& obj = objects[i];
+        obj.firstIndex = indices.size();
+        for (const tinyobj::index_t& idx : shapes[i].mesh.indices) {
+            const uint64_t key = (uint64_t(uint32_t(idx.vertex_index)) << 32) | uint32_t(idx.normal_index);
+            const auto it = welded.emplace(key, GLuint(corners.size()));
+            if (it.second) corners.push_back(idx);
+            indices.push_back(it.first->second);
+        }
+        obj.nIndices = GLsizei(indices.size() - obj.firstIndex);
     }
 
-    // VBO
-    glGenVertexArrays(1, &obj.vao);
-    glBindVertexArray(obj.vao);
+    // Interleaved position and normal
+    const bool pack = scene.config.packNormals;
+    const size_t stride = pack ? 4 * sizeof(GLfloat) : N_ATTR_PER_VERT * sizeof(GLfloat);
+    std::vector<GLfloat> vertices(corners.size() * stride / sizeof(GLfloat));
+    GLfloat* v = vertices.data();
+    for (const tinyobj::index_t& idx : corners) {
+        v[0] = sa.vertices[3 * idx.vertex_index + 0];
+        v[1] = sa.vertices[3 * idx.vertex_index + 1];
+        v[2] = sa.vertices[3 * idx.vertex_index + 2];
+        const v3f n = glm::normalize(v3f(sa.normals[3 * idx.normal_index + 0], sa.normals[3 * idx.normal_index + 1],
+                                         sa.normals[3 * idx.normal_index + 2]));
+        if (pack) {
+            // Signed normalized 10-bit components (GL_INT_2_10_10_10_REV)
+            GLuint packed = 0;
+            for (int c = 0; c < 3; c++)
+                packed |= (GLuint(int(std::round(glm::clamp(n[c], -1.f, 1.f) * 511.f))) & 0x3ffu) << (10 * c);
+            std::memcpy(&v[3], &packed, sizeof(packed));
+        } else {
+            v[3] = n.x;
+            v[4] = n.y;
+            v[5] = n.z;
+        }
+        v += stride / sizeof(GLfloat);
+    }
 
-    glGenBuffers(1, &obj.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, obj.vbo);
-    glBufferData(GL_ARRAY_BUFFER,
-                 sizeof(GLfloat) * obj.nVerts * N_ATTR_PER_VERT,
-                 (GLvoid*) (&obj.vertices[0]),
-                 GL_STATIC_DRAW);
-}
+    glGenVertexArrays(1, &geometryVAO);
+    glBindVertexArray(geometryVAO);
 
-void RenderPass::buildVAO(size_t objectIdx) {
-    glBindVertexArray(objects[objectIdx].vao);
-    glBindBuffer(GL_ARRAY_BUFFER, objects[objectIdx].vbo);
+    glGenBuffers(1, &geometryVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, geometryVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+
+    // The element buffer binding is part of the VAO
+    glGenBuffers(1, &geometryIBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometryIBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), indices.data(), GL_STATIC_DRAW);
 
-    // Define vertices attributes
-    // if the layout index in shader is same as the first argument in glVertexAttribPointer
-    // then the related buffer data will be passed into shader variables with corresponding location automatically
     glEnableVertexAttribArray(posAttrib);
     glEnableVertexAttribArray(normalAttrib);
-    glVertexAttribPointer(posAttrib,
-                          3,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(GLfloat) * N_ATTR_PER_VERT,
-                          (GLvoid*) (0 * sizeof(GLfloat)));
-    glVertexAttribPointer(normalAttrib,
-                          3,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(GLfloat) * N_ATTR_PER_VERT,
-                          (GLvoid*) (3 * sizeof(GLfloat)));
+    glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, GLsizei(stride), (GLvoid*) 0);
+    if (pack)
+        glVertexAttribPointer(normalAttrib, 4, GL_INT_2_10_10_10_REV, GL_TRUE, GLsizei(stride),
+                              (GLvoid*) (3 * sizeof(GLfloat)));
+    else
+        glVertexAttribPointer(normalAttrib, 3, GL_FLOAT, GL_FALSE, GLsizei(stride), (GLvoid*) (3 * sizeof(GLfloat)));
 
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    std::cout << "Geometry: " << indices.size() << " corners welded into " << corners.size() << " vertices ("
+              << (sizeof(GLfloat) * vertices.size() + sizeof(GLuint) * indices.size()) / 1024 << " KB)" << std::endl;
+    return corners;
+}
+
+/// Draws an object's triangles, with geometryVAO bound
+void RenderPass::drawObject(const GLObject& obj) {
+    glDrawElements(GL_TRIANGLES, obj.nIndices, GL_UNSIGNED_INT, (GLvoid*) (obj.firstIndex * sizeof(GLuint)));
+}
+
+/// Draws the triangles of objects [begin, end) in one call, with geometryVAO bound
+void RenderPass::drawObjects(size_t begin, size_t end) {
+    std::vector<GLsizei> counts;
+    std::vector<const GLvoid*> offsets;
+    for (size_t i = begin; i < end; i++) {
+        counts.push_back(objects[i].nIndices);
+        offsets.push_back((const GLvoid*) (objects[i].firstIndex * sizeof(GLuint)));
+    }
+    if (!counts.empty())
+        glMultiDrawElements(GL_TRIANGLES, counts.data(), GL_UNSIGNED_INT, offsets.data(), GLsizei(counts.size()));
 }
 
 void RenderPass::assignShader(GLObject& obj,
@@ -330,6 +477,28 @@ void RenderPass::assignShader(GLObject& obj,
     }
 }
 
+void RenderPass::sortObjectsByShader() {
+    // Draws are then grouped by program, which is only switched between groups
+    std::stable_sort(objects.begin(), objects.end(),
+                     [](const GLObject& a, const GLObject& b) { return a.shaderID < b.shaderID; });
+}
+
+void RenderPass::updateFrameUniforms(const glm::mat4& view, const glm::mat4& projection) {
+    FrameUniforms frame;
+    frame.model = modelMat;
+    frame.view = view;
+    frame.projection = projection;
+    frame.normalMat = normalMat;
+    frame.camPos = glm::vec4(camera.camera_position, 1.f);
+    frame.lightPos = glm::vec4(lightPos, 1.f);
+    frame.lightIntensity = glm::vec4(lightIntensity, 0.f);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUniformsUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, frameUniformsUBO);
+}
+
 void RenderPass::initPostProcessShader() {
     // shader to do screen-space post-process
     const char* src = "#version 330 core\n"
@@ -23,7 +23,13 @@
 #endif
 #endif
 
+#ifdef TR_HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 #include <core/core.h>
+#include <core/profiler.h>
 
 TR_NAMESPACE_BEGIN
 
@@ -34,13 +40,12 @@ struct BSDF;
  * GL Object structure.
  */
 struct GLObject {
-    GLuint vao{0};
-    GLuint vbo{0};
     GLuint shaderID{0};
     int shaderIdx{0};
 
-    int nVerts{0};
-    std::vector<GLfloat> vertices;
+    // Range of the object's triangles in the merged index buffer (see RenderPass::buildGeometry)
+    size_t firstIndex{0};
+    GLsizei nIndices{0};
 
     // uniforms for diffuse shader
     GLuint albedoUniform{0};
@@ -55,6 +60,21 @@ struct GLObject {
     v3f rho_s{0};
 };
 
+/**
+ * Per-frame uniforms shared by the shaders of a pass: uniform block `FrameUniforms` (std140 layout),
+ * uploaded once per frame instead of once per object.
+ */
+struct FrameUniforms {
+    glm::mat4 model;
+    glm::mat4 view;
+    glm::mat4 projection;
+    glm::mat4 normalMat;
+    // vec3 (xyz), aligned on 16 bytes
+    glm::vec4 camPos;
+    glm::vec4 lightPos;
+    glm::vec4 lightIntensity;
+};
+
 /**
  * RenderPass structure.
  */
@@ -64,11 +84,22 @@ struct RenderPass {
     SDL_Window* window{nullptr};
     SDL_GLContext contextGL{0};
 
+    // Offscreen context (no window) for headless renders
+    bool headless{false};
+#ifdef TR_HEADLESS_EGL
+    EGLDisplay eglDisplay{EGL_NO_DISPLAY};
+    EGLSurface eglSurface{EGL_NO_SURFACE};
+    EGLContext eglContext{EGL_NO_CONTEXT};
+#endif
+
     int width, height;
     int nPixel;
 
     bool isSaved = false;
 
+    // False for single images (nogui, benchmarks), which wait for progressive work (e.g. GI bake) to finish
+    bool interactive{true};
+
     std::string shadersFilePath;
 
     std::vector<GLObject> objects;
@@ -88,6 +119,9 @@ struct RenderPass {
     // Camera real-time
     CameraRT camera;
 
+    // CPU and GPU timings of the frames (when profiling)
+    FrameProfiler profiler;
+
     // Camera
     glm::vec3 camPos;
 
@@ -95,30 +129,47 @@ struct RenderPass {
     glm::vec3 lightPos;
     glm::vec3 lightIntensity;
 
+    // Uniform buffer of the per-frame uniforms, bound to every program declaring the block
+    static const GLuint FRAME_UNIFORMS_BINDING = 0;
+    GLuint frameUniformsUBO{0};
+
     // shader attributes
     GLuint posAttrib{0};
     GLuint normalAttrib{1};
     const int N_ATTR_PER_VERT{6}; // 3 for pos, 3 for normals
 
+    // Welded vertices and triangles of all the objects, in one vertex and one index buffer
+    GLuint geometryVAO{0};
+    GLuint geometryVBO{0};
+    GLuint geometryIBO{0};
+
     explicit RenderPass(const Scene& scene) : scene(scene) { }
+    virtual ~RenderPass() = default;
     virtual bool init(const Config& config);
     virtual void cleanUp();
     virtual void render();
 
-    virtual void buildVBO(size_t objectIdx);
-    virtual void buildVAO(size_t objectIdx);
+    std::vector<tinyobj::index_t> buildGeometry();
+    void drawObject(const GLObject& obj);
+    void drawObjects(size_t begin, size_t end);
 	virtual void handleEvents(SDL_Event& e);
 
     bool save(GLfloat* data);
+    void setVSync(bool vsync);
     bool updateCamera(SDL_Event& e);	
 
     // Utils
-    bool initOpenGL(int width, int height);
+    bool initOpenGL(int width, int height, bool headless = false);
+    bool initOffscreenContext();
+    bool initGLEW();
+    void destroyContext();
     GLuint compileProgram(GLuint vs, GLuint fs);
     GLuint compileShader(const char* shaderPath_, GLenum shaderType);
     GLuint compileShader_(const char* codePtr, GLenum shaderType);
     std::string readFile(const char* filePath);
     void assignShader(GLObject& obj, const tinyobj::shape_t& s, const std::vector<std::unique_ptr<BSDF>>& bsdfs);
+    void sortObjectsByShader();
+    void updateFrameUniforms(const glm::mat4& view, const glm::mat4& projection);
 
     // For Linear->sRGB post-process shader
     GLuint postprocess_quadShader;
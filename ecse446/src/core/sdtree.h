@@ -0,0 +1,321 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <mutex>
+#include <fstream>
+#include <core/core.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Spatio-directional tree for path guiding (Müller et al. '17, "Practical Path Guiding").
+ * A binary tree subdivides the scene bounds; each of its leaves holds a directional quadtree
+ * over the cylindrical parametrization of the sphere of directions, learning incident radiance.
+ */
+
+/// World direction -> [0,1]^2 (area preserving cylindrical map)
+inline p2f dirToCanonical(const v3f& d) {
+    const float cosTheta = clamp(d.z, -1.f, 1.f);
+    float phi = std::atan2(d.y, d.x);
+    if (phi < 0.f) phi += 2.f * M_PI;
+    return {clamp((cosTheta + 1.f) * 0.5f, 0.f, 1.f), clamp(phi * INV_TWOPI, 0.f, 1.f)};
+}
+
+/// [0,1]^2 -> world direction
+inline v3f canonicalToDir(const p2f& p) {
+    const float cosTheta = 2.f * p.x - 1.f;
+    const float sinTheta = safeSqrt(1.f - cosTheta * cosTheta);
+    const float phi = 2.f * M_PI * p.y;
+    return {sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta};
+}
+
+/**
+ * Directional quadtree.
+ * Nodes are stored in a flat array; a child index of 0 denotes a leaf quadrant (0 is the root).
+ */
+struct DTree {
+    struct Node {
+        float sum[4];
+        uint32_t child[4];
+        Node() { for (int i = 0; i < 4; i++) { sum[i] = 0.f; child[i] = 0; } }
+        float total() const { return sum[0] + sum[1] + sum[2] + sum[3]; }
+    };
+
+    std::vector<Node> nodes;
+    /* Number of samples recorded since the last reset */
+    size_t nbSamples = 0;
+
+    DTree() : nodes(1) { }
+
+    static inline int quadrant(p2f& p) {
+        const int q = (p.x >= 0.5f ? 1 : 0) + (p.y >= 0.5f ? 2 : 0);
+        p.x = 2.f * p.x - (q & 1);
+        p.y = 2.f * p.y - (q >> 1);
+        return q;
+    }
+
+    float total() const { return nodes[0].total(); }
+
+    /// Splat a radiance estimate into the leaf quadrant containing p
+    void record(p2f p, float value) {
+        nbSamples++;
+        size_t idx = 0;
+        for (;;) {
+            const int q = quadrant(p);
+            if (!nodes[idx].child[q]) {
+                nodes[idx].sum[q] += value;
+                return;
+            }
+            idx = nodes[idx].child[q];
+        }
+    }
+
+    /// Propagate leaf sums up to the root
+    float build(size_t idx = 0) {
+        Node& n = nodes[idx];
+        for (int q = 0; q < 4; q++)
+            if (n.child[q]) n.sum[q] = build(n.child[q]);
+        return n.total();
+    }
+
+    /// Density with respect to solid angle
+    float pdf(const v3f& d) const {
+        if (total() <= 0.f) return INV_FOURPI;
+        p2f p = dirToCanonical(d);
+        float density = 1.f;
+        size_t idx = 0;
+        for (;;) {
+            const Node& n = nodes[idx];
+            const int q = quadrant(p);
+            const float t = n.total();
+            if (n.sum[q] <= 0.f || t <= 0.f) return 0.f;
+            density *= 4.f * n.sum[q] / t;
+            if (!n.child[q]) break;
+            idx = n.child[q];
+        }
+        return density * INV_FOURPI;
+    }
+
+    v3f sample(p2f u) const {
+        if (total() <= 0.f) return canonicalToDir(u);
+
+        p2f origin(0.f);
+        float size = 1.f;
+        size_t idx = 0;
+        for (;;) {
+            const Node& n = nodes[idx];
+            // Pick the top or bottom row, then the column within that row
+            const float top = n.sum[0] + n.sum[1];
+            const float t = n.total();
+            int q = 0;
+            float fy = top / t;
+            if (u.y < fy) {
+                u.y /= fy;
+            } else {
+                u.y = (u.y - fy) / (1.f - fy);
+                q = 2;
+            }
+            const float row = n.sum[q] + n.sum[q + 1];
+            const float fx = row > 0.f ? n.sum[q] / row : 0.5f;
+            if (u.x < fx) {
+                u.x /= fx;
+            } else {
+                u.x = (u.x - fx) / (1.f - fx);
+                q += 1;
+            }
+            u = glm::min(u, p2f(1.f - 1e-6f));
+
+            size *= 0.5f;
+            origin += p2f((q & 1) ? size : 0.f, (q >> 1) ? size : 0.f);
+            if (!n.child[q]) break;
+            idx = n.child[q];
+        }
+        return canonicalToDir(origin + u * size);
+    }
+
+    /**
+     * Rebuild the tree topology from the energy distribution of another tree:
+     * quadrants holding more than `threshold` of the total energy are subdivided.
+     * Sums of the new tree are reset to zero.
+     */
+    void refineFrom(const DTree& prev, float threshold, int maxDepth) {
+        nodes.assign(1, Node());
+        nbSamples = 0;
+        const float t = prev.total();
+        if (t <= 0.f) return;
+
+        struct Item { size_t newIdx; size_t prevIdx; bool hasPrev; float prevSums[4]; int depth; };
+        std::vector<Item> stack;
+        Item root{0, 0, true, {0, 0, 0, 0}, 1};
+        stack.push_back(root);
+
+        while (!stack.empty()) {
+            const Item it = stack.back();
+            stack.pop_back();
+            for (int q = 0; q < 4; q++) {
+                const float s = it.hasPrev ? prev.nodes[it.prevIdx].sum[q] : it.prevSums[q];
+                if (it.depth >= maxDepth || s / t <= threshold) continue;
+
+                const size_t c = nodes.size();
+                nodes[it.newIdx].child[q] = uint32_t(c);
+                nodes.emplace_back();
+
+                Item child{c, 0, false, {s / 4, s / 4, s / 4, s / 4}, it.depth + 1};
+                if (it.hasPrev && prev.nodes[it.prevIdx].child[q]) {
+                    child.hasPrev = true;
+                    child.prevIdx = prev.nodes[it.prevIdx].child[q];
+                }
+                stack.push_back(child);
+            }
+        }
+    }
+};
+
+/**
+ * Pair of directional trees attached to a spatial leaf:
+ * `sampling` is read-only during a pass, `building` collects the current pass' samples.
+ */
+struct DTreeWrapper {
+    DTree building;
+    DTree sampling;
+    std::mutex mutex;
+
+    void record(const v3f& d, float value) {
+        const p2f p = dirToCanonical(d);
+        std::lock_guard<std::mutex> lock(mutex);
+        building.record(p, value);
+    }
+};
+
+/**
+ * Spatial binary tree, splitting the (cubified) scene bounds along alternating axes.
+ */
+struct SDTree {
+    struct Node {
+        uint32_t child[2];
+        uint32_t dtree;
+        Node() : dtree(0) { child[0] = child[1] = 0; }
+        bool isLeaf() const { return child[0] == 0; }
+    };
+
+    AABB bounds;
+    std::vector<Node> nodes;
+    std::vector<std::unique_ptr<DTreeWrapper>> dtrees;
+
+    /* Fraction of the directional energy above which a quadrant is subdivided */
+    float dTreeThreshold = 0.01f;
+    int dTreeMaxDepth = 20;
+    /* Base number of samples a spatial leaf needs before it is split */
+    float sTreeThreshold = 12000.f;
+
+    explicit SDTree(const AABB& sceneBounds = AABB()) {
+        // Cube around the scene bounds so the children stay well-shaped
+        const v3f center = sceneBounds.getCenter();
+        const v3f d = sceneBounds.max - sceneBounds.min;
+        const float halfSize = 0.5f * 1.01f * std::max(d.x, std::max(d.y, d.z));
+        bounds.min = center - v3f(halfSize);
+        bounds.max = center + v3f(halfSize);
+
+        nodes.emplace_back();
+        dtrees.emplace_back(new DTreeWrapper());
+    }
+
+    DTreeWrapper* getDTree(const v3f& pos) const {
+        v3f p = (pos - bounds.min) / (bounds.max - bounds.min);
+        p = glm::clamp(p, v3f(0.f), v3f(1.f - 1e-6f));
+        size_t idx = 0;
+        int axis = 0;
+        while (!nodes[idx].isLeaf()) {
+            const int c = p[axis] < 0.5f ? 0 : 1;
+            p[axis] = 2.f * p[axis] - c;
+            idx = nodes[idx].child[c];
+            axis = (axis + 1) % 3;
+        }
+        return dtrees[nodes[idx].dtree].get();
+    }
+
+    /**
+     * End of a training pass: split spatial leaves that received enough samples,
+     * then make the collected radiance the new sampling distribution and
+     * refine the building trees for the next pass.
+     */
+    void refine(int pass) {
+        const float threshold = sTreeThreshold * std::sqrt(std::pow(2.f, float(pass)));
+
+        for (size_t idx = 0; idx < nodes.size(); idx++) {
+            if (!nodes[idx].isLeaf()) continue;
+            DTreeWrapper* w = dtrees[nodes[idx].dtree].get();
+            if (w->building.nbSamples <= threshold) continue;
+
+            // Children share the parent's distribution and half of its samples
+            for (int c = 0; c < 2; c++) {
+                const uint32_t d = uint32_t(dtrees.size());
+                dtrees.emplace_back(new DTreeWrapper());
+                dtrees.back()->building = w->building;
+                dtrees.back()->building.nbSamples /= 2;
+                Node n;
+                n.dtree = d;
+                nodes[idx].child[c] = uint32_t(nodes.size());
+                nodes.push_back(n);
+            }
+            // Reprocess the new children in this same loop (they may need more splits)
+        }
+
+        for (auto& w : dtrees) {
+            w->building.build();
+            w->sampling = w->building;
+            w->building.refineFrom(w->sampling, dTreeThreshold, dTreeMaxDepth);
+        }
+    }
+
+    /// Write the sampling distributions to a binary file, for reuse across frames
+    bool save(const std::string& filename) const {
+        std::ofstream out(filename, std::ios::binary);
+        if (!out) return false;
+        const uint32_t magic = 0x44535254; // "TRSD"
+        const uint32_t nbNodes = uint32_t(nodes.size()), nbDTrees = uint32_t(dtrees.size());
+        out.write((const char*) &magic, sizeof(magic));
+        out.write((const char*) &bounds, sizeof(AABB));
+        out.write((const char*) &nbNodes, sizeof(nbNodes));
+        out.write((const char*) nodes.data(), sizeof(Node) * nbNodes);
+        out.write((const char*) &nbDTrees, sizeof(nbDTrees));
+        for (const auto& w : dtrees) {
+            const uint32_t n = uint32_t(w->sampling.nodes.size());
+            out.write((const char*) &n, sizeof(n));
+            out.write((const char*) w->sampling.nodes.data(), sizeof(DTree::Node) * n);
+        }
+        return bool(out);
+    }
+
+    bool load(const std::string& filename) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) return false;
+        uint32_t magic = 0, nbNodes = 0, nbDTrees = 0;
+        in.read((char*) &magic, sizeof(magic));
+        if (magic != 0x44535254) return false;
+        in.read((char*) &bounds, sizeof(AABB));
+        in.read((char*) &nbNodes, sizeof(nbNodes));
+        nodes.resize(nbNodes);
+        in.read((char*) nodes.data(), sizeof(Node) * nbNodes);
+        in.read((char*) &nbDTrees, sizeof(nbDTrees));
+        dtrees.clear();
+        for (uint32_t i = 0; i < nbDTrees && in; i++) {
+            uint32_t n = 0;
+            in.read((char*) &n, sizeof(n));
+            dtrees.emplace_back(new DTreeWrapper());
+            DTree& s = dtrees.back()->sampling;
+            s.nodes.resize(n);
+            in.read((char*) s.nodes.data(), sizeof(DTree::Node) * n);
+            dtrees.back()->building.refineFrom(s, dTreeThreshold, dTreeMaxDepth);
+        }
+        return bool(in) && !nodes.empty() && dtrees.size() == nbDTrees;
+    }
+};
+
+TR_NAMESPACE_END
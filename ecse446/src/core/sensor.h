@@ -0,0 +1,155 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <core/core.h>
+#include <core/simd.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Batch of camera samples: raster positions (pixels, y pointing down the image) and lens positions
+ * (on the unit disk, thin lens only), and the rays generated through them.
+ */
+struct RayBatch {
+    static const int Size = 64;
+    int count = 0;
+    float px[Size]{}, py[Size]{};
+    float lensU[Size]{}, lensV[Size]{};
+    std::vector<Ray> rays;
+
+    RayBatch() : rays(Size, Ray(v3f(0.f), v3f(0.f, 0.f, -1.f))) { }
+};
+
+/**
+ * Camera sensor generating the primary rays of offline renders.
+ * The camera-to-world basis and the steps between pixels on the image plane are computed once,
+ * so that a ray is an affine function of its raster position.
+ * Perspective rays go through the plane at distance 1 (pinhole) or through the focus plane from
+ * a point of the lens (thin lens); orthographic rays are parallel to the view direction.
+ */
+struct Sensor {
+    ECameraType type;
+    v3f eye;
+    /* Camera basis in world space: right, up, and backwards (as glm::lookAt) */
+    v3f u, v, w;
+    /* Point of the image plane at raster position (0, 0) relative to the eye, and steps of one pixel */
+    v3f corner, dx, dy;
+    /* Thin lens radius and focus distance (0 and 1 for a pinhole) */
+    float lensRadius, focusDistance;
+
+    explicit Sensor(const Config& config) {
+        const Camera& c = config.camera;
+        type = c.type;
+        eye = c.o;
+        w = glm::normalize(c.o - c.at);
+        u = glm::normalize(glm::cross(c.up, w));
+        v = glm::cross(w, u);
+
+        // Image plane at distance 1, or of the given height for orthographic cameras
+        const float fovScale = std::tan(c.fov / 360.f * M_PI) * 2.f;
+        float planeHeight = fovScale;
+        if (type == EOrthographicCamera)
+            planeHeight = c.orthoHeight > 0.f ? c.orthoHeight : fovScale * glm::distance(c.o, c.at);
+        const float planeWidth = planeHeight * config.width / config.height;
+        dx = u * (planeWidth / config.width);
+        dy = -v * (planeHeight / config.height);
+        corner = -0.5f * planeWidth * u + 0.5f * planeHeight * v;
+        if (type != EOrthographicCamera) corner -= w;
+
+        lensRadius = 0.f;
+        focusDistance = 1.f;
+        if (type == EThinLensCamera) {
+            lensRadius = c.apertureRadius;
+            focusDistance = c.focusDistance > 0.f ? c.focusDistance : glm::distance(c.o, c.at);
+        }
+    }
+
+    bool hasLens() const { return lensRadius > 0.f; }
+
+    /**
+     * Ray through raster position (px, py), from lens position (lu, lv) on the unit disk.
+     * Its differentials reach the next pixels, scaled by `scale` (e.g. 1/sqrt(spp)).
+     */
+    Ray generateRay(float px, float py, float lu, float lv, float scale) const {
+        const v3f p = corner + px * dx + py * dy;
+        if (type == EOrthographicCamera) {
+            Ray ray(eye + p, -w);
+            setDifferentials(ray, ray.o + dx, ray.o + dy, ray.d, ray.d, scale);
+            return ray;
+        }
+        const v3f lens = lensRadius * (lu * u + lv * v);
+        const v3f target = focusDistance * p - lens;
+        Ray ray(eye + lens, glm::normalize(target));
+        setDifferentials(ray, ray.o, ray.o, glm::normalize(target + focusDistance * dx),
+                         glm::normalize(target + focusDistance * dy), scale);
+        return ray;
+    }
+
+    /**
+     * Fills the rays of a batch from its camera samples, 4 at a time.
+     */
+    void generateRays(RayBatch& batch, float scale) const {
+        const v3f4 corner4(corner), dx4(dx), dy4(dy), eye4(eye);
+        const v3f4 u4(u * lensRadius), v4(v * lensRadius);
+        const float4 focus(focusDistance);
+        float o[3][4], d[3][4], rx[3][4], ry[3][4];
+
+        for (int i = 0; i < batch.count; i += 4) {
+            // Lanes past the count compute unused rays
+            const v3f4 p = corner4 + dx4 * float4::load(batch.px + i) + dy4 * float4::load(batch.py + i);
+            v3f4 origin, dir, dirX, dirY;
+            if (type == EOrthographicCamera) {
+                origin = eye4 + p;
+                dir = dirX = dirY = v3f4(-w);
+            } else {
+                const v3f4 lens = u4 * float4::load(batch.lensU + i) + v4 * float4::load(batch.lensV + i);
+                const v3f4 target = p * focus - lens;
+                origin = eye4 + lens;
+                dir = normalize(target);
+                dirX = normalize(target + dx4 * focus);
+                dirY = normalize(target + dy4 * focus);
+            }
+            store(origin, o);
+            store(dir, d);
+            store(dirX, rx);
+            store(dirY, ry);
+
+            for (int k = 0; k < 4 && i + k < batch.count; k++) {
+                Ray& ray = batch.rays[i + k];
+                ray = Ray(v3f(o[0][k], o[1][k], o[2][k]), v3f(d[0][k], d[1][k], d[2][k]));
+                const v3f dirRx(rx[0][k], rx[1][k], rx[2][k]), dirRy(ry[0][k], ry[1][k], ry[2][k]);
+                if (type == EOrthographicCamera) setDifferentials(ray, ray.o + dx, ray.o + dy, dirRx, dirRy, scale);
+                else setDifferentials(ray, ray.o, ray.o, dirRx, dirRy, scale);
+            }
+        }
+    }
+
+private:
+    static void setDifferentials(Ray& ray, const v3f& rxOrigin, const v3f& ryOrigin,
+                                 const v3f& rxDirection, const v3f& ryDirection, float scale) {
+        ray.hasDifferentials = true;
+        ray.rxOrigin = rxOrigin;
+        ray.ryOrigin = ryOrigin;
+        ray.rxDirection = rxDirection;
+        ray.ryDirection = ryDirection;
+        ray.scaleDifferentials(scale);
+    }
+
+    static v3f4 normalize(const v3f4& a) {
+        return a * (float4(1.f) / length(a));
+    }
+
+    static void store(const v3f4& a, float out[3][4]) {
+        a.x.store(out[0]);
+        a.y.store(out[1]);
+        a.z.store(out[2]);
+    }
+};
+
+TR_NAMESPACE_END
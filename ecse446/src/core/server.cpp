@@ -0,0 +1,507 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <core/server.h>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+TR_NAMESPACE_BEGIN
+
+namespace {
+
+/**
+ * Minimal JSON reader building the equivalent TOML document: objects become tables (arrays of
+ * objects, arrays of tables), integers stay integers in objects and numbers in arrays are reals,
+ * so that numeric arrays are homogeneous.
+ */
+struct JSONReader {
+    const std::string& s;
+    size_t i = 0;
+
+    explicit JSONReader(const std::string& s) : s(s) { }
+
+    std::shared_ptr<cpptoml::table> parse() {
+        if (peek() != '{') fail("expected an object");
+        auto table = std::static_pointer_cast<cpptoml::table>(parseValue(false));
+        skip();
+        if (i != s.size()) fail("trailing characters");
+        return table;
+    }
+
+private:
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error("Invalid JSON job (" + what + " at offset " + std::to_string(i) + ")");
+    }
+
+    void skip() {
+        while (i < s.size() && std::isspace((unsigned char) s[i])) i++;
+    }
+
+    char peek() {
+        skip();
+        if (i >= s.size()) fail("unexpected end");
+        return s[i];
+    }
+
+    void expect(char c) {
+        if (peek() != c) fail(std::string("expected '") + c + "'");
+        i++;
+    }
+
+    std::string parseString() {
+        expect('"');
+        std::string out;
+        while (i < s.size() && s[i] != '"') {
+            char c = s[i++];
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (i >= s.size()) break;
+            c = s[i++];
+            switch (c) {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (i + 4 > s.size()) fail("truncated escape");
+                    const unsigned code = unsigned(std::stoul(s.substr(i, 4), nullptr, 16));
+                    i += 4;
+                    // UTF-8 (basic multilingual plane)
+                    if (code < 0x80) out += char(code);
+                    else if (code < 0x800) {
+                        out += char(0xC0 | (code >> 6));
+                        out += char(0x80 | (code & 0x3F));
+                    } else {
+                        out += char(0xE0 | (code >> 12));
+                        out += char(0x80 | ((code >> 6) & 0x3F));
+                        out += char(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: out += c; // " \ /
+            }
+        }
+        expect('"');
+        return out;
+    }
+
+    std::shared_ptr<cpptoml::base> parseValue(bool inArray) {
+        const char c = peek();
+        if (c == '{') {
+            i++;
+            auto table = cpptoml::make_table();
+            if (peek() == '}') {
+                i++;
+                return table;
+            }
+            for (;;) {
+                const std::string key = parseString();
+                expect(':');
+                table->insert(key, parseValue(false));
+                if (peek() == '}') {
+                    i++;
+                    return table;
+                }
+                expect(',');
+            }
+        }
+        if (c == '[') {
+            i++;
+            std::vector<std::shared_ptr<cpptoml::base>> values;
+            if (peek() != ']') {
+                for (;;) {
+                    values.push_back(parseValue(true));
+                    if (peek() == ']') break;
+                    expect(',');
+                }
+            }
+            i++;
+            if (!values.empty() && values[0]->is_table()) {
+                auto tables = cpptoml::make_table_array();
+                for (const auto& v : values) {
+                    if (!v->is_table()) fail("mixed array");
+                    tables->push_back(std::static_pointer_cast<cpptoml::table>(v));
+                }
+                return tables;
+            }
+            auto array = cpptoml::make_array();
+            array->get() = values;
+            return array;
+        }
+        if (c == '"') return cpptoml::make_value<std::string>(parseString());
+        if (s.compare(i, 4, "true") == 0) {
+            i += 4;
+            return cpptoml::make_value<bool>(true);
+        }
+        if (s.compare(i, 5, "false") == 0) {
+            i += 5;
+            return cpptoml::make_value<bool>(false);
+        }
+
+        const size_t begin = i;
+        bool real = inArray;
+        while (i < s.size() && std::strchr("+-0123456789.eE", s[i])) {
+            real |= s[i] == '.' || s[i] == 'e' || s[i] == 'E';
+            i++;
+        }
+        if (i == begin) fail("unexpected character");
+        const std::string number = s.substr(begin, i - begin);
+        if (real) return cpptoml::make_value<double>(std::stod(number));
+        return cpptoml::make_value<int64_t>(std::stoll(number));
+    }
+};
+
+}
+
+#ifndef _WIN32
+
+namespace {
+
+bool sendAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        const ssize_t n = ::send(fd, p, size, 0);
+        if (n <= 0) return false;
+        p += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+bool sendLine(int fd, const std::string& line) {
+    return sendAll(fd, (line + "\n").data(), line.size() + 1);
+}
+
+}
+
+RenderServer::RenderServer(const std::string& socketFile, size_t cacheSize, ConfigLoader loader)
+        : m_socketFile(socketFile), m_cacheSize(std::max(cacheSize, size_t(1))), m_loader(std::move(loader)) {
+    m_spoolDir = fs::path(socketFile + ".jobs");
+}
+
+RenderServer::~RenderServer() {
+    if (m_socket >= 0) {
+        ::close(m_socket);
+        std::remove(m_socketFile.c_str());
+    }
+}
+
+bool RenderServer::run() {
+    // Clients may leave before their job is done: report failed writes instead of terminating
+    std::signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (m_socketFile.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << m_socketFile << std::endl;
+        return false;
+    }
+    std::strcpy(address.sun_path, m_socketFile.c_str());
+    std::remove(m_socketFile.c_str()); // Left over by a previous server
+
+    m_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_socket < 0 || ::bind(m_socket, (sockaddr*) &address, sizeof(address)) != 0 || ::listen(m_socket, 16) != 0) {
+        std::cerr << "Could not listen on " << m_socketFile << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    fs::create_directories(m_spoolDir);
+    std::cout << "Render server listening on " << m_socketFile << std::endl;
+
+    std::thread renderer(&RenderServer::renderLoop, this);
+    for (;;) {
+        const int client = ::accept(m_socket, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Could not accept client: " << std::strerror(errno) << std::endl;
+            break;
+        }
+
+        // Jobs are read on their own thread, so that a slow client doesn't hold up the others
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_shutdown) { // Woken up by the shutdown job
+            ::close(client);
+            break;
+        }
+        m_readers++;
+        std::thread(&RenderServer::receive, this, client).detach();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_readersDone.wait(lock, [this] { return m_readers == 0; });
+        m_quit = true;
+    }
+    m_cv.notify_one();
+    renderer.join();
+    for (const Job& job : m_queue) {
+        sendLine(job.client, "ERROR server shutting down");
+        ::close(job.client);
+    }
+    m_queue.clear();
+    m_cache.clear();
+    std::remove(m_spoolDir.string().c_str()); // If empty
+    std::cout << "Render server stopped" << std::endl;
+    return true;
+}
+
+void RenderServer::receive(int client) {
+    Job job;
+    bool received = false;
+    try {
+        received = readJob(client, job);
+        if (!received) ::close(client);
+    } catch (const std::exception& e) {
+        sendLine(client, std::string("ERROR ") + e.what());
+        ::close(client);
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (received && job.client < 0) {
+        // Shutdown: wake up the accept loop with a connection of our own
+        m_shutdown = true;
+        lock.unlock();
+        const int wake = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::strcpy(address.sun_path, m_socketFile.c_str());
+        if (wake >= 0) {
+            ::connect(wake, (sockaddr*) &address, sizeof(address));
+            ::close(wake);
+        }
+        lock.lock();
+    } else if (received) {
+        size_t position = 0;
+        for (const Job& queued : m_queue) position += queued.priority >= job.priority;
+        sendLine(client, "QUEUED " + std::to_string(job.id) + " " + std::to_string(position));
+        m_queue.push_back(std::move(job));
+        m_cv.notify_one();
+    }
+    m_readers--;
+    m_readersDone.notify_all();
+}
+
+bool RenderServer::readJob(int client, Job& job) {
+    // Read up to the end of the top-level object (or until the client closes its side)
+    // A client that stops sending, or reading what is sent to it, is dropped after the timeout
+    timeval timeout = {10, 0};
+    ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    std::string text;
+    int depth = 0;
+    bool inString = false, escaped = false, started = false;
+    char buffer[4096];
+    while (!started || depth > 0) {
+        const ssize_t n = ::recv(client, buffer, sizeof(buffer), 0);
+        if (n <= 0) break;
+        for (ssize_t k = 0; k < n && (!started || depth > 0); k++) {
+            const char c = buffer[k];
+            text += c;
+            if (inString) {
+                if (escaped) escaped = false;
+                else if (c == '\\') escaped = true;
+                else if (c == '"') inString = false;
+            } else if (c == '"') inString = true;
+            else if (c == '{' || c == '[') {
+                started = true;
+                depth++;
+            } else if (c == '}' || c == ']') depth--;
+        }
+        if (text.size() > (1 << 20)) throw std::runtime_error("Job too large");
+    }
+    if (!started) return false;
+
+    const auto data = JSONReader(text).parse();
+    if (data->get_as<std::string>("command").value_or("") == "shutdown") {
+        sendLine(client, "OK");
+        ::close(client);
+        job.client = -1;
+        return true;
+    }
+
+    Config& config = job.config;
+    if (m_loader(config, *data)) throw std::runtime_error("Real-time jobs are not supported");
+    // The scene stays resident: resolve it against the directory the server runs in
+    config.objFile = fs::absolute(config.objFile);
+    config.frames = 0;
+    config.frame = -1;
+    config.checkpointInterval = 0.f;
+    config.resume = false;
+    config.farmRole = EFarmNone;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    job.id = m_nextID++;
+    job.priority = data->get_as<int>("priority").value_or(0);
+    job.tiles = data->get_as<bool>("tiles").value_or(false);
+    job.client = client;
+    // The image is written next to the (virtual) scene file of the job
+    config.tomlFile = m_spoolDir / ("job_" + std::to_string(job.id) + ".toml");
+    return true;
+}
+
+void RenderServer::renderLoop() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+            if (m_quit) return;
+            // Highest priority first, then first come first served
+            auto next = std::min_element(m_queue.begin(), m_queue.end(), [](const Job& a, const Job& b) {
+                return a.priority != b.priority ? a.priority > b.priority : a.id < b.id;
+            });
+            job = std::move(*next);
+            m_queue.erase(next);
+        }
+
+        const auto begin = std::chrono::steady_clock::now();
+        try {
+            render(job);
+        } catch (const std::exception& e) {
+            std::cerr << "Job " << job.id << " failed: " << e.what() << std::endl;
+            sendLine(job.client, std::string("ERROR ") + e.what());
+        }
+        ::close(job.client);
+        const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - begin;
+        std::cout << "Job " << job.id << " done in " << elapsed.count() << "s" << std::endl;
+    }
+}
+
+void RenderServer::render(Job& job) {
+    CachedScene& cached = acquireScene(job.config);
+    Renderer& renderer = *cached.renderer;
+    const Config& config = *cached.config;
+
+    // Finished bands are copied by the render threads, which call onTileRow under a lock, and sent by
+    // their own thread: a slow client doesn't hold up the render. Tiles stop at the first failed send.
+    struct Band {
+        int y0, y1;
+        std::vector<v3f> rgb;
+    };
+    std::mutex bandsMutex;
+    std::condition_variable bandsReady;
+    std::deque<Band> bands;
+    bool rendered = false;
+    std::atomic<bool> connected(true);
+    std::thread sender;
+    if (job.tiles) {
+        renderer.integrator->onTileRow = [&](int ty) {
+            if (!connected) return;
+            const int y0 = ty * TiledEXRWriter::TileSize;
+            const int y1 = std::min(y0 + TiledEXRWriter::TileSize, config.height);
+            const v3f* first = &renderer.integrator->rgb->data[size_t(y0) * config.width];
+            Band band{y0, y1, std::vector<v3f>(first, first + size_t(y1 - y0) * config.width)};
+            std::lock_guard<std::mutex> lock(bandsMutex);
+            bands.push_back(std::move(band));
+            bandsReady.notify_one();
+        };
+        sender = std::thread([&] {
+            std::unique_lock<std::mutex> lock(bandsMutex);
+            for (;;) {
+                bandsReady.wait(lock, [&] { return rendered || !bands.empty(); });
+                if (bands.empty()) return;
+                const Band band = std::move(bands.front());
+                bands.pop_front();
+                lock.unlock();
+                std::ostringstream header;
+                header << "TILE " << band.y0 << " " << band.y1 << " " << config.width;
+                connected = connected && sendLine(job.client, header.str())
+                            && sendAll(job.client, band.rgb.data(), sizeof(v3f) * band.rgb.size());
+                lock.lock();
+            }
+        });
+    }
+    // Sends the remaining bands, before the image (or the error)
+    auto finishTiles = [&] {
+        renderer.integrator->onTileRow = nullptr;
+        if (!sender.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(bandsMutex);
+            rendered = true;
+        }
+        bandsReady.notify_one();
+        sender.join();
+    };
+    try {
+        renderer.render();
+    } catch (...) {
+        finishTiles();
+        throw;
+    }
+    finishTiles();
+    renderer.cleanUp();
+
+    const std::string filename = getOutputPath(config, "exr");
+    std::ifstream in(filename, std::ios::binary);
+    const std::string image((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    std::remove(filename.c_str());
+    if (image.empty()) throw std::runtime_error("Could not save the image");
+    if (connected && sendLine(job.client, "EXR " + std::to_string(image.size())))
+        sendAll(job.client, image.data(), image.size());
+}
+
+RenderServer::CachedScene& RenderServer::acquireScene(const Config& config) {
+    // Textures are loaded with the filtering of the first job
+    const std::string key = config.objFile.string() + "|" + std::to_string(int(config.textureFilter));
+    for (auto it = m_cache.begin(); it != m_cache.end(); ++it) {
+        if (it->key != key) continue;
+        m_cache.splice(m_cache.begin(), m_cache, it);
+        CachedScene& cached = m_cache.front();
+        *cached.config = config;
+        if (!cached.renderer->initIntegrator()) throw std::runtime_error("Could not initialize the integrator");
+        return cached;
+    }
+
+    while (m_cache.size() >= m_cacheSize) {
+        std::cout << "Evicting scene " << m_cache.back().config->objFile << std::endl;
+        m_cache.pop_back();
+    }
+    // Textures of the evicted scenes (and not shared with the resident ones)
+    TextureCache::get().purgeUnused();
+    CachedScene cached;
+    cached.key = key;
+    cached.config = std::unique_ptr<Config>(new Config(config));
+    cached.renderer = std::unique_ptr<Renderer>(new Renderer(*cached.config));
+    if (!cached.renderer->init(false, true))
+        throw std::runtime_error("Could not load scene " + config.objFile.string());
+    m_cache.push_front(std::move(cached));
+    return m_cache.front();
+}
+
+#else
+
+RenderServer::RenderServer(const std::string& socketFile, size_t cacheSize, ConfigLoader loader)
+        : m_socketFile(socketFile), m_cacheSize(cacheSize), m_loader(std::move(loader)) { }
+
+RenderServer::~RenderServer() { }
+
+bool RenderServer::run() {
+    std::cerr << "The render server needs UNIX sockets, which aren't supported on this platform" << std::endl;
+    return false;
+}
+
+#endif
+
+TR_NAMESPACE_END
@@ -0,0 +1,90 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <core/core.h>
+#include <core/renderer.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Render server: long-lived process rendering offline jobs received over a UNIX socket.
+ * Loaded scenes (geometry, textures, BVH) stay resident in an LRU cache keyed by OBJ file,
+ * so that repeated jobs on the same scene only pay for the render itself.
+ *
+ * A client connects and sends one JSON job, laid out like a TOML scene file, e.g.
+ *   {"input": {"objfile": "/abs/scene.obj"}, "camera": {"eye": [0, 1, 4], "at": [0, 1, 0]},
+ *    "film": {"width": 320, "height": 240}, "renderer": {"type": "path", "spp": 16},
+ *    "priority": 1, "tiles": true}
+ * Jobs are queued by decreasing priority (then arrival). The server replies with text lines, some
+ * followed by binary payloads:
+ *   QUEUED <id> <position>            job accepted
+ *   TILE <y0> <y1> <width>            with "tiles": rows [y0, y1) as float RGB, as soon as they are final
+ *   EXR <bytes>                       the output image (RGB and AOVs), then the connection is closed
+ *   ERROR <message>                   the job failed, then the connection is closed
+ * The job {"command": "shutdown"} stops the server once the current job is done.
+ */
+struct RenderServer {
+    /* Parses a job (the same settings as a scene file) into a config. Returns whether it is real-time */
+    typedef std::function<bool(Config&, const cpptoml::table&)> ConfigLoader;
+
+    RenderServer(const std::string& socketFile, size_t cacheSize, ConfigLoader loader);
+    ~RenderServer();
+
+    /**
+     * Accepts jobs until a shutdown job is received. Returns false if the socket couldn't be opened.
+     */
+    bool run();
+
+private:
+    struct Job {
+        uint64_t id;
+        int priority;
+        int client;
+        bool tiles;
+        Config config;
+    };
+
+    /* Scene resident in the cache: the renderer's scene refers to `config`, updated for each job */
+    struct CachedScene {
+        std::string key;
+        std::unique_ptr<Config> config;
+        std::unique_ptr<Renderer> renderer;
+    };
+
+    std::string m_socketFile;
+    size_t m_cacheSize;
+    ConfigLoader m_loader;
+    /* Directory holding the images of the jobs while they are rendered */
+    fs::path m_spoolDir;
+    int m_socket = -1;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::vector<Job> m_queue;
+    uint64_t m_nextID = 0;
+    bool m_quit = false;
+    /* Clients whose job is being read, each on its own thread, and whether a shutdown job was received */
+    int m_readers = 0;
+    std::condition_variable m_readersDone;
+    bool m_shutdown = false;
+
+    /* Most recently used first */
+    std::list<CachedScene> m_cache;
+
+    void receive(int client);
+    bool readJob(int client, Job& job);
+    void renderLoop();
+    void render(Job& job);
+    CachedScene& acquireScene(const Config& config);
+};
+
+TR_NAMESPACE_END
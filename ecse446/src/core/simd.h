@@ -0,0 +1,170 @@
+/*
+    This file is part of TinyRender, an educative rendering system.
+
+    Designed for ECSE 446/546 Realistic/Advanced Image Synthesis.
+    Derek Nowrouzezahrai, McGill University.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TR_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#include <core/platform.h>
+
+TR_NAMESPACE_BEGIN
+
+/**
+ * Minimal 4-wide float vector.
+ * Maps to SSE2 when available, with a scalar fallback otherwise.
+ * Comparisons return masks (all bits set per active lane) to be used with select().
+ * Math functions are friends, so that they are only found for float4 arguments.
+ */
+struct float4 {
+#ifdef TR_SIMD_SSE2
+    __m128 v;
+
+    float4() { }
+    float4(__m128 x) : v(x) { }
+    explicit float4(float x) : v(_mm_set1_ps(x)) { }
+    float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) { }
+
+    static float4 load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    friend float4 operator+(const float4& a, const float4& b) { return _mm_add_ps(a.v, b.v); }
+    friend float4 operator-(const float4& a, const float4& b) { return _mm_sub_ps(a.v, b.v); }
+    friend float4 operator*(const float4& a, const float4& b) { return _mm_mul_ps(a.v, b.v); }
+    friend float4 operator/(const float4& a, const float4& b) { return _mm_div_ps(a.v, b.v); }
+    friend float4 operator&(const float4& a, const float4& b) { return _mm_and_ps(a.v, b.v); }
+    friend float4 operator|(const float4& a, const float4& b) { return _mm_or_ps(a.v, b.v); }
+    friend float4 operator<(const float4& a, const float4& b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend float4 operator>(const float4& a, const float4& b) { return _mm_cmpgt_ps(a.v, b.v); }
+
+    friend float4 min(const float4& a, const float4& b) { return _mm_min_ps(a.v, b.v); }
+    friend float4 max(const float4& a, const float4& b) { return _mm_max_ps(a.v, b.v); }
+    friend float4 sqrt(const float4& a) { return _mm_sqrt_ps(a.v); }
+    friend float4 abs(const float4& a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+    /// mask ? a : b
+    friend float4 select(const float4& mask, const float4& a, const float4& b) {
+        return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+    }
+    friend float hsum(const float4& a) {
+        __m128 s = _mm_add_ps(a.v, _mm_movehl_ps(a.v, a.v));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+    /// Exponential (Cephes expf polynomial, relative error ~2e-7, flushes to 0 below -87)
+    friend float4 exp(const float4& a) {
+        const __m128 x = _mm_max_ps(_mm_min_ps(a.v, _mm_set1_ps(88.f)), _mm_set1_ps(-87.f));
+        const __m128i n = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)));
+        const __m128 fn = _mm_cvtepi32_ps(n);
+        __m128 f = _mm_sub_ps(x, _mm_mul_ps(fn, _mm_set1_ps(0.693359375f)));
+        f = _mm_add_ps(f, _mm_mul_ps(fn, _mm_set1_ps(2.12194440e-4f)));
+        __m128 p = _mm_set1_ps(1.9875691500e-4f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.3981999507e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.3334519073e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(4.1665795894e-2f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.6666665459e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.0000001201e-1f));
+        p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, f), f), f), _mm_set1_ps(1.f));
+        const __m128 pow2n = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+        return _mm_and_ps(_mm_mul_ps(p, pow2n), _mm_cmpgt_ps(a.v, _mm_set1_ps(-87.f)));
+    }
+#else
+    float v[4];
+
+    float4() { }
+    explicit float4(float x) { v[0] = v[1] = v[2] = v[3] = x; }
+    float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+
+    static float4 load(const float* p) { return float4(p[0], p[1], p[2], p[3]); }
+    void store(float* p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+
+    template<typename F>
+    static float4 map(const float4& a, const float4& b, F f) {
+        return float4(f(a.v[0], b.v[0]), f(a.v[1], b.v[1]), f(a.v[2], b.v[2]), f(a.v[3], b.v[3]));
+    }
+    static float mask(bool b) {
+        const uint32_t bits = b ? 0xffffffffu : 0u;
+        float f;
+        std::memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    static bool isSet(float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(f));
+        return bits != 0u;
+    }
+
+    friend float4 operator+(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x + y; }); }
+    friend float4 operator-(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x - y; }); }
+    friend float4 operator*(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x * y; }); }
+    friend float4 operator/(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x / y; }); }
+    friend float4 operator&(const float4& a, const float4& b) {
+        return map(a, b, [](float x, float y) { return mask(isSet(x) && isSet(y)); });
+    }
+    friend float4 operator|(const float4& a, const float4& b) {
+        return map(a, b, [](float x, float y) { return mask(isSet(x) || isSet(y)); });
+    }
+    friend float4 operator<(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return mask(x < y); }); }
+    friend float4 operator>(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return mask(x > y); }); }
+
+    friend float4 min(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x < y ? x : y; }); }
+    friend float4 max(const float4& a, const float4& b) { return map(a, b, [](float x, float y) { return x > y ? x : y; }); }
+    friend float4 sqrt(const float4& a) { return map(a, a, [](float x, float) { return std::sqrt(x); }); }
+    friend float4 abs(const float4& a) { return map(a, a, [](float x, float) { return std::abs(x); }); }
+    friend float4 select(const float4& mask, const float4& a, const float4& b) {
+        float4 r;
+        for (int i = 0; i < 4; i++) r.v[i] = isSet(mask.v[i]) ? a.v[i] : b.v[i];
+        return r;
+    }
+    friend float hsum(const float4& a) { return (a.v[0] + a.v[1]) + (a.v[2] + a.v[3]); }
+    friend float4 exp(const float4& a) { return map(a, a, [](float x, float) { return std::exp(x); }); }
+#endif
+
+    float4& operator+=(const float4& b) { return *this = *this + b; }
+    float4& operator*=(const float4& b) { return *this = *this * b; }
+
+    /// Arc cosine (Abramowitz & Stegun 4.4.46, |error| <= 2e-8 on [0,1])
+    friend float4 acos(const float4& x) {
+        const float4 ax = min(abs(x), float4(1.f));
+        float4 p(-0.0012624911f);
+        p = p * ax + float4(0.0066700901f);
+        p = p * ax + float4(-0.0170881256f);
+        p = p * ax + float4(0.0308918810f);
+        p = p * ax + float4(-0.0501743046f);
+        p = p * ax + float4(0.0889789874f);
+        p = p * ax + float4(-0.2145988016f);
+        p = p * ax + float4(1.5707963050f);
+        const float4 r = sqrt(float4(1.f) - ax) * p;
+        return select(x < float4(0.f), float4(float(M_PI)) - r, r);
+    }
+};
+
+/// Three-component vector of float4, for operating on 4 points/directions at once
+struct v3f4 {
+    float4 x, y, z;
+
+    v3f4() { }
+    v3f4(const float4& x, const float4& y, const float4& z) : x(x), y(y), z(z) { }
+    explicit v3f4(const v3f& v) : x(v.x), y(v.y), z(v.z) { }
+
+    friend v3f4 operator+(const v3f4& a, const v3f4& b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+    friend v3f4 operator-(const v3f4& a, const v3f4& b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+    friend v3f4 operator*(const v3f4& a, const float4& s) { return {a.x * s, a.y * s, a.z * s}; }
+
+    friend float4 dot(const v3f4& a, const v3f4& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+    friend v3f4 cross(const v3f4& a, const v3f4& b) {
+        return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+    }
+    friend float4 length(const v3f4& a) { return sqrt(dot(a, a)); }
+};
+
+TR_NAMESPACE_END
@@ -11,6 +11,7 @@
 #include <core/platform.h>
 #include <tinyformat.h>
 #include "tinyexr.h"
+#include <core/exr.h>
 #include <iterator>
 #include <iostream>
 #include <iomanip>
@@ -90,69 +91,23 @@ inline bool saveEXR(const GLfloat* pixels, const std::string& filename, const in
 }
 
 /**
- * Saves render buffer to .exr image file.
+ * Saves channels to a single tiled .exr image file, each with its own pixel type.
+ * Layers are expressed with dotted channel names ("albedo.R").
  */
-inline bool saveEXR(const std::unique_ptr<v3f[]>& rgb, const std::string& filename, const int width, const int height) {
-    EXRHeader header;
-    InitEXRHeader(&header);
-
-    EXRImage image;
-    InitEXRImage(&image);
-
-    image.num_channels = 3;
-
-    std::vector<float> images[3];
-    images[0].resize(width * height);
-    images[1].resize(width * height);
-    images[2].resize(width * height);
-
-    // Split RGBRGBRGB... into R, G and B layer
-    for (int i = 0; i < width * height; i++) {
-        images[0][i] = rgb[i].x;
-        images[1][i] = rgb[i].y;
-        images[2][i] = rgb[i].z;
-    }
-
-    float* image_ptr[3];
-    image_ptr[0] = &(images[2].at(0)); // B
-    image_ptr[1] = &(images[1].at(0)); // G
-    image_ptr[2] = &(images[0].at(0)); // R
-
-    image.images = (unsigned char**) image_ptr;
-    image.width = width;
-    image.height = height;
-
-    header.num_channels = 3;
-    header.channels = (EXRChannelInfo*) malloc(sizeof(EXRChannelInfo) * header.num_channels);
-
-    // Must be (A)BGR order, since most of EXR viewers expect this channel order
-    strncpy(header.channels[0].name, "B", 255);
-    header.channels[0].name[strlen("B")] = '\0';
-    strncpy(header.channels[1].name, "G", 255);
-    header.channels[1].name[strlen("G")] = '\0';
-    strncpy(header.channels[2].name, "R", 255);
-    header.channels[2].name[strlen("R")] = '\0';
-
-    header.pixel_types = (int*) malloc(sizeof(int) * header.num_channels);
-    header.requested_pixel_types = (int*) malloc(sizeof(int) * header.num_channels);
-    for (int i = 0; i < header.num_channels; i++) {
-        header.pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
-        header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_HALF;
-    }
-
-    const char* err = nullptr;
-    int ret = SaveEXRImageToFile(&image, &header, filename.c_str(), &err);
-    if (ret != TINYEXR_SUCCESS) {
-        fprintf(stderr, "Save EXR err: %s\n", err);
-        FreeEXRErrorMessage(err);
-        return false;
-    }
-    std::cout << "\nSaved EXR image to " << filename << std::endl;
+inline bool saveEXR(const std::vector<EXRChannel>& channels, const std::string& filename, const int width, const int height) {
+    TiledEXRWriter writer(filename, width, height, channels);
+    if (!writer.open()) return false;
+    for (int ty = 0; ty < writer.getTilesY(); ty++) writer.writeTileRow(ty);
+    return writer.close();
+}
 
-    free(header.channels);
-    free(header.pixel_types);
-    free(header.requested_pixel_types);
-    return true;
+/**
+ * Saves render buffer to .exr image file (32-bit float RGB).
+ */
+inline bool saveEXR(const std::unique_ptr<v3f[]>& rgb, const std::string& filename, const int width, const int height) {
+    const float* data = &rgb[0].x;
+    return saveEXR({{"R", data + 0, 3, false}, {"G", data + 1, 3, false}, {"B", data + 2, 3, false}},
+                   filename, width, height);
 }
 
 /**
@@ -95,13 +95,16 @@ struct DirectIntegrator : Integrator {
                 float emitterPdf;
                 size_t id = selectEmitter(sampler.next(), emitterPdf);
                 const Emitter& em = getEmitterByID(id);
-                const v3f emitterCenter = scene.getShapeCenter(em.shapeID);
-                float emitterRadius = scene.getShapeRadius(em.shapeID);
 
                 v3f Ypos, Ynormal, wiW;
 
-                sampleSphereByArea(sampler.next2D(), info.p, emitterCenter, emitterRadius,
-                        Ypos, Ynormal, wiW, samplePdf);
+                if (em.shape == ESphereEmitter)
+                    sampleSphereByArea(sampler.next2D(), info.p, em.center, em.radius,
+                            Ypos, Ynormal, wiW, samplePdf);
+                else {
+                    sampleEmitterPosition(sampler, em, Ynormal, Ypos, samplePdf);
+                    wiW = normalize(Ypos - info.p);
+                }
 
                 info.wi = normalize(info.frameNs.toLocal(wiW));
                 // No more cosTheta!!!!
@@ -122,7 +125,9 @@ struct DirectIntegrator : Integrator {
                 // uniform sample the whole sphere ensures each solid angle sample maps to two surface points
                 // hemisphere cannot ensures this uniformity.
 
-                if ( scene.bvh->intersect(shadowRay, shadowInfo) && shadowInfo.shapeID==em.shapeID )
+                // The first hit must be the sampled point, not another part of the emitter in front of it
+                const float dist = glm::distance(Ypos, info.p);
+                if ( scene.bvh->intersect(shadowRay, shadowInfo) && isEmitterSample(em, shadowInfo, dist) )
                 {
                     //cout<<shadowInfo.shapeID<<" "<<em.shapeID<<endl;
                     v3f lightIntense = getEmission( shadowInfo );
@@ -139,7 +144,7 @@ struct DirectIntegrator : Integrator {
                         lightIntense = v3f(0.);
                     }
 
-                    v3f bsdf = getBSDF(info)->eval(info);
+                    v3f bsdf = getMaterial(info)->eval(info);
                     Lr += bsdf * lightIntense / samplePdf / emitterPdf;
                 }
             }
@@ -178,7 +183,7 @@ struct DirectIntegrator : Integrator {
                 if ( scene.bvh->intersect(lightRay, emitterInfo) && getEmission( emitterInfo )!=v3f(0) )
                 {
                     v3f lightIntense = getEmission( emitterInfo );
-                    v3f bsdf = getBSDF(info)->eval(info);
+                    v3f bsdf = getMaterial(info)->eval(info);
                     Lr += bsdf * lightIntense / samplePdf;
                 }
             }
@@ -201,7 +206,7 @@ struct DirectIntegrator : Integrator {
             for ( size_t i = 0; i < m_bsdfSamples; i++ )
             {
                 float pdf;
-                v3f bsdf = getBSDF(info)->sample(info, sampler, &pdf);
+                v3f bsdf = getMaterial(info)->sample(info, sampler, &pdf);
                 float cosTheta = info.wi.z;
                 // No more cosTheta!!!!
                 // BSDF is already multiplied by cosTheta
@@ -240,21 +245,21 @@ struct DirectIntegrator : Integrator {
                 float emitterPdf;
                 size_t id = selectEmitter(sampler.next(), emitterPdf);
                 const Emitter& em = getEmitterByID(id);
-                const v3f emitterCenter = scene.getShapeCenter(em.shapeID);
-                float emitterRadius = scene.getShapeRadius(em.shapeID);
 
                 v3f wiW;
+                float dist;
 
-                sampleSphereBySolidAngle(sampler.next2D(), info.p, emitterCenter, emitterRadius, wiW, samplePdf);
+                sampleEmitterSolidAngle(sampler, em, info.p, info.frameNs.n, wiW, samplePdf, &dist);
+                if (samplePdf <= 0.f) continue;
 
                 info.wi = normalize(info.frameNs.toLocal(wiW));
 
                 SurfaceInteraction shadowInfo;
                 Ray shadowRay(info.p, normalize(wiW), Epsilon);
-                if ( scene.bvh->intersect(shadowRay, shadowInfo) && shadowInfo.shapeID==em.shapeID )
+                if ( scene.bvh->intersect(shadowRay, shadowInfo) && isEmitterSample(em, shadowInfo, dist) )
                 {
                     v3f lightIntense = getEmission( shadowInfo );
-                    v3f bsdf = getBSDF(info)->eval(info);
+                    v3f bsdf = getMaterial(info)->eval(info);
                     Lr += bsdf * lightIntense / samplePdf / emitterPdf;
                 }
             }
@@ -285,22 +290,22 @@ struct DirectIntegrator : Integrator {
                 float emitterPdf;
                 size_t id = selectEmitter(sampler.next(), emitterPdf);
                 const Emitter& em = getEmitterByID(id);
-                const v3f emitterCenter = scene.getShapeCenter(em.shapeID);
-                float emitterRadius = scene.getShapeRadius(em.shapeID);
 
                 v3f wiW;
+                float dist;
 
-                sampleSphereBySolidAngle(sampler.next2D(), info.p, emitterCenter, emitterRadius, wiW, samplePdf);
+                sampleEmitterSolidAngle(sampler, em, info.p, info.frameNs.n, wiW, samplePdf, &dist);
+                if (samplePdf <= 0.f) continue;
 
                 info.wi = normalize(info.frameNs.toLocal(wiW));
 
                 SurfaceInteraction shadowInfo;
                 Ray shadowRay(info.p, normalize(wiW), Epsilon);
-                if ( scene.bvh->intersect(shadowRay, shadowInfo) && shadowInfo.shapeID==em.shapeID )
+                if ( scene.bvh->intersect(shadowRay, shadowInfo) && isEmitterSample(em, shadowInfo, dist) )
                 {
                     v3f lightIntense = getEmission( shadowInfo );
-                    v3f bsdf = getBSDF(info)->eval(info);
-                    we = balanceHeuristic(m_emitterSamples, samplePdf * emitterPdf, m_bsdfSamples, getBSDF(info)->pdf(info));
+                    v3f bsdf = getMaterial(info)->eval(info);
+                    we = balanceHeuristic(m_emitterSamples, samplePdf * emitterPdf, m_bsdfSamples, getMaterial(info)->pdf(info));
                     LE += bsdf * lightIntense / samplePdf / emitterPdf * we;
                 }
             }
@@ -308,7 +313,7 @@ struct DirectIntegrator : Integrator {
             for ( size_t i = 0; i < m_bsdfSamples; i++ )
             {
                 float pdf;
-                v3f bsdf = getBSDF(info)->sample(info, sampler, &pdf);
+                v3f bsdf = getMaterial(info)->sample(info, sampler, &pdf);
                 float cosTheta = info.wi.z;
                 Ray lightRay(info.p, normalize(info.frameNs.toWorld(info.wi)), Epsilon);
 
@@ -316,15 +321,10 @@ struct DirectIntegrator : Integrator {
 
                 if ( scene.bvh->intersect(lightRay, emitterInfo) && getEmission( emitterInfo )!=v3f(0) )
                 {
-                    float samplePdf;
                     const Emitter& em = getEmitterByID(int(getEmitterIDByShapeID(emitterInfo.shapeID)));
-                    float emitterRadius = scene.getShapeRadius(em.shapeID);
-                    v3f emitterCenter = scene.getShapeCenter(em.shapeID);
-                    float dist = distance(emitterCenter, info.p);
-                    float cosThetaMax = sqrt(pow(dist, 2) - pow(emitterRadius, 2)) / dist;
-                    samplePdf = Warp::squareToUniformConePdf(cosThetaMax);
+                    float samplePdf = getEmitterSolidAnglePdf(em, info.p, info.frameNs.n, emitterInfo);
 
-                    wm = balanceHeuristic(m_bsdfSamples, pdf, m_emitterSamples, samplePdf * 1.f / scene.emitters.size());
+                    wm = balanceHeuristic(m_bsdfSamples, pdf, m_emitterSamples, samplePdf * getEmitterPdf(em));
                     v3f lightIntense = getEmission( emitterInfo );
                     LM += bsdf * lightIntense / pdf * wm;
                 }
@@ -7,6 +7,9 @@
 
 #pragma once
 
+#include <core/irradiancecache.h>
+#include <core/sdtree.h>
+
 TR_NAMESPACE_BEGIN
 
 /**
@@ -18,22 +21,353 @@ struct PathTracerIntegrator : Integrator {
         m_maxDepth = scene.config.integratorSettings.pt.maxDepth;
         m_rrDepth = scene.config.integratorSettings.pt.rrDepth;
         m_rrProb = scene.config.integratorSettings.pt.rrProb;
+
+        m_icSamples = scene.config.integratorSettings.pt.icSamples;
+        if (scene.config.integratorSettings.pt.irradianceCache)
+            m_irradianceCache = std::unique_ptr<IrradianceCache>(
+                new IrradianceCache(scene.aabb, scene.config.integratorSettings.pt.icError));
+
+        if (scene.config.integratorSettings.pt.pathGuiding) {
+            m_guidingPasses = scene.config.integratorSettings.pt.guidingPasses;
+            m_bsdfSamplingFraction = scene.config.integratorSettings.pt.bsdfSamplingFraction;
+            m_sdTree = std::unique_ptr<SDTree>(new SDTree(scene.aabb));
+
+            const std::string& file = scene.config.integratorSettings.pt.guidingFile;
+            if (!file.empty()) {
+                m_guidingFile = fs::path(file);
+                if (!m_guidingFile.is_absolute())
+                    m_guidingFile = (scene.config.tomlFile.parent_path() / m_guidingFile).make_preferred();
+
+                // Reuse a previously learned distribution (e.g. other frames of the same scene)
+                if (fs::exists(m_guidingFile)) {
+                    if (!m_sdTree->load(m_guidingFile.string()))
+                        throw std::runtime_error("Could not load SD-tree " + m_guidingFile.string());
+                    std::cout << "Loaded SD-tree " << m_guidingFile.string() << std::endl;
+                    m_guidingPasses = 0;
+                }
+            }
+        }
+    }
+
+    void cleanUp() override {
+        if (m_irradianceCache)
+            std::cout << "Irradiance cache: " << m_irradianceCache->nbRecords << " records" << std::endl;
+        Integrator::cleanUp();
+    }
+
+    int getTrainingPasses() const override { return m_sdTree ? m_guidingPasses : 0; }
+
+    /// Irradiance records are computed where they are first needed, which depends on the rows rendered before
+    bool isOrderDependent() const override { return bool(m_irradianceCache); }
+
+    void beginTrainingPass(int pass) override { m_training = true; }
+
+    void endTrainingPass(int pass) override {
+        m_training = false;
+        m_sdTree->refine(pass);
+        if (pass + 1 == m_guidingPasses && !m_guidingFile.empty()) {
+            if (m_sdTree->save(m_guidingFile.string()))
+                std::cout << "Saved SD-tree " << m_guidingFile.string() << std::endl;
+            else
+                std::cout << "Could not save SD-tree " << m_guidingFile.string() << std::endl;
+        }
+        // Later frames of an animation reuse the learned distribution
+        if (pass + 1 == m_guidingPasses) m_guidingPasses = 0;
+    }
+
+    /**
+     * Vertices of the current path, for recording the incident radiance into the SD-tree.
+     * Each vertex keeps the throughput up to its outgoing direction, so that the incident
+     * radiance along that direction is the radiance collected afterwards divided by it.
+     */
+    struct GuidingPath {
+        struct Vertex {
+            v3f p;          // Vertex position
+            v3f d;          // Sampled direction (world space)
+            v3f throughput; // Path throughput including the bounce at this vertex
+            v3f radiance;   // Radiance collected by the path after this vertex
+            float pdf;      // Solid angle pdf of the sampled direction
+        };
+
+        static const int MaxVertices = 32;
+        Vertex vertices[MaxVertices];
+        int nbVertices = 0;
+
+        void push(const v3f& p, const v3f& d, const v3f& throughput, float pdf) {
+            if (nbVertices < MaxVertices) vertices[nbVertices++] = {p, d, throughput, v3f(0.f), pdf};
+        }
+
+        void add(const v3f& contrib) {
+            for (int i = 0; i < nbVertices; i++) vertices[i].radiance += contrib;
+        }
+
+        void commit(const SDTree& sdTree) const {
+            for (int i = 0; i < nbVertices; i++) {
+                const Vertex& v = vertices[i];
+                v3f L(0.f);
+                for (int c = 0; c < 3; c++)
+                    if (v.throughput[c] > 0.f) L[c] = v.radiance[c] / v.throughput[c];
+                sdTree.getDTree(v.p)->record(v.d, getLuminance(L) / v.pdf);
+            }
+        }
+    };
+
+    /**
+     * Samples the next direction of a path (stored in hit.wi) and returns f / pdf.
+     * With path guiding, BSDF and SD-tree sampling are combined by one-sample MIS (balance heuristic).
+     * Only diffuse BSDFs are guided, since the others do not sample exactly their pdf().
+     */
+    v3f sampleBounce(SurfaceInteraction& hit, Sampler& sampler, float& pdf) const {
+        const Material* bsdf = getMaterial(hit);
+        const DTree* dtree = m_sdTree ? &m_sdTree->getDTree(hit.p)->sampling : nullptr;
+
+        if (!dtree || dtree->total() <= 0.f || bsdf->getType() != BSDF::EDiffuseReflection) {
+            const v3f f = bsdf->sample(hit, sampler, &pdf);
+            return pdf > 0.f ? f / pdf : v3f(0.f);
+        }
+
+        const float alpha = m_bsdfSamplingFraction;
+        if (sampler.next() < alpha) {
+            bsdf->sample(hit, sampler, &pdf);
+        } else {
+            hit.wi = glm::normalize(hit.frameNs.toLocal(dtree->sample(sampler.next2D())));
+        }
+
+        const v3f f = bsdf->eval(hit);
+        pdf = alpha * std::max(bsdf->pdf(hit), 0.f)
+              + (1.f - alpha) * dtree->pdf(glm::normalize(hit.frameNs.toWorld(hit.wi)));
+        return pdf > 0.f ? f / pdf : v3f(0.f);
     }
 
+    /// Continue a path from a surface hit, accumulating emission on emitter hits (no light sampling)
+    v3f traceImplicit(SurfaceInteraction& hit, Sampler& sampler, int depth) const {
+        v3f Li(0.f);
+        v3f throughput(1.f);
+        GuidingPath path;
+
+        for (; m_maxDepth < 0 || depth < m_maxDepth; depth++) {
+            if (depth >= m_rrDepth) {
+                if (sampler.next() > m_rrProb) break;
+                throughput /= m_rrProb;
+            }
+
+            float pdf;
+            const v3f w = sampleBounce(hit, sampler, pdf);
+            if (isZero(w)) break;
+            throughput *= w;
+
+            Ray r(hit.p, glm::normalize(hit.frameNs.toWorld(hit.wi)));
+            if (m_training) path.push(hit.p, r.d, throughput, pdf);
+            SurfaceInteraction next;
+            if (!scene.bvh->intersect(r, next)) break;
+
+            if (getMaterial(next)->isEmissive()) {
+                if (next.wo.z > 0.f) {
+                    Li += throughput * getEmission(next);
+                    path.add(throughput * getEmission(next));
+                }
+                break;
+            }
+            hit = next;
+        }
+
+        if (m_training) path.commit(*m_sdTree);
+        return Li;
+    }
+
+    /// Direct illumination at a surface hit from one emitter sample (solid angle measure, shadowed)
+    v3f sampleDirect(SurfaceInteraction& hit, Sampler& sampler) const {
+        float emPdf;
+        const Emitter& em = getEmitterByID(selectEmitter(sampler.next(), emPdf));
+
+        v3f wiW;
+        float pdf, dist;
+        sampleEmitterSolidAngle(sampler, em, hit.p, hit.frameNs.n, wiW, pdf, &dist);
+        if (pdf <= 0.f) return v3f(0.f);
+
+        hit.wi = hit.frameNs.toLocal(wiW);
+        const v3f f = getMaterial(hit)->eval(hit);
+        if (isZero(f)) return v3f(0.f);
+
+        // Visible if the first surface along the sampled direction is the front of the emitter, at the sampled
+        // point (the pdf is the one of the sampled triangle, not of another part of the emitter in front of it)
+        SurfaceInteraction lightHit;
+        Ray shadowRay(hit.p, wiW);
+        if (!scene.bvh->intersect(shadowRay, lightHit) || !isEmitterSample(em, lightHit, dist) || lightHit.wo.z <= 0.f)
+            return v3f(0.f);
+
+        return f * em.getRadiance() / (pdf * emPdf);
+    }
+
+    /// Continue a path from a surface hit, sampling the emitters explicitly at each vertex
+    v3f traceExplicit(SurfaceInteraction& hit, Sampler& sampler, int depth) const {
+        v3f Li(0.f);
+        v3f throughput(1.f);
+        // With explicit emitter sampling, the guiding distribution learns the indirect radiance only
+        GuidingPath path;
+
+        for (;; depth++) {
+            const v3f Ld = throughput * sampleDirect(hit, sampler);
+            Li += Ld;
+            path.add(Ld);
+
+            if (m_maxDepth >= 0 && depth >= m_maxDepth) break;
+            if (depth >= m_rrDepth) {
+                if (sampler.next() > m_rrProb) break;
+                throughput /= m_rrProb;
+            }
+
+            float pdf;
+            const v3f w = sampleBounce(hit, sampler, pdf);
+            if (isZero(w)) break;
+            throughput *= w;
+
+            Ray r(hit.p, glm::normalize(hit.frameNs.toWorld(hit.wi)));
+            if (m_training) path.push(hit.p, r.d, throughput, pdf);
+            SurfaceInteraction next;
+            if (!scene.bvh->intersect(r, next)) break;
+
+            // Emitters were already accounted for by explicit sampling
+            if (getMaterial(next)->isEmissive()) break;
+            hit = next;
+        }
+
+        if (m_training) path.commit(*m_sdTree);
+        return Li;
+    }
+
+    /**
+     * Computes a new irradiance cache record at a surface hit.
+     * Gathers indirect radiance over a stratified, cosine-weighted hemisphere and estimates
+     * the translational and rotational gradients from the strata (Ward & Heckbert '92).
+     */
+    IrradianceRecord computeIrradianceRecord(const SurfaceInteraction& hit, Sampler& sampler) const {
+        const int M = std::max(2, int(std::round(std::sqrt(m_icSamples / M_PI))));
+        const int N = std::max(3, m_icSamples / M);
+
+        std::vector<v3f> L(M * N);
+        std::vector<float> r(M * N);
+        float invDistSum = 0.f;
+
+        for (int j = 0; j < M; j++) {
+            for (int k = 0; k < N; k++) {
+                const p2f u = sampler.next2D();
+                const float sinTheta = std::sqrt((j + u.x) / M);
+                const float cosTheta = safeSqrt(1.f - sinTheta * sinTheta);
+                const float phi = 2.f * M_PI * (k + u.y) / N;
+                const v3f wi(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+
+                v3f& Ljk = L[j * N + k];
+                float& rjk = r[j * N + k];
+                Ljk = v3f(0.f);
+                rjk = std::numeric_limits<float>::infinity();
+
+                Ray ray(hit.p, glm::normalize(hit.frameNs.toWorld(wi)));
+                SurfaceInteraction gather;
+                if (!scene.bvh->intersect(ray, gather)) continue;
+
+                rjk = gather.t;
+                invDistSum += 1.f / gather.t;
+                if (!getMaterial(gather)->isEmissive())
+                    Ljk = traceExplicit(gather, sampler, 1);
+            }
+        }
+
+        IrradianceRecord rec;
+        rec.p = hit.p;
+        rec.n = hit.frameNs.n;
+        rec.R = invDistSum > 0.f ? (M * N) / invDistSum : std::numeric_limits<float>::infinity();
+
+        v3f E(0.f), gradT[3], gradR[3];
+        for (int c = 0; c < 3; c++) gradT[c] = gradR[c] = v3f(0.f);
+
+        for (int k = 0; k < N; k++) {
+            const float phi = 2.f * M_PI * (k + 0.5f) / N;
+            const float phiMinus = 2.f * M_PI * k / N;
+            const v3f uk(std::cos(phi), std::sin(phi), 0.f);
+            const v3f vk(-std::sin(phi), std::cos(phi), 0.f);
+            const v3f vkMinus(-std::sin(phiMinus), std::cos(phiMinus), 0.f);
+            const int kPrev = (k + N - 1) % N;
+
+            v3f sumU(0.f), sumV(0.f), sumR(0.f);
+            for (int j = 0; j < M; j++) {
+                const v3f& Ljk = L[j * N + k];
+                const float sinMinus = std::sqrt(float(j) / M);
+                const float sinPlus = std::sqrt(float(j + 1) / M);
+                const float sinCenter = std::sqrt((j + 0.5f) / M);
+
+                E += Ljk;
+                sumR -= Ljk * (sinCenter / safeSqrt(1.f - sinCenter * sinCenter));
+
+                if (j > 0) {
+                    const float cos2Minus = 1.f - sinMinus * sinMinus;
+                    const float rmin = std::min(r[j * N + k], r[(j - 1) * N + k]);
+                    sumU += (Ljk - L[(j - 1) * N + k]) * (sinMinus * cos2Minus / rmin);
+                }
+                const float rmin = std::min(r[j * N + k], r[j * N + kPrev]);
+                sumV += (Ljk - L[j * N + kPrev]) * ((sinPlus - sinMinus) / rmin);
+            }
+
+            for (int c = 0; c < 3; c++) {
+                gradT[c] += uk * (2.f * M_PI / N * sumU[c]) + vkMinus * sumV[c];
+                gradR[c] += vk * sumR[c];
+            }
+        }
+
+        const float norm = M_PI / (M * N);
+        rec.E = E * norm;
+        for (int c = 0; c < 3; c++) {
+            rec.gradT[c] = hit.frameNs.toWorld(gradT[c]);
+            rec.gradR[c] = hit.frameNs.toWorld(gradR[c] * norm);
+        }
+
+        // Gradient limiting: the radius should not exceed the extent over which
+        // the first-order extrapolation stays within the irradiance magnitude
+        const float gradNorm = glm::length(v3f(glm::length(rec.gradT[0]),
+                                               glm::length(rec.gradT[1]),
+                                               glm::length(rec.gradT[2])));
+        if (gradNorm > 0.f)
+            rec.R = std::min(rec.R, glm::length(rec.E) / gradNorm);
+
+        return rec;
+    }
+
+    /// Indirect irradiance at a diffuse surface hit, from the cache or by computing a new record
+    v3f getCachedIrradiance(const SurfaceInteraction& hit, Sampler& sampler) const {
+        v3f E;
+        if (m_irradianceCache->lookup(hit.p, hit.frameNs.n, E)) return E;
+
+        IrradianceRecord rec = computeIrradianceRecord(hit, sampler);
+        m_irradianceCache->insert(rec);
+        return rec.E;
+    }
 
     v3f renderImplicit(const Ray& ray, Sampler& sampler, SurfaceInteraction& hit) const {
         v3f Li(0.f);
 
-        // TODO(A5): Implement this
+        if (getMaterial(hit)->isEmissive())
+            return hit.wo.z > 0.f ? getEmission(hit) : Li;
 
+        Li = traceImplicit(hit, sampler, 0);
         return Li;
     }
 
     v3f renderExplicit(const Ray& ray, Sampler& sampler, SurfaceInteraction& hit) const {
         v3f Li(0.f);
 
-        // TODO(A5): Implement this
+        const Material* bsdf = getMaterial(hit);
+        if (bsdf->isEmissive())
+            return hit.wo.z > 0.f ? getEmission(hit) : Li;
+
+        // Diffuse first bounce: direct lighting + cached indirect irradiance
+        if (m_irradianceCache && m_maxDepth != 0 && bsdf->getType() == BSDF::EDiffuseReflection) {
+            Li += sampleDirect(hit, sampler);
+            hit.wi = v3f(0, 0, 1); // Trick to get 1/pi * albedo without cosine term
+            Li += bsdf->eval(hit) * getCachedIrradiance(hit, sampler);
+            return Li;
+        }
 
+        Li = traceExplicit(hit, sampler, 0);
         return Li;
     }
 
@@ -55,6 +389,15 @@ struct PathTracerIntegrator : Integrator {
     int m_rrDepth;      // When to start Russian roulette
     float m_rrProb;     // Russian roulette probability
     bool m_isExplicit;  // Implicit or explicit
+
+    int m_icSamples;    // Number of hemisphere samples to compute an irradiance cache record
+    std::unique_ptr<IrradianceCache> m_irradianceCache;   // Indirect diffuse irradiance cache (optional)
+
+    std::unique_ptr<SDTree> m_sdTree;    // Learned incident radiance for path guiding (optional)
+    int m_guidingPasses = 0;             // Number of training passes (0 when the SD-tree is loaded)
+    float m_bsdfSamplingFraction = 0.5f; // Probability of sampling the BSDF rather than the SD-tree
+    fs::path m_guidingFile;              // Where to save/load the SD-tree
+    bool m_training = false;             // Whether paths are recorded into the SD-tree
 };
 
 TR_NAMESPACE_END
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <tiny_obj_loader.h>
+#include <core/simd.h>
 #define RAY_EPS_CV 1e-5 // Use when setting min and max dist for ray in control variates code
 TR_NAMESPACE_BEGIN
 
@@ -22,7 +23,24 @@ struct PolygonalIntegrator : Integrator {
 	bool m_traceShadows;       // Trace shadows or not
 	EPolygonalMethod m_method; // Method to use (Arvo, or control variates)
 
-	std::vector<std::vector<v3f>> m_triangles; // Data structure to store triangles
+	/**
+	 * Emitter triangles, gathered once in structure-of-arrays layout so that the edge
+	 * integrals of 4 triangles are evaluated at once. Each emitter's range is padded to a
+	 * multiple of 4 with degenerate triangles (zero normal), which never contribute.
+	 * Vertices are wound counter-clockwise around the emitting side.
+	 */
+	struct PackedTriangles {
+		std::vector<float> v[3][3];  // v[k][c][t]: coordinate c of vertex k of triangle t
+		std::vector<float> n[3];     // n[c][t]: emitting (geometric) normal of triangle t
+		std::vector<size_t> offset;  // Triangles of emitter e are in [offset[e], offset[e + 1])
+
+		void push(const v3f p[3], const v3f& normal) {
+			for (int k = 0; k < 3; k++)
+				for (int c = 0; c < 3; c++) v[k][c].push_back(p[k][c]);
+			for (int c = 0; c < 3; c++) n[c].push_back(normal[c]);
+		}
+		size_t size() const { return n[0].size(); }
+	} m_triangles;
 
     explicit PolygonalIntegrator(const Scene& scene) : Integrator(scene) {
         m_alpha = scene.config.integratorSettings.poly.alpha;
@@ -35,6 +53,35 @@ struct PolygonalIntegrator : Integrator {
 		 * 2) Store vertices in m_triangles
 		 */
 // TODO(A4): Implement this
+        const auto& vx = scene.worldData.attrib.vertices;
+        const auto& ns = scene.worldData.attrib.normals;
+
+        m_triangles.offset.push_back(0);
+        for (const Emitter& em : scene.emitters) {
+            const tinyobj::shape_t& shape = scene.worldData.shapes[em.shapeID];
+            for (size_t t = 0; t < shape.mesh.indices.size(); t += 3) {
+                v3f p[3], ns_sum(0.f);
+                for (int k = 0; k < 3; k++) {
+                    const tinyobj::index_t& idx = shape.mesh.indices[t + k];
+                    p[k] = v3f(vx[3 * idx.vertex_index + 0], vx[3 * idx.vertex_index + 1], vx[3 * idx.vertex_index + 2]);
+                    if (idx.normal_index >= 0)
+                        ns_sum += v3f(ns[3 * idx.normal_index + 0], ns[3 * idx.normal_index + 1], ns[3 * idx.normal_index + 2]);
+                }
+
+                v3f ng = glm::cross(p[1] - p[0], p[2] - p[0]);
+                if (glm::length2(ng) <= 0.f) continue;
+                // Canonical winding: the geometric normal agrees with the shading normals
+                if (glm::dot(ng, ns_sum) < 0.f) {
+                    std::swap(p[1], p[2]);
+                    ng = -ng;
+                }
+                m_triangles.push(p, glm::normalize(ng));
+            }
+
+            const v3f zero[3] = {v3f(0.f), v3f(0.f), v3f(0.f)};
+            while (m_triangles.size() % 4) m_triangles.push(zero, v3f(0.f));
+            m_triangles.offset.push_back(m_triangles.size());
+        }
     }
 
     /// Reflect
@@ -71,16 +118,76 @@ struct PolygonalIntegrator : Integrator {
         float contrib = 0.f;
 
         // TODO(A4): Implement this
+        const v3f u1 = glm::normalize(v1 - i.p);
+        const v3f u2 = glm::normalize(v2 - i.p);
+        const v3f gamma = glm::cross(u1, u2);
+        const float len = glm::length(gamma);
+        if (len <= 0.f) return contrib;
+
+        const float theta = std::acos(clamp(glm::dot(u1, u2), -1.f, 1.f));
+        contrib = theta * glm::dot(gamma / len, i.frameNs.n);
 
         return contrib;
     }
-	   
+
+    /**
+     * Edge contributions of 4 packed triangles, starting at triangle t, one edge per lane at a time.
+     * Returns the (clamped) solid angle projected onto n of each triangle, i.e. -1/2 \sum_k theta_k Gamma_k . n,
+     * and 0 for triangles whose emitting side faces away from x.
+     */
+    float4 getTriangleContrib4(size_t t, const v3f4& x, const v3f4& n) const {
+        const PackedTriangles& tri = m_triangles;
+        v3f4 u[3];
+        for (int k = 0; k < 3; k++)
+            u[k] = v3f4(float4::load(&tri.v[k][0][t]), float4::load(&tri.v[k][1][t]), float4::load(&tri.v[k][2][t])) - x;
+
+        const v3f4 ne(float4::load(&tri.n[0][t]), float4::load(&tri.n[1][t]), float4::load(&tri.n[2][t]));
+        const float4 front = dot(ne, u[0]) < float4(0.f);
+
+        for (int k = 0; k < 3; k++) u[k] = u[k] * (float4(1.f) / length(u[k]));
+
+        float4 sum(0.f);
+        for (int k = 0; k < 3; k++) {
+            const v3f4& a = u[k];
+            const v3f4& b = u[(k + 1) % 3];
+            const v3f4 gamma = cross(a, b);
+            const float4 len = length(gamma);
+            const float4 theta = acos(dot(a, b));
+            sum += select(len > float4(0.f), theta * dot(gamma, n) / len, float4(0.f));
+        }
+
+        return select(front, max(float4(-0.5f) * sum, float4(0.f)), float4(0.f));
+    }
+
+    /// Unshadowed irradiance at a surface point from all the emitters (Arvo '94)
+    v3f getIrradiance(const SurfaceInteraction& i) const {
+        v3f E(0.f);
+        const v3f4 x(i.p);
+        const v3f4 n(glm::normalize(i.frameNs.n));
+
+        for (size_t e = 0; e < scene.emitters.size(); e++) {
+            float4 sum(0.f);
+            for (size_t t = m_triangles.offset[e]; t < m_triangles.offset[e + 1]; t += 4)
+                sum += getTriangleContrib4(t, x, n);
+            E += getEmitterByID(e).getRadiance() * hsum(sum);
+        }
+
+        return E;
+    }
 
     /// Direct illumination using Arvo '94 analytic solution for polygonal lights
     v3f renderAnalytic(const Ray& ray, Sampler& sampler) const {
         v3f Lr(0.f);
 
         // TODO(A4): Implement this
+        SurfaceInteraction hit;
+        if (!scene.bvh->intersect(ray, hit)) return Lr;
+
+        const Material* bsdf = getMaterial(hit);
+        if (bsdf->isEmissive()) return getEmission(hit);
+
+        hit.wi = v3f(0, 0, 1); // Trick to get 1/pi * albedo without cosine term
+        Lr = bsdf->eval(hit) * getIrradiance(hit);
 
         return Lr;
     }
@@ -96,7 +203,7 @@ struct PolygonalIntegrator : Integrator {
         SurfaceInteraction hit;
         if (!scene.bvh->intersect(ray, hit)) return D;
 
-        const BSDF* bsdf = getBSDF(hit);
+        const Material* bsdf = getMaterial(hit);
         if (bsdf->isEmissive()) return D;
 
         hit.wi = v3f(0, 0, 1); // Trick to get 1/pi * albedo without cosine term
@@ -110,9 +217,33 @@ struct PolygonalIntegrator : Integrator {
     v3f estimateVisDiff(Sampler& sampler, SurfaceInteraction& i, const Emitter& em) const {
         v3f sum(0.f);
 
-        // TODO(A4): Implement this
+        // i.wi = (0, 0, 1): the BSDF evaluates to albedo / pi
+        const v3f brdf = getMaterial(i)->eval(i);
+        const v3f n = glm::normalize(i.frameNs.n);
+
+        for (size_t s = 0; s < m_visSamples; s++) {
+            v3f ne, pe;
+            float pdf;
+            sampleEmitterPosition(sampler, em, ne, pe, pdf);
+
+            v3f wiW = pe - i.p;
+            const float d2 = glm::length2(wiW);
+            const float dist = std::sqrt(d2);
+            wiW /= dist;
+            const float cosI = glm::dot(n, wiW);
+            const float cosL = glm::dot(ne, -wiW);
+            if (cosI <= 0.f || cosL <= 0.f) continue;
+
+            // Unshadowed estimate g, and h = V * g
+            const v3f g = brdf * em.getRadiance() * cosI * cosL / (d2 * pdf);
+            SurfaceInteraction shadow;
+            Ray shadowRay(i.p, wiW, RAY_EPS_CV, dist - RAY_EPS_CV);
+            const bool visible = !scene.bvh->intersect(shadowRay, shadow);
+
+            sum += (visible ? g : v3f(0.f)) - m_alpha * g;
+        }
 
-        return sum;
+        return sum / float(m_visSamples);
     }
 
     /// Control variates using Arvo '94 for direct illumination; ray trace shadows
@@ -121,6 +252,17 @@ struct PolygonalIntegrator : Integrator {
         v3f Lr(0.f);
 
         // TODO(A4): Implement this
+        SurfaceInteraction hit;
+        if (!scene.bvh->intersect(ray, hit)) return Lr;
+
+        const Material* bsdf = getMaterial(hit);
+        if (bsdf->isEmissive()) return getEmission(hit);
+
+        // alpha * (analytic unshadowed term) + MC estimate of h - alpha * g
+        hit.wi = v3f(0, 0, 1); // Trick to get 1/pi * albedo without cosine term
+        Lr = m_alpha * bsdf->eval(hit) * getIrradiance(hit);
+        for (size_t e = 0; e < scene.emitters.size(); e++)
+            Lr += estimateVisDiff(sampler, hit, getEmitterByID(e));
 
         return Lr;
     }
@@ -130,6 +272,33 @@ struct PolygonalIntegrator : Integrator {
         v3f Lr(0.f);
 
         // TODO(A4): Implement this
+        SurfaceInteraction hit;
+        if (!scene.bvh->intersect(ray, hit)) return Lr;
+
+        const Material* bsdf = getMaterial(hit);
+        if (bsdf->isEmissive()) return getEmission(hit);
+
+        float emPdf;
+        const Emitter& em = getEmitterByID(selectEmitter(sampler.next(), emPdf));
+        v3f ne, pe;
+        float pdf;
+        sampleEmitterPosition(sampler, em, ne, pe, pdf);
+
+        v3f wiW = pe - hit.p;
+        const float d2 = glm::length2(wiW);
+        const float dist = std::sqrt(d2);
+        wiW /= dist;
+        const float cosL = glm::dot(ne, -wiW);
+        if (cosL <= 0.f) return Lr;
+
+        if (m_traceShadows) {
+            SurfaceInteraction shadow;
+            Ray shadowRay(hit.p, wiW, Epsilon, dist * (1.f - 1e-3f));
+            if (scene.bvh->intersect(shadowRay, shadow)) return Lr;
+        }
+
+        hit.wi = hit.frameNs.toLocal(wiW);
+        Lr = bsdf->eval(hit) * em.getRadiance() * cosL / (d2 * pdf * emPdf);
 
         return Lr;
     }
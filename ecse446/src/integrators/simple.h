@@ -37,7 +37,7 @@ struct SimpleIntegrator : Integrator {
                 // distance falloff
                 v3f distance = lightPos - hitInfo.p;
                 hitInfo.wi = normalize( hitInfo.frameNs.toLocal( distance ) );
-                Li = ( lightIntens / glm::length2( distance ) ) * ( getBSDF( hitInfo )->eval( hitInfo ) );
+                Li = ( lightIntens / glm::length2( distance ) ) * ( getMaterial( hitInfo )->eval( hitInfo ) );
             }
         }
         else
@@ -5,9 +5,11 @@
     Derek Nowrouzezahrai, McGill University.
 */
 
+#include <chrono>
 #include <core/core.h>
 #include <core/platform.h>
 #include <core/renderer.h>
+#include <core/server.h>
 #define TINYEXR_IMPLEMENTATION
 #include "tinyexr.h"
 #define TINYOBJLOADER_IMPLEMENTATION
@@ -15,17 +17,19 @@
 
 
 /**
- * Load TOML scene file and create scene objects.
+ * Load the settings of a scene (TOML scene file, or render server job) into the config.
  */
-bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
-    // Scene and Wavefront OBJ files
-    const auto data = cpptoml::parse_file(inputFile);
-    config.tomlFile = inputFile;
-    const auto input = data->get_table("input");
-    config.objFile = *input->get_as<std::string>("objfile");
+bool loadConfig(TinyRender::Config& config, const cpptoml::table& data) {
+    // Wavefront OBJ file
+    const auto input = data.get_table("input");
+    if (!input) throw std::runtime_error("Missing [input] table");
+    const auto objFile = input->get_as<std::string>("objfile");
+    if (!objFile) throw std::runtime_error("Missing objfile");
+    config.objFile = *objFile;
 
     // Camera settings
-    const auto camera = data->get_table("camera");
+    const auto camera = data.get_table("camera");
+    if (!camera) throw std::runtime_error("Missing [camera] table");
     config.camera.fov = camera->get_as<double>("fov").value_or(30.);
     auto eye = camera->get_array_of<double>("eye").value_or({1., 1., 0.});
     config.camera.o = v3f(eye[0], eye[1], eye[2]);
@@ -33,14 +37,51 @@ bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
     config.camera.at = v3f(at[0], at[1], at[2]);
     auto up = camera->get_array_of<double>("up").value_or({0., 1., 0.});
     config.camera.up = v3f(up[0], up[1], up[2]);
+    string cameraType = camera->get_as<string>("type").value_or("pinhole");
+    if (cameraType == "thinlens")
+        config.camera.type = TinyRender::EThinLensCamera;
+    else if (cameraType == "orthographic")
+        config.camera.type = TinyRender::EOrthographicCamera;
+    else
+        config.camera.type = TinyRender::EPinholeCamera;
+    config.camera.apertureRadius = float(camera->get_as<double>("aperture").value_or(0.));
+    config.camera.focusDistance = float(camera->get_as<double>("focusDistance").value_or(0.));
+    config.camera.orthoHeight = float(camera->get_as<double>("size").value_or(0.));
+
+    // Camera animation: keyframes interpolated over `frames` frames, each saved to <scene>_<frame>.exr
+    config.frames = 0;
+    config.frame = -1;
+    if (const auto animation = data.get_table("animation")) {
+        if (const auto keyframes = animation->get_table_array("keyframe")) {
+            for (const auto& key : *keyframes) {
+                TinyRender::CameraKeyframe k;
+                k.frame = key->get_as<int>("frame").value_or(0);
+                k.camera = config.camera;
+                if (auto fov = key->get_as<double>("fov")) k.camera.fov = float(*fov);
+                if (auto eye = key->get_array_of<double>("eye")) k.camera.o = v3f((*eye)[0], (*eye)[1], (*eye)[2]);
+                if (auto at = key->get_array_of<double>("at")) k.camera.at = v3f((*at)[0], (*at)[1], (*at)[2]);
+                if (auto up = key->get_array_of<double>("up")) k.camera.up = v3f((*up)[0], (*up)[1], (*up)[2]);
+                if (auto aperture = key->get_as<double>("aperture")) k.camera.apertureRadius = float(*aperture);
+                if (auto focus = key->get_as<double>("focusDistance")) k.camera.focusDistance = float(*focus);
+                config.keyframes.push_back(k);
+            }
+        }
+        if (config.keyframes.empty())
+            throw std::runtime_error("Animations need at least one [[animation.keyframe]]");
+        std::sort(config.keyframes.begin(), config.keyframes.end(),
+                  [](const TinyRender::CameraKeyframe& a, const TinyRender::CameraKeyframe& b) { return a.frame < b.frame; });
+        config.frames = animation->get_as<int>("frames").value_or(config.keyframes.back().frame + 1);
+    }
 
     // Film settings
-    const auto film = data->get_table("film");
+    const auto film = data.get_table("film");
+    if (!film) throw std::runtime_error("Missing [film] table");
     config.width = film->get_as<int>("width").value_or(768);
     config.height = film->get_as<int>("height").value_or(576);
 
     // Renderer settings
-    const auto renderer = data->get_table("renderer");
+    const auto renderer = data.get_table("renderer");
+    if (!renderer) throw std::runtime_error("Missing [renderer] table");
     auto realTime = renderer->get_as<bool>("realtime").value_or(false);
     auto type = renderer->get_as<std::string>("type").value_or("normal");
 
@@ -51,6 +92,70 @@ bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
 	// Test for automated scripting
 	auto test = renderer->get_as<bool>("test").value_or(false);
 	config.test = test;
+
+    // Emitter triangle sampling
+    string triangleSampling = renderer->get_as<string>("triangleSampling").value_or("solidAngle");
+    if (triangleSampling == "area")
+        config.triangleSampling = TinyRender::ETriangleArea;
+    else if (triangleSampling == "projected")
+        config.triangleSampling = TinyRender::ETriangleProjectedSolidAngle;
+    else
+        config.triangleSampling = TinyRender::ETriangleSolidAngle;
+
+    // Texture filtering
+    string textureFilter = renderer->get_as<string>("textureFilter").value_or("trilinear");
+    if (textureFilter == "nearest")
+        config.textureFilter = TinyRender::ETextureNearest;
+    else if (textureFilter == "bilinear")
+        config.textureFilter = TinyRender::ETextureBilinear;
+    else
+        config.textureFilter = TinyRender::ETextureTrilinear;
+
+    // Pixel reconstruction filter
+    string pixelFilter = renderer->get_as<string>("filter").value_or("box");
+    if (pixelFilter == "gaussian")
+        config.pixelFilter = TinyRender::EGaussianFilter;
+    else if (pixelFilter == "mitchell")
+        config.pixelFilter = TinyRender::EMitchellFilter;
+    else if (pixelFilter == "lanczos")
+        config.pixelFilter = TinyRender::ELanczosFilter;
+    else
+        config.pixelFilter = TinyRender::EBoxFilter;
+
+    // Texture memory budget (MB) for on-demand paging, 0 to load textures upfront
+    config.textureMemory = renderer->get_as<double>("textureMemory").value_or(0.);
+
+    // Auxiliary EXR layers, e.g. aovs = ["albedo", "normal", "depth:float"] (stored as half unless ":float")
+    if (auto aovs = renderer->get_array_of<string>("aovs")) {
+        for (const string& aov : *aovs) {
+            const size_t colon = aov.find(':');
+            const string name = aov.substr(0, colon);
+            const bool half = colon == string::npos || aov.substr(colon + 1) != "float";
+            int type = 0;
+            while (type < TinyRender::EAOVs && name != TinyRender::AOVBuffer::getName(TinyRender::EAOV(type))) type++;
+            if (type == TinyRender::EAOVs)
+                throw std::runtime_error("Unknown AOV \"" + name + "\"");
+            config.aovs.emplace_back(TinyRender::EAOV(type), half);
+        }
+    }
+
+    // Checkpoints of long offline renders (seconds between checkpoints)
+    config.checkpointInterval = float(renderer->get_as<double>("checkpointInterval").value_or(0.));
+
+    // Render farm (seconds before the band of an unresponsive worker is leased again)
+    config.leaseTimeout = float(std::max(1., renderer->get_as<double>("leaseTimeout").value_or(60.)));
+
+    // Denoising of offline renders
+    config.denoise = renderer->get_as<bool>("denoise").value_or(false);
+    config.denoiseRadius = std::max(1, renderer->get_as<int>("denoiseRadius").value_or(8));
+    config.denoiseStrength = float(renderer->get_as<double>("denoiseStrength").value_or(2.0));
+
+    // Frame timings of real-time renders
+    config.profile = renderer->get_as<bool>("profile").value_or(false);
+    config.benchmarkFrames = 0;
+
+    // Vertex format of real-time renders
+    config.packNormals = renderer->get_as<bool>("packNormals").value_or(false);
 		
     // Real-time renderpass
     if (realTime) {
@@ -140,6 +245,13 @@ bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
             config.integratorSettings.pt.maxDepth = renderer->get_as<int>("maxDepth").value_or(-1);
             config.integratorSettings.pt.rrDepth = renderer->get_as<int>("rrDepth").value_or(5);
             config.integratorSettings.pt.rrProb = renderer->get_as<double>("rrProb").value_or(0.95f);
+            config.integratorSettings.pt.irradianceCache = renderer->get_as<bool>("irradianceCache").value_or(false);
+            config.integratorSettings.pt.icError = renderer->get_as<double>("icError").value_or(0.3f);
+            config.integratorSettings.pt.icSamples = renderer->get_as<int>("icSamples").value_or(256);
+            config.integratorSettings.pt.pathGuiding = renderer->get_as<bool>("pathGuiding").value_or(false);
+            config.integratorSettings.pt.guidingPasses = renderer->get_as<int>("guidingPasses").value_or(5);
+            config.integratorSettings.pt.bsdfSamplingFraction = renderer->get_as<double>("bsdfSamplingFraction").value_or(0.5f);
+            config.integratorSettings.pt.guidingFile = renderer->get_as<string>("guidingFile").value_or("");
         }
         else {
             throw std::runtime_error("Invalid integrator type");
@@ -151,10 +263,20 @@ bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
     return realTime;
 }
 
+/**
+ * Load TOML scene file and create scene objects.
+ */
+bool loadTOML(TinyRender::Config& config, const std::string& inputFile) {
+    const auto data = cpptoml::parse_file(inputFile);
+    config.tomlFile = inputFile;
+    return loadConfig(config, *data);
+}
+
 /**
  * Launch rendering job.
  */
-void run(std::string& inputTOMLFile, bool nogui) {
+void run(std::string& inputTOMLFile, bool nogui, bool resume,
+         TinyRender::EFarmRole farmRole, const std::string& farmDir, int benchmarkFrames) {
     TinyRender::Config config;
     bool isRealTime;
 
@@ -164,31 +286,92 @@ void run(std::string& inputTOMLFile, bool nogui) {
         std::cerr << "Error while parsing scene file: " << e.what() << std::endl;
         exit(EXIT_FAILURE);
     }
+    config.resume = resume;
+    config.farmRole = farmRole;
+    config.farmDir = farmDir;
+    config.benchmarkFrames = benchmarkFrames;
 
     TinyRender::Renderer renderer(config);
-    renderer.init(isRealTime, nogui);
-    renderer.render();
-    renderer.cleanUp();
+    if (isRealTime || config.frames == 0) {
+        renderer.init(isRealTime, nogui);
+        renderer.render();
+        renderer.cleanUp();
+        return;
+    }
+
+    // Animation: the scene, its BVH and the integrator are set up once, then only the camera changes
+    // (the scene refers to this config). Resuming restarts from the last frame started.
+    config.frame = 0;
+    if (!renderer.init(isRealTime, nogui)) exit(EXIT_FAILURE);
+    int first = 0;
+    if (resume) {
+        for (config.frame = 1; config.frame < config.frames; config.frame++) {
+            if (!fs::exists(TinyRender::getOutputPath(config, "exr"))) break;
+            first = config.frame;
+        }
+    }
+    const auto beginAnimation = std::chrono::steady_clock::now();
+    for (int frame = first; frame < config.frames; frame++) {
+        config.frame = frame;
+        config.camera = TinyRender::interpolateCamera(config.keyframes, frame);
+        std::cout << "Frame " << frame + 1 << "/" << config.frames << std::endl;
+        renderer.render();
+        renderer.cleanUp();
+    }
+    const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - beginAnimation;
+    std::cout << "Rendered " << config.frames - first << " frames in " << elapsed.count() << "s" << std::endl;
 }
 
 /**
  * Main TinyRender program.
  */
 int main(int argc, char* argv[]) {
-    if (argc != 2 && argc !=3) {
-        cerr << "Syntax: " << argv[0] << " <scene.toml>" << endl;
+    if (argc >= 3 && argc <= 4 && std::string(argv[1]) == "--serve") {
+        // Render server: scenes stay loaded (up to the given number) between jobs
+        const size_t cacheSize = argc == 4 ? size_t(std::max(1, std::atoi(argv[3]))) : 4;
+        TinyRender::RenderServer server(argv[2], cacheSize, loadConfig);
+        return server.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (argc < 2 || argc > 8) {
+        cerr << "Syntax: " << argv[0]
+             << " <scene.toml> [nogui] [--resume] [--coordinator <dir> | --worker <dir>] [--benchmark <frames>]"
+             << endl;
+        cerr << "        " << argv[0] << " --serve <socket> [number of resident scenes]" << endl;
         exit(EXIT_FAILURE);
     }
 
     bool nogui = false;
-    if(argc == 3) {
-        if(std::string(argv[2]) == "nogui") {
+    bool resume = false;
+    TinyRender::EFarmRole farmRole = TinyRender::EFarmNone;
+    std::string farmDir;
+    int benchmarkFrames = 0;
+    for (int i = 2; i < argc; i++) {
+        if(std::string(argv[i]) == "nogui") {
             nogui = true;
         }
+        else if(std::string(argv[i]) == "--resume") {
+            resume = true;
+        }
+        else if(std::string(argv[i]) == "--coordinator" || std::string(argv[i]) == "--worker") {
+            if (i + 1 == argc) {
+                cerr << argv[i] << " needs the directory shared by the render farm" << endl;
+                exit(EXIT_FAILURE);
+            }
+            farmRole = std::string(argv[i]) == "--worker" ? TinyRender::EFarmWorker : TinyRender::EFarmCoordinator;
+            farmDir = argv[++i];
+        }
+        else if(std::string(argv[i]) == "--benchmark") {
+            if (i + 1 == argc || std::atoi(argv[i + 1]) <= 0) {
+                cerr << "--benchmark needs the number of frames to render" << endl;
+                exit(EXIT_FAILURE);
+            }
+            benchmarkFrames = std::atoi(argv[++i]);
+        }
     }
 
     auto inputTOMLFile = std::string(argv[1]);
-    run(inputTOMLFile, nogui);
+    run(inputTOMLFile, nogui, resume, farmRole, farmDir, benchmarkFrames);
 
 #ifdef _WIN32
     if(!nogui) system("pause");
@@ -7,6 +7,12 @@
 
 #pragma once
 
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <core/core.h>
 #include "core/renderpass.h"
 #include "tiny_obj_loader.h"
@@ -16,6 +22,10 @@ TR_NAMESPACE_BEGIN
 
 /**
  * Global Illumination baking renderpass.
+ * The radiance leaving each (welded) vertex is estimated with the path tracer and drawn as vertex colors.
+ * The bake runs in the background over the thread pool, in passes of 1, 2, 4, ... samples per vertex:
+ * the window shows the current estimate, refined after each pass. The sums are cached next to the scene
+ * file after each pass, so later runs resume the bake (or skip it) instead of starting over.
  */
 struct GIPass : RenderPass {
     GLuint shader{0};
@@ -24,34 +34,24 @@ struct GIPass : RenderPass {
     GLuint viewMatUniform{0};
     GLuint projectionMatUniform{0};
 
+    // Vertex colors, read as the second attribute of the geometry VAO
+    GLuint colorVBO{0};
+    GLuint colorAttrib{1};
+
     int m_samplePerVertex;
 
     std::unique_ptr<PathTracerIntegrator> m_ptIntegrator;
 
     explicit GIPass(const Scene& scene) : RenderPass(scene) {
         m_ptIntegrator = std::unique_ptr<PathTracerIntegrator>(new PathTracerIntegrator(scene));
+        m_ptIntegrator->m_isExplicit = true;
         m_ptIntegrator->m_maxDepth = scene.config.integratorSettings.gi.maxDepth;
         m_ptIntegrator->m_rrProb = scene.config.integratorSettings.gi.rrProb;
         m_ptIntegrator->m_rrDepth = scene.config.integratorSettings.gi.rrDepth;
         m_samplePerVertex = scene.config.integratorSettings.gi.samplesByVertex;
     }
 
-    virtual void buildVBO(size_t objectIdx) override {
-        GLObject& obj = objects[objectIdx];
-
-        // TODO(A5): Implement this
-
-        // VBO
-        glGenVertexArrays(1, &obj.vao);
-        glBindVertexArray(obj.vao);
-
-        glGenBuffers(1, &obj.vbo);
-        glBindBuffer(GL_ARRAY_BUFFER, obj.vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     sizeof(GLfloat) * obj.nVerts * N_ATTR_PER_VERT,
-                     (GLvoid*) (&obj.vertices[0]),
-                     GL_STATIC_DRAW);
-    }
+    ~GIPass() override { stopBake(); }
 
     bool init(const Config& config) override {
         RenderPass::init(config);
@@ -68,37 +68,260 @@ struct GIPass : RenderPass {
         viewMatUniform = GLuint(glGetUniformLocation(shader, "view"));
         projectionMatUniform = GLuint(glGetUniformLocation(shader, "projection"));
 
-        // Create vertex buffers
-        objects.resize(scene.worldData.shapes.size());
-        for (size_t i = 0; i < objects.size(); i++) {
-            buildVBO(i);
-            buildVAO(i);
+        // Create vertex buffers: the colors replace the normals
+        m_vertices = buildGeometry();
+        glBindVertexArray(geometryVAO);
+        glGenBuffers(1, &colorVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(v3f) * m_vertices.size(), nullptr, GL_DYNAMIC_DRAW);
+        glVertexAttribPointer(colorAttrib, 3, GL_FLOAT, GL_FALSE, sizeof(v3f), (GLvoid*) 0);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // Resume from the cached bake, and refine it in the background
+        m_sums.assign(m_vertices.size(), v3f(0.f));
+        m_colors.assign(m_vertices.size(), v3f(0.f));
+        m_cacheFile = getOutputPath(config, "gibake");
+        m_cacheKey = getCacheKey(config);
+        if (loadCache()) {
+            std::cout << "GI bake: loaded " << m_samples << " samples per vertex from " << m_cacheFile << std::endl;
+            publish();
         }
+        m_stop = false;
+        m_bakeThread = std::thread(&GIPass::bake, this);
 
         return true;
     }
 
     void cleanUp() override {
-        // Delete vertex buffers
-        for (size_t i = 0; i < objects.size(); i++) {
-            glDeleteBuffers(1, &objects[i].vbo);
-            glDeleteVertexArrays(1, &objects[i].vao);
-        }
+        stopBake();
+        glDeleteBuffers(1, &colorVBO);
+        glDeleteProgram(shader);
 
         RenderPass::cleanUp();
     }
 
     void render() override {
+        // Single images (nogui, benchmarks) show the finished bake
+        if (!interactive && m_bakeThread.joinable()) m_bakeThread.join();
+        uploadColors();
+
+        profiler.beginStage("Geometry");
         glBindFramebuffer(GL_FRAMEBUFFER, postprocess_fboScreen);
         glClearColor(0.f, 0.f, 0.f, 1.f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glEnable(GL_DEPTH_TEST);
 
-        // TODO(A5): Implement this
+        glUseProgram(shader);
+
+        // Update camera
+        glm::mat4 model, view, projection;
+        camera.Update();
+        camera.GetMatricies(projection, view, model);
+
+        glUniformMatrix4fv(modelMatUniform, 1, GL_FALSE, &(modelMat[0][0]));
+        glUniformMatrix4fv(viewMatUniform, 1, GL_FALSE, &(view[0][0]));
+        glUniformMatrix4fv(projectionMatUniform, 1, GL_FALSE, &(projection[0][0]));
+
+        glBindVertexArray(geometryVAO);
+        drawObjects(0, objects.size());
+        glBindVertexArray(0);
+        profiler.endStage();
 
         RenderPass::render();
     }
 
+private:
+    static const int BlockSize = 256;
+
+    /* Welded vertices, sums of their radiance samples and number of samples per vertex */
+    std::vector<tinyobj::index_t> m_vertices;
+    std::vector<v3f> m_sums;
+    int m_samples = 0;
+
+    /* Current estimate, handed from the bake thread to the GL thread */
+    std::mutex m_colorMutex;
+    std::vector<v3f> m_colors;
+    std::atomic<bool> m_colorsUpdated{false};
+    std::atomic<bool> m_done{false};
+
+    std::thread m_bakeThread;
+    std::atomic<bool> m_stop{false};
+
+    std::string m_cacheFile;
+    uint64_t m_cacheKey = 0;
+
+    /**
+     * Bakes passes of doubling sample counts until each vertex has `samplesByVertex` samples.
+     * Samplers are seeded by pass and block of vertices, so the result doesn't depend on the thread count.
+     */
+    void bake() {
+        std::vector<v3f> origins, directions;
+        buildVertexRays(origins, directions);
+        const int nbBlocks = int((m_vertices.size() + BlockSize - 1) / BlockSize);
+        const auto begin = std::chrono::steady_clock::now();
+
+        while (m_samples < m_samplePerVertex && !m_stop) {
+            const int samples = std::min(std::max(m_samples, 1), m_samplePerVertex - m_samples);
+            std::vector<v3f> sums(m_sums);
+            ThreadPool::ParallelFor(0, nbBlocks, [&](int block) {
+                Sampler sampler(m_samples * nbBlocks + block);
+                const size_t end = std::min(m_vertices.size(), size_t(block + 1) * BlockSize);
+                for (size_t i = size_t(block) * BlockSize; i < end && !m_stop; i++) {
+                    const Ray ray(origins[i], directions[i]);
+                    for (int s = 0; s < samples; s++) sums[i] += m_ptIntegrator->render(ray, sampler);
+                }
+            });
+            if (m_stop) break; // Partial pass: dropped
+
+            m_sums.swap(sums);
+            m_samples += samples;
+            // Before publishing: the frame uploading the final colors saves the image again
+            if (m_samples >= m_samplePerVertex) m_done = true;
+            publish();
+            saveCache();
+            const std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - begin;
+            std::cout << "GI bake: " << m_samples << "/" << m_samplePerVertex << " samples per vertex ("
+                      << elapsed.count() << "s)" << std::endl;
+        }
+        if (!m_stop) m_done = true;
+    }
+
+    /**
+     * Rays hitting each vertex against its normal, whose radiance is the one leaving the vertex along the normal
+     * (view independent for diffuse surfaces). A ray through the vertex itself lies on the edges of its triangles
+     * and can slip between them: it aims slightly inside one of the triangles instead.
+     */
+    void buildVertexRays(std::vector<v3f>& origins, std::vector<v3f>& directions) const {
+        const auto& sa = scene.worldData.attrib;
+        const float offset = 2e-3f; // The BVH ignores hits closer than 1e-3
+        auto key = [](const tinyobj::index_t& idx) {
+            return (uint64_t(uint32_t(idx.vertex_index)) << 32) | uint32_t(idx.normal_index);
+        };
+        auto position = [&](const tinyobj::index_t& idx) {
+            return v3f(sa.vertices[3 * idx.vertex_index + 0], sa.vertices[3 * idx.vertex_index + 1],
+                       sa.vertices[3 * idx.vertex_index + 2]);
+        };
+
+        std::unordered_map<uint64_t, size_t> welded;
+        for (size_t i = 0; i < m_vertices.size(); i++) welded.emplace(key(m_vertices[i]), i);
+
+        origins.assign(m_vertices.size(), v3f(0.f));
+        directions.assign(m_vertices.size(), v3f(0.f));
+        for (const tinyobj::shape_t& shape : scene.worldData.shapes) {
+            const auto& indices = shape.mesh.indices;
+            for (size_t f = 0; f + 2 < indices.size(); f += 3) {
+                const v3f centroid = (position(indices[f]) + position(indices[f + 1]) + position(indices[f + 2])) / 3.f;
+                for (size_t c = f; c < f + 3; c++) {
+                    const size_t i = welded[key(indices[c])];
+                    if (directions[i] != v3f(0.f)) continue;
+                    const v3f n = glm::normalize(v3f(sa.normals[3 * indices[c].normal_index + 0],
+                                                     sa.normals[3 * indices[c].normal_index + 1],
+                                                     sa.normals[3 * indices[c].normal_index + 2]));
+                    const v3f p = position(indices[c]);
+                    origins[i] = p + 0.01f * (centroid - p) + offset * n;
+                    directions[i] = -n;
+                }
+            }
+        }
+    }
+
+    void stopBake() {
+        m_stop = true;
+        if (m_bakeThread.joinable()) m_bakeThread.join();
+    }
+
+    /// Averages the sums into the colors shown by the next frame
+    void publish() {
+        std::lock_guard<std::mutex> lock(m_colorMutex);
+        for (size_t i = 0; i < m_sums.size(); i++) m_colors[i] = m_sums[i] / float(std::max(m_samples, 1));
+        m_colorsUpdated = true;
+    }
+
+    void uploadColors() {
+        if (!m_colorsUpdated.exchange(false)) return;
+        {
+            std::lock_guard<std::mutex> lock(m_colorMutex);
+            glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(v3f) * m_colors.size(), m_colors.data());
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        // Save the image again once the bake is finished
+        if (m_done) isSaved = false;
+    }
+
+    /**
+     * Cache key: scene files (path, size and modification time of the obj, its mtl libraries and the toml),
+     * vertex count and path tracer settings.
+     * The sample count isn't part of it: raising `samplesByVertex` refines the cached bake.
+     */
+    uint64_t getCacheKey(const Config& config) const {
+        fs::path obj(config.objFile);
+        if (!obj.is_absolute()) obj = (config.tomlFile.parent_path() / obj).make_preferred();
+        std::ostringstream key;
+        auto addFile = [&key](const fs::path& file) {
+            key << fs::absolute(file).string() << "|";
+            if (fs::exists(file)) key << fs::file_size(file) << "|" << getWriteTime(file) << "|";
+        };
+        addFile(obj);
+        addFile(config.tomlFile);
+        // Materials (albedo, emission) are read from the mtl libraries of the obj
+        std::ifstream in(obj.string());
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream tokens(line);
+            std::string keyword, library;
+            if (tokens >> keyword && keyword == "mtllib")
+                while (tokens >> library) addFile(obj.parent_path() / library);
+        }
+        key << m_vertices.size() << "|" << m_ptIntegrator->m_maxDepth << "|" << m_ptIntegrator->m_rrDepth << "|"
+            << m_ptIntegrator->m_rrProb;
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : key.str()) hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+        return hash;
+    }
+
+    bool loadCache() {
+        std::ifstream in(m_cacheFile, std::ios::binary);
+        uint32_t magic = 0;
+        uint64_t key = 0, count = 0;
+        int32_t samples = 0;
+        in.read((char*) &magic, sizeof(magic));
+        in.read((char*) &key, sizeof(key));
+        in.read((char*) &count, sizeof(count));
+        in.read((char*) &samples, sizeof(samples));
+        if (!in || magic != 0x49475254 || key != m_cacheKey || count != m_sums.size()) return false;
+        in.read((char*) m_sums.data(), sizeof(v3f) * m_sums.size());
+        if (!in) {
+            m_sums.assign(m_sums.size(), v3f(0.f));
+            return false;
+        }
+        m_samples = samples;
+        return true;
+    }
+
+    /// Written to a temporary file, then renamed, so that quitting during a save keeps the previous cache
+    void saveCache() const {
+        const std::string tmp = m_cacheFile + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::binary);
+            const uint32_t magic = 0x49475254; // "TRGI"
+            const uint64_t count = m_sums.size();
+            const int32_t samples = m_samples;
+            out.write((const char*) &magic, sizeof(magic));
+            out.write((const char*) &m_cacheKey, sizeof(m_cacheKey));
+            out.write((const char*) &count, sizeof(count));
+            out.write((const char*) &samples, sizeof(samples));
+            out.write((const char*) m_sums.data(), sizeof(v3f) * m_sums.size());
+            if (!out) {
+                std::cerr << "Could not write " << tmp << std::endl;
+                return;
+            }
+        }
+        std::remove(m_cacheFile.c_str()); // For renames that don't replace existing files
+        std::rename(tmp.c_str(), m_cacheFile.c_str());
+    }
 };
 
 TR_NAMESPACE_END
@@ -42,26 +42,17 @@ struct NormalPass : RenderPass {
         normalMatUniform = GLuint(glGetUniformLocation(shader, "normalMat"));
 
         // Create vertex buffers
-        objects.resize(scene.worldData.shapes.size());
-        for (size_t i = 0; i < objects.size(); i++) {
-            buildVBO(i);
-            buildVAO(i);
-        }
+        buildGeometry();
 
         return true;
     }
 
     void cleanUp() override {
-        // Delete vertex buffers
-        for (size_t i = 0; i < objects.size(); i++) {
-            glDeleteBuffers(1, &objects[i].vbo);
-            glDeleteVertexArrays(1, &objects[i].vao);
-        }
-
         RenderPass::cleanUp();
     }
 
     void render() override {
+        profiler.beginStage("Geometry");
         glBindFramebuffer(GL_FRAMEBUFFER, postprocess_fboScreen);
         glClearColor(0.f, 0.f, 0.f, 1.f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -81,22 +72,11 @@ struct NormalPass : RenderPass {
         glUniformMatrix4fv(projectionMatUniform, 1, GL_FALSE, &(projection[0][0]));
         glUniformMatrix4fv(normalMatUniform, 1, GL_FALSE, &(normalMat[0][0]));
 
-        // Draw
-        for (auto& object : objects) {
-            /**
-             * 1) Bind vertex array of current object.
-             * 2) Draw its triangles.
-             * 3) Bind vertex array to 0.
-             */
-            // TODO(A1): Implement this
-
-            // A Vertex Array Object allows us to define the memory layout of the attributes in the VBO.
-            // One VBO is assigned to each VAO.
-
-            glBindVertexArray( object.vao );
-            glDrawArrays( GL_TRIANGLES,0, object.nVerts );
-            glBindVertexArray(0);
-        }
+        // Draw all objects at once (one shader, no per-object uniforms)
+        glBindVertexArray(geometryVAO);
+        drawObjects(0, objects.size());
+        glBindVertexArray(0);
+        profiler.endStage();
 
         // save pixel
         RenderPass::render();
@@ -7,7 +7,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include "core/renderpass.h"
+#include "core/sensor.h"
 #include "tiny_obj_loader.h"
 
 TR_NAMESPACE_BEGIN
@@ -15,14 +19,12 @@ TR_NAMESPACE_BEGIN
 /**
  * Analytic polygonal light source renderpass.
  * Based on the normal shading renderpass
+ * Ray-traced shadows (the control variate term) are accumulated in the background over the thread pool,
+ * one sample per pixel per pass, while the camera is still. Bands of rows are uploaded as they are finished.
  */
 struct PolygonalPass : RenderPass {
     GLuint diffuseShader{0};
     GLuint emitterShader{0};
-    GLuint modelMatUniform{0};
-    GLuint viewMatUniform{0};
-    GLuint projectionMatUniform{0};
-    GLuint normalMatUniform{0};
     bool firstPass = true;
 
 
@@ -32,7 +34,7 @@ struct PolygonalPass : RenderPass {
     std::vector<float> emitterVertexData; // Each point of each vertex is a float
     // Layout should be [ t1.v1.x t1.v1.y t1.v1.z t1.v2.x t1.v2.y t1.v2.z t1.v3.x t1.v3.y t1.v3.z t2.v1.x .... ]
 
-    // Uniforms
+    // Uniforms of the diffuse shader (the matrices and light are per-frame uniforms, see FrameUniforms)
     GLuint emitterVerticesUniform{0};
     GLuint windowSizeUniform{0}; // Needed for texture mapping of CV term
     GLuint lightIrradianceUniform{0};
@@ -45,12 +47,8 @@ struct PolygonalPass : RenderPass {
     // Make sure MAX_NUM_EMITTER_TRIANGLES matches the value in polygonal.fs
     int const maxNbVertices = MAX_NUM_EMITTER_TRIANGLES * 3 * 3;
 
-    // Emitter and sampler
+    // Emitter
     Emitter emitter;
-    Sampler* sampler = nullptr;
-
-    // Color the emitter properly
-    GLuint lightIntensityUniform;
 
     // Storage for CV term
     std::vector<float> cvTermData;
@@ -58,10 +56,11 @@ struct PolygonalPass : RenderPass {
     size_t numDataValues;
 
     // Used for computing CV term
-    int samplesAccumulated = 0; // Used for moving average of CV term
+    std::atomic<int> samplesAccumulated{0}; // Used for moving average of CV term
     std::unique_ptr<PolygonalIntegrator> polygonalIntegrator;
 
     explicit PolygonalPass(const Scene& scene) : RenderPass(scene) {}
+    ~PolygonalPass() override { stopShadows(); }
 
     /// Initialize renderpass
     bool init(const Config& config) override {
@@ -85,6 +84,12 @@ struct PolygonalPass : RenderPass {
         shaders[EMITTER_SHADER_IDX] = emitterShader;
         shaders[PHONG_SHADER_IDX] = -1; // Should not be any Phong surfaces, unless bonus
 
+        // Locate uniforms once
+        emitterVerticesUniform = GLuint(glGetUniformLocation(diffuseShader, "emitterVertices"));
+        nbTrianglesUniform = GLuint(glGetUniformLocation(diffuseShader, "nbTriangles"));
+        lightIrradianceUniform = GLuint(glGetUniformLocation(diffuseShader, "lightIrradiance"));
+        windowSizeUniform = GLuint(glGetUniformLocation(diffuseShader, "windowSize"));
+
         // Initialize the polygonal integrator which will be used for computing CV term
         polygonalIntegrator = std::unique_ptr<PolygonalIntegrator>(new PolygonalIntegrator(scene));
         polygonalIntegrator->m_alpha = scene.config.integratorSettings.poly.alpha;
@@ -98,8 +103,11 @@ struct PolygonalPass : RenderPass {
         glGenTextures(1, &cvTermTexture);
         clearShadows();
 
+        // Shadows are computed with the scene's light (samplers are created per band, see accumulateShadows)
+        if (scene.emitters.empty()) throw std::runtime_error("Polygonal renderpass: no emitter in the scene");
+        emitter = scene.emitters[0];
+
         /**
-         * 1) Retrieve and assign `emitter`; create new `sampler` (seeded by your student ID)
          * 2) Compute # of triangles on emitter and set `nbTriangles` and `nbVertices`
          * 3) Compute and set `lightIrradiance`
          * 4) Loop over each vertex and store xyz-components to `emitterVertexdata`
@@ -108,37 +116,32 @@ struct PolygonalPass : RenderPass {
         // TODO(A4): Implement this
 
         // Create vertex buffers
+        buildGeometry();
         const auto& shapes = scene.worldData.shapes;
-        objects.resize(shapes.size());
-        for (size_t i = 0; i < objects.size(); i++) {
-            buildVBO(i);
-            buildVAO(i);
+        for (size_t i = 0; i < objects.size(); i++)
             assignShader(objects[i], shapes[i], scene.bsdfs);
-        }
+        sortObjectsByShader();
         return true;
     }
 
     /// Clean up after renderpass (deleter vertex buffers, etc.)
     void cleanUp() override {
-        for (auto& object : objects) {
-            glDeleteBuffers(1, &object.vbo);
-            glDeleteVertexArrays(1, &object.vao);
-        }
+        stopShadows();
+        glDeleteTextures(1, &cvTermTexture);
         RenderPass::cleanUp();
-        delete sampler;
     }
 
     /// Event handler for shadows; clear on camera moved or draw on space bar pressed
     void handleEvents(SDL_Event& e) override {
-        /**
-         * 1) Check if camera moved using `RenderPass::updateCamera(e)`: if so, _clear_ shadows
-         * 2) Check if space bar was pressed: if so, _add_ shadows
-         */
-        // TODO(A4): Implement this
+        if (RenderPass::updateCamera(e)) clearShadows();
+        else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_SPACE) addShadows();
     }
 
     /// Remove shadows; called when the camera moves
     void clearShadows() {
+        stopShadows();
+        std::lock_guard<std::mutex> lock(m_shadowMutex);
+        m_finishedBands.clear();
         cvTermData.clear();
         cvTermData.assign(numDataValues, 0.f);
         samplesAccumulated = 0;
@@ -150,20 +153,10 @@ struct PolygonalPass : RenderPass {
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     }
 
-    /// Superpose ray-traced shadows on top of analytic diffuse shading
+    /// Superpose ray-traced shadows on top of analytic diffuse shading, from now on while the camera is still
     void addShadows() {
-        /**
-         * 1) Loop over pixels: height first _then_ width (order matters here!)
-         * 2) Trace ray through each pixel, just like A1
-         *    Note: Use _current_ camera settings (e.g. `camera.camera_look_at`)
-         * 3) Call `polygonalIntegrator->estimateVisibilityDiffHelper()` to estimate difference D = h - alpha*g / pdf
-         * 4) For each pixel, update entries of the vector `cvTermData` (e.g. `cvTermData[idx] = val`)
-         *    Note: Make sure to compute _moving average_ for each element using `samplesAccumulated`
-         *          Textures can only store positive values (and D < 0 always), so take -D
-         * 5) After loop, increment `samplesAccumulated`
-         * 6) Bind texture object and fill buffer with data from `cvTermData` (see `clearShadows()` for example)
-         */
-        // TODO(A4): Implement this
+        m_addShadows = true;
+        if (!m_shadowThread.joinable()) startShadows();
     }
 
     /// Main rendering routine
@@ -174,54 +167,144 @@ struct PolygonalPass : RenderPass {
             addShadows();
             firstPass = false;
         }
+        // Single images wait for their pass of shadows
+        if (!interactive && m_shadowThread.joinable()) m_shadowThread.join();
 
         // Standard real-time render
+        profiler.beginStage("Geometry");
         glBindFramebuffer(GL_FRAMEBUFFER, postprocess_fboScreen);
         glClearColor(0.f, 0.f, 0.f, 1.f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glEnable(GL_DEPTH_TEST);
 
-        // Update camera
+        // Update camera and per-frame uniforms
         glm::mat4 model, view, projection;
         camera.Update();
         camera.GetMatricies(projection, view, model);
+        updateFrameUniforms(view, projection);
+        updateShadows();
 
-        // Draw objects
+        // Draw objects, sorted by shader
+        glBindVertexArray(geometryVAO);
+        GLuint currentShader = 0;
         for (auto& object : objects) {
             // Define shader to use
-            glUseProgram(object.shaderID);
-            glActiveTexture(GL_TEXTURE0); // Required!
-            glBindTexture(GL_TEXTURE_2D, cvTermTexture); // Need to bind texture after setting shader
-
-            // Update camera
-            camera.Update();
-            camera.GetMatricies(projection, view, model);
-
-            // Create uniforms
-            modelMatUniform = GLuint(glGetUniformLocation(object.shaderID, "model"));
-            viewMatUniform = GLuint(glGetUniformLocation(object.shaderID, "view"));
-            projectionMatUniform = GLuint(glGetUniformLocation(object.shaderID, "projection"));
-            normalMatUniform = GLuint(glGetUniformLocation(object.shaderID, "normalMat"));
-
-            // Pass common Uniforms
-            glUniformMatrix4fv(modelMatUniform, 1, GL_FALSE, &(modelMat[0][0]));
-            glUniformMatrix4fv(viewMatUniform, 1, GL_FALSE, &(view[0][0]));
-            glUniformMatrix4fv(projectionMatUniform, 1, GL_FALSE, &(projection[0][0]));
-            glUniformMatrix4fv(normalMatUniform, 1, GL_FALSE, &(normalMat[0][0]));
+            if (object.shaderID != currentShader) {
+                glUseProgram(object.shaderID);
+                glActiveTexture(GL_TEXTURE0); // Required!
+                glBindTexture(GL_TEXTURE_2D, cvTermTexture); // Need to bind texture after setting shader
+                currentShader = object.shaderID;
+            }
 
             /**
              * 1) Check if object is emitter or diffuse (no Phong, unless bonus)
-             * 2) Bind correct uniforms for each shader
+             * 2) Bind correct uniforms for each shader (locations found in init and assignShader)
             */
             // TODO(A4): Implement this
 
-            // Bind VAO, draw and bind to zero
-            glBindVertexArray(object.vao);
-            glDrawArrays(GL_TRIANGLES, 0, object.nVerts);
-            glBindVertexArray(0);
+            // Draw
+            drawObject(object);
         }
+        glBindVertexArray(0);
+        profiler.endStage();
         RenderPass::render();
     }
+
+private:
+    static const int BandSize = 16;
+    /* Shadow passes accumulated before stopping */
+    static const int MaxShadowPasses = 256;
+
+    /* Whether shadows were requested, so that they are accumulated again once the camera stops moving */
+    bool m_addShadows = false;
+    /* Camera whose shadows are accumulated */
+    glm::vec3 m_shadowEye, m_shadowAt;
+    static constexpr float StillTolerance = 1e-3f;
+
+    std::thread m_shadowThread;
+    std::atomic<bool> m_stopShadows{false};
+    /* Guards `cvTermData` and the bands finished since the last upload */
+    std::mutex m_shadowMutex;
+    std::vector<int> m_finishedBands;
+
+    void startShadows() {
+        Config view = scene.config;
+        view.camera.type = EPinholeCamera;
+        view.camera.o = m_shadowEye = camera.camera_position;
+        view.camera.at = m_shadowAt = camera.camera_look_at;
+        view.camera.up = camera.camera_up;
+        m_stopShadows = false;
+        m_shadowThread = std::thread(&PolygonalPass::accumulateShadows, this, Sensor(view));
+    }
+
+    void stopShadows() {
+        m_stopShadows = true;
+        if (m_shadowThread.joinable()) m_shadowThread.join();
+    }
+
+    /**
+     * Accumulates passes of one ray per pixel, until stopped (one pass for single images).
+     * Samplers are seeded by pass and band of rows, so the result doesn't depend on the thread count.
+     */
+    void accumulateShadows(const Sensor sensor) {
+        const int width = scene.config.width, height = scene.config.height;
+        const int nbBands = (height + BandSize - 1) / BandSize;
+
+        while (!m_stopShadows && samplesAccumulated < (interactive ? MaxShadowPasses : 1)) {
+            const int n = samplesAccumulated;
+            ThreadPool::ParallelFor(0, nbBands, [&](int band) {
+                Sampler sampler(n * nbBands + band);
+                const int begin = band * BandSize, end = std::min(height, begin + BandSize);
+                std::vector<v3f> D(size_t(width) * (end - begin));
+                // Texture rows go up the image, raster rows go down
+                for (int y = begin; y < end && !m_stopShadows; y++)
+                    for (int x = 0; x < width; x++) {
+                        const Ray ray = sensor.generateRay(x + .5f, height - 1 - y + .5f, 0.f, 0.f, 1.f);
+                        D[size_t(y - begin) * width + x] =
+                            polygonalIntegrator->estimateVisDiffRealTime(ray, sampler, emitter);
+                    }
+                if (m_stopShadows) return;
+
+                // Moving average of -D (textures store positive values, and D < 0)
+                std::lock_guard<std::mutex> lock(m_shadowMutex);
+                float* cv = &cvTermData[size_t(begin) * width * 3];
+                for (size_t i = 0; i < D.size(); i++)
+                    for (int c = 0; c < 3; c++) cv[3 * i + c] = (cv[3 * i + c] * n - D[i][c]) / (n + 1);
+                m_finishedBands.push_back(band);
+            });
+            if (m_stopShadows) break;
+            samplesAccumulated++;
+        }
+    }
+
+    /**
+     * Uploads the finished bands, and restarts the accumulation when the camera has moved since it started
+     * and is still again. The camera keeps drifting after a key press or a mouse move (its velocity decays
+     * by 2% per frame, its rotation by half): it is still once all of its remaining motion is within
+     * `StillTolerance` (about a pixel at unit distance).
+     */
+    void updateShadows() {
+        if (m_addShadows) {
+            auto moved = [](const glm::vec3& a, const glm::vec3& b) { return glm::distance(a, b) > StillTolerance; };
+            const float drift = 50.f * glm::length(camera.camera_position_delta) +
+                                2.f * (std::abs(camera.camera_heading) + std::abs(camera.camera_pitch));
+            if (m_shadowThread.joinable() &&
+                (moved(camera.camera_position, m_shadowEye) || moved(camera.camera_look_at, m_shadowAt)))
+                clearShadows();
+            if (!m_shadowThread.joinable() && drift < StillTolerance) startShadows();
+        }
+
+        std::lock_guard<std::mutex> lock(m_shadowMutex);
+        if (m_finishedBands.empty()) return;
+        const int width = scene.config.width, height = scene.config.height;
+        glBindTexture(GL_TEXTURE_2D, cvTermTexture);
+        for (int band : m_finishedBands) {
+            const int begin = band * BandSize, rows = std::min(height, begin + BandSize) - begin;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, begin, width, rows, GL_RGB, GL_FLOAT,
+                            &cvTermData[size_t(begin) * width * 3]);
+        }
+        m_finishedBands.clear();
+    }
 };
 
 TR_NAMESPACE_END
\ No newline at end of file
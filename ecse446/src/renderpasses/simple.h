@@ -33,102 +33,61 @@ struct SimplePass : RenderPass {
         }
 
         // Create vertex buffers
+        buildGeometry();
         const auto& shapes = scene.worldData.shapes;
-        objects.resize(shapes.size());
-        for (size_t i = 0; i < objects.size(); i++) {
-            buildVBO(i);
-            buildVAO(i);
+        for (size_t i = 0; i < objects.size(); i++)
             assignShader(objects[i], shapes[i], scene.bsdfs);
-        }
+        sortObjectsByShader();
 
         return true;
     }
 
     virtual void cleanUp() override {
-        // Delete vertex buffers
-        for (size_t i = 0; i < objects.size(); i++) {
-            glDeleteBuffers(1, &objects[i].vbo);
-            glDeleteVertexArrays(1, &objects[i].vao);
-        }
-
         RenderPass::cleanUp();
     }
 
     virtual void render() override {
+        profiler.beginStage("Geometry");
         glBindFramebuffer(GL_FRAMEBUFFER, postprocess_fboScreen);
         glClearColor(0.f, 0.f, 0.f, 1.f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glEnable(GL_DEPTH_TEST);
 
-        // Update camera
+        // Update camera and per-frame uniforms
         glm::mat4 model, view, projection;
         camera.Update();
         camera.GetMatricies(projection, view, model);
+        updateFrameUniforms(view, projection);
 
 		// You can use scene.config.bonus as a boolean to enable/disable shadows if you choose to do the bonus for A2
 
-        for (size_t i = 0; i < objects.size(); i++) {
-            GLObject obj = objects[i];
-
+        // Objects are sorted by shader
+        glBindVertexArray(geometryVAO);
+        GLuint currentShader = 0;
+        for (const GLObject& obj : objects) {
             // Define shader to use
-            glUseProgram(obj.shaderID);
-
-            // Pass uniforms
-            GLuint modelMatUniform = GLuint(glGetUniformLocation(obj.shaderID, "model"));
-            GLuint viewMatUniform = GLuint(glGetUniformLocation(obj.shaderID, "view"));
-            GLuint projectionMatUniform = GLuint(glGetUniformLocation(obj.shaderID, "projection"));
-            GLuint normalMatUniform = GLuint(glGetUniformLocation(obj.shaderID, "normalMat"));
-            glUniformMatrix4fv(modelMatUniform, 1, GL_FALSE, &(modelMat[0][0]));
-            glUniformMatrix4fv(viewMatUniform, 1, GL_FALSE, &(view[0][0]));
-            glUniformMatrix4fv(projectionMatUniform, 1, GL_FALSE, &(projection[0][0]));
-            glUniformMatrix4fv(normalMatUniform, 1, GL_FALSE, &(normalMat[0][0]));
-
-            GLuint camPosUniform = GLuint(glGetUniformLocation(obj.shaderID, "camPos"));
-            glUniform3f(camPosUniform, camera.camera_position.x, camera.camera_position.y, camera.camera_position.z);
-
-            // Pass light position & power via uniforms
-            //   this->lightPos
-            //   this->lightIntensity
-            // TODO(A2): Implement this
-            GLuint lightPosition = GLuint(glGetUniformLocation(obj.shaderID, "lightPos"));
-            GLuint lightIntens = GLuint(glGetUniformLocation(obj.shaderID, "lightIntensity"));
-
-            glUniform3f(lightPosition, this->lightPos.x, this->lightPos.y, this->lightPos.z);
-            glUniform3f(lightIntens, this->lightIntensity.x, this->lightIntensity.y, this->lightIntensity.z);
-
-            // Pass shader-specific parameters via uniforms
-            //   obj.albedo
-            //   obj.rho_d
-            //   obj.rho_s
-            //   obj.exponent
-            // TODO(A2): Implement this
-            GLuint albPos = GLuint(glGetUniformLocation(obj.shaderID, "albedo"));
-            GLuint rho_dPos = GLuint(glGetUniformLocation(obj.shaderID, "rho_d"));
-            GLuint rho_sPos = GLuint(glGetUniformLocation(obj.shaderID, "rho_s"));
-            GLuint expPos = GLuint(glGetUniformLocation(obj.shaderID, "exponent"));
+            if (obj.shaderID != currentShader) {
+                glUseProgram(obj.shaderID);
+                currentShader = obj.shaderID;
+            }
 
+            // Pass shader-specific parameters via uniforms (locations found in assignShader)
             if (obj.shaderIdx == DIFFUSE_SHADER_IDX)
             {
-                glUniform3f(albPos, obj.albedo.x, obj.albedo.y, obj.albedo.z);
+                glUniform3f(obj.albedoUniform, obj.albedo.x, obj.albedo.y, obj.albedo.z);
             }
             else if (obj.shaderIdx == PHONG_SHADER_IDX)
             {
-                glUniform3f(rho_dPos, obj.rho_d.x, obj.rho_d.y, obj.rho_d.z);
-                glUniform3f(rho_sPos, obj.rho_s.x, obj.rho_s.y, obj.rho_s.z);
-                glUniform1f(expPos, obj.exponent);
+                glUniform3f(obj.rho_d_Uniform, obj.rho_d.x, obj.rho_d.y, obj.rho_d.z);
+                glUniform3f(obj.rho_s_Uniform, obj.rho_s.x, obj.rho_s.y, obj.rho_s.z);
+                glUniform1f(obj.exponentUniform, obj.exponent);
             }
 
             // Draw
-            /**
-             * 1) Bind vertex array of current object.
-             * 2) Draw its triangles.
-             * 3) Bind vertex array to 0.
-             */
-            // TODO(A2): Implement this
-            glBindVertexArray( obj.vao );
-            glDrawArrays( GL_TRIANGLES,0, obj.nVerts );
-            glBindVertexArray(0);
+            drawObject(obj);
         }
+        glBindVertexArray(0);
+        profiler.endStage();
 
         RenderPass::render();
     }
@@ -87,14 +87,7 @@ TR_NAMESPACE_BEGIN
             //        glBindBuffer(GL_ARRAY_BUFFER, 0);
 
             // Create vertex buffers
-            const auto& shapes = scene.worldData.shapes;
-            objects.resize(shapes.size());
-            for (size_t i = 0; i < shapes.size(); i++) {
-                const tinyobj::shape_t& s = shapes[i];
-                GLObject& obj = objects[i];
-                buildVBO(i);
-                buildVAO(i);
-            }
+            buildGeometry();
 
             // 3. Create shader to build GBuffer
             //     3.1 geometry.vs----Unprojected M,V transformed Position and Normal
@@ -213,13 +206,6 @@ TR_NAMESPACE_BEGIN
             glDeleteVertexArrays(1, &quadVAO);
             glDeleteProgram(shaderSSAO);
 
-            // Delete vertex buffers
-            for (size_t i = 0; i < objects.size(); i++) {
-                GLObject obj = objects[i];
-                glDeleteBuffers(1, &obj.vbo);
-                glDeleteVertexArrays(1, &obj.vao);
-            }
-
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
             RenderPass::cleanUp();
@@ -234,6 +220,7 @@ TR_NAMESPACE_BEGIN
              */
             // TODO: Implement this
 
+            profiler.beginStage("G-buffer");
             glBindFramebuffer(GL_FRAMEBUFFER, gbuffer);
 
             glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -267,16 +254,13 @@ TR_NAMESPACE_BEGIN
             glUniformMatrix4fv(projectionMatUniform, 1, GL_FALSE, &(projection[0][0]));
 
 
-            for (size_t i = 0; i < objects.size(); i++) {
-                GLObject obj = objects[i];
-                //3.
-                glBindVertexArray(obj.vao);
-                //4.
-                glDrawArrays(GL_TRIANGLES, 0, obj.nVerts);
-                //5.
-                glBindVertexArray(0);
-
-            }
+            //3.
+            glBindVertexArray(geometryVAO);
+            //4.
+            drawObjects(0, objects.size());
+            //5.
+            glBindVertexArray(0);
+            profiler.endStage();
 
             // II. SSAO pass
             // =======================================================================================
@@ -284,6 +268,7 @@ TR_NAMESPACE_BEGIN
              * 1) Bind the screen buffer (postprocess_fboScreen).
              */
             // TODO: Implement this
+            profiler.beginStage("SSAO");
             glBindFramebuffer(GL_FRAMEBUFFER, postprocess_fboScreen);
 
             glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -329,6 +314,7 @@ TR_NAMESPACE_BEGIN
             glBindVertexArray(0);
             //7.
             glBindTexture(GL_TEXTURE_2D, 0);
+            profiler.endStage();
 
             RenderPass::render();
         }
@@ -2,9 +2,17 @@
 
 #define pi 3.14159265358979323846
 
-uniform vec3 camPos;
-uniform vec3 lightPos;
-uniform vec3 lightIntensity;
+// Per-frame uniforms, shared by the shaders of the pass (see FrameUniforms in renderpass.h)
+layout(std140) uniform FrameUniforms {
+    mat4 model;
+    mat4 view;
+    mat4 projection;
+    mat4 normalMat;
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightIntensity;
+};
+
 uniform vec3 albedo;
 
 
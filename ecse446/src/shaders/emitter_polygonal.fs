@@ -10,7 +10,16 @@
 in vec3 vPos;
 in vec3 vNormal;
 
-uniform vec3 lightIntensity;
+// Per-frame uniforms, shared by the shaders of the pass (see FrameUniforms in renderpass.h)
+layout(std140) uniform FrameUniforms {
+    mat4 model;
+    mat4 view;
+    mat4 projection;
+    mat4 normalMat;
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightIntensity;
+};
 
 out vec3 color;
 
@@ -6,13 +6,21 @@
 #version 330 core
 #define PI       3.14159265358979323846   // pi
 
+// Per-frame uniforms, shared by the shaders of the pass (see FrameUniforms in renderpass.h)
+layout(std140) uniform FrameUniforms {
+    mat4 model;
+    mat4 view;
+    mat4 projection;
+    mat4 normalMat;
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightIntensity;
+};
+
 // get the desired uniforms
-uniform vec3 camPos;
 uniform vec3 rho_d;
 uniform vec3 rho_s;
 uniform float exponent;
-uniform vec3 lightPos;
-uniform vec3 lightIntensity;
 
 in vec3 vNormal;
 in vec3 vPos;
@@ -9,10 +9,16 @@
 
 
 #pragma once
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform mat4 normalMat;
+// Per-frame uniforms, shared by the shaders of the pass (see FrameUniforms in renderpass.h)
+layout(std140) uniform FrameUniforms {
+    mat4 model;
+    mat4 view;
+    mat4 projection;
+    mat4 normalMat;
+    vec3 camPos;
+    vec3 lightPos;
+    vec3 lightIntensity;
+};
 
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;